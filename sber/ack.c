@@ -0,0 +1,103 @@
+/*
+ * ack.c: SBERTASK_IOC_ACK example. Reads of SBERTASK_CH_ACK channel lease
+ * records, returned lease is redelivered in queue order, ack frees it.
+ * Run after "sudo ./start.sh": ./ack [/dev/sbertask]
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include "sbertask.h"
+
+#define REC 2
+
+static long ack(int fd, __u64 lease, __u32 flags)
+{
+	struct sbertask_ack ack;
+
+	memset(&ack, 0, sizeof(ack));
+	ack.lease = lease;
+	ack.flags = flags;
+	return ioctl(fd, SBERTASK_IOC_ACK, &ack);
+}
+
+/* Next record must be rec */
+static int expect(int fd, const char *rec)
+{
+	char buf[100];
+	int res;
+
+	res = read(fd, buf, sizeof(buf));
+	if (res == REC && !memcmp(buf, rec, REC))
+		return 0;
+	printf("ack: FAIL read \"%.*s\", expected \"%s\"\n", res > 0 ? res : 0, buf, rec);
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	const char *dev = argc > 1 ? argv[1] : "/dev/sbertask";
+	struct sbertask_config old, config;
+	int fd, ret = 1;
+	char buf[100];
+	long res;
+
+	fd = open(dev, O_RDWR | O_NONBLOCK);
+	if (fd < 0){
+		perror(dev);
+		return 1;
+	}
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+	if (ioctl(fd, SBERTASK_IOC_GET_CONFIG, &old)){
+		perror("SBERTASK_IOC_GET_CONFIG");
+		return 1;
+	}
+	config = old;
+	config.flags = SBERTASK_CH_PACKET | SBERTASK_CH_ACK;
+	config.lease_ms = 0;
+	if (ioctl(fd, SBERTASK_IOC_SET_CONFIG, &config)){
+		perror("SBERTASK_IOC_SET_CONFIG");
+		return 1;
+	}
+
+	/* Leases 1 and 2 */
+	write(fd, "m1", REC);
+	write(fd, "m2", REC);
+	if (expect(fd, "m1") || expect(fd, "m2"))
+		goto restore;
+	/* Lease 1 returns, lease 2 comes back with it, so order is kept */
+	res = ack(fd, 1, SBERTASK_ACK_RETURN);
+	if (res != 1){
+		printf("ack: FAIL return of lease 1 gave %ld\n", res);
+		goto restore;
+	}
+	/* Leases 3 and 4 */
+	if (expect(fd, "m1") || expect(fd, "m2"))
+		goto restore;
+	res = ack(fd, 2, 0);
+	if (res != -1 || errno != ENOENT){
+		printf("ack: FAIL ack of returned lease gave %ld, expected ENOENT\n", res);
+		goto restore;
+	}
+	res = ack(fd, 0, SBERTASK_ACK_UPTO);
+	if (res != 2){
+		printf("ack: FAIL ack of all leases gave %ld, expected 2\n", res);
+		goto restore;
+	}
+	res = read(fd, buf, sizeof(buf));
+	if (res != -1 || errno != EAGAIN){
+		printf("ack: FAIL acknowledged record came back\n");
+		goto restore;
+	}
+	printf("ack: OK\n");
+	ret = 0;
+restore:
+	/* Leases left after failure are freed */
+	ack(fd, 0, SBERTASK_ACK_UPTO);
+	ioctl(fd, SBERTASK_IOC_SET_CONFIG, &old);
+	close(fd);
+	return ret;
+}
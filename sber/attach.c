@@ -0,0 +1,166 @@
+/*
+ * attach.c: SBERTASK_IOC_ATTACH example. Two attaches of one name give one
+ * channel, its anon fd passed over SCM_RIGHTS works in other process.
+ * Run after "sudo ./start.sh": ./attach [/dev/sbertask]
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "sbertask.h"
+
+#define NAME "attach-example"
+#define KEY 4100
+
+/* New fd of named channel, its channel key goes to *channel */
+static int attach_name(int fd, __u64 *channel)
+{
+	struct sbertask_attach attach;
+	int chan_fd;
+
+	memset(&attach, 0, sizeof(attach));
+	strncpy(attach.name, NAME, sizeof(attach.name));
+	attach.flags = SBERTASK_ATTACH_NAME | SBERTASK_ATTACH_FD;
+	chan_fd = ioctl(fd, SBERTASK_IOC_ATTACH, &attach);
+	if (chan_fd < 0)
+		return -1;
+	*channel = attach.channel;
+	return chan_fd;
+}
+
+static int send_fd(int sock, int fd)
+{
+	char cbuf[CMSG_SPACE(sizeof(int))], byte = 0;
+	struct iovec iov = { &byte, 1 };
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	return sendmsg(sock, &msg, 0) == 1 ? 0 : -1;
+}
+
+static int recv_fd(int sock)
+{
+	char cbuf[CMSG_SPACE(sizeof(int))], byte;
+	struct iovec iov = { &byte, 1 };
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	int fd;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	if (recvmsg(sock, &msg, 0) != 1)
+		return -1;
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS)
+		return -1;
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	return fd;
+}
+
+int main(int argc, char **argv)
+{
+	const char *dev = argc > 1 ? argv[1] : "/dev/sbertask";
+	struct sbertask_attach attach;
+	int fd, a, b, w, sv[2], res, status;
+	__u64 ch_a, ch_b;
+	char buf[100];
+	pid_t pid;
+
+	fd = open(dev, O_RDWR | O_NONBLOCK);
+	if (fd < 0){
+		perror(dev);
+		return 1;
+	}
+	a = attach_name(fd, &ch_a);
+	b = attach_name(fd, &ch_b);
+	if (a < 0 || b < 0){
+		perror("SBERTASK_IOC_ATTACH");
+		return 1;
+	}
+	if (ch_a != ch_b || !(ch_a & SBERTASK_CHAN_KEYED) || !(ch_a & SBERTASK_CHAN_NAMED)){
+		printf("attach: FAIL name gave channels %llx and %llx\n",
+		       (unsigned long long)ch_a, (unsigned long long)ch_b);
+		return 1;
+	}
+	fcntl(b, F_SETFL, O_NONBLOCK);
+	while (read(b, buf, sizeof(buf)) > 0)
+		;
+
+	/* Other process writes through fd it got over unix socket */
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)){
+		perror("socketpair");
+		return 1;
+	}
+	pid = fork();
+	if (pid == 0){
+		int chan_fd = recv_fd(sv[1]);
+
+		_exit(chan_fd >= 0 && write(chan_fd, "hello", 5) == 5 ? 0 : 1);
+	}
+	send_fd(sv[0], a);
+	waitpid(pid, &status, 0);
+	res = read(b, buf, sizeof(buf));
+	if (!WIFEXITED(status) || WEXITSTATUS(status) || res != 5 || memcmp(buf, "hello", 5)){
+		printf("attach: FAIL record written through passed fd is \"%.*s\"\n", res > 0 ? res : 0, buf);
+		return 1;
+	}
+
+	/* Key out of range */
+	memset(&attach, 0, sizeof(attach));
+	attach.key = SBERTASK_CHAN_KEYED | KEY;
+	if (ioctl(fd, SBERTASK_IOC_ATTACH, &attach) != -1 || errno != EINVAL){
+		printf("attach: FAIL key with SBERTASK_CHAN_KEYED bit was taken\n");
+		return 1;
+	}
+	/* This file moves to keyed channel, fd of it reads what file writes */
+	attach.key = KEY;
+	attach.flags = SBERTASK_ATTACH_FD;
+	b = ioctl(fd, SBERTASK_IOC_ATTACH, &attach);
+	attach.flags = 0;
+	if (b < 0 || ioctl(fd, SBERTASK_IOC_ATTACH, &attach)){
+		perror("SBERTASK_IOC_ATTACH");
+		return 1;
+	}
+	fcntl(b, F_SETFL, O_NONBLOCK);
+	while (read(b, buf, sizeof(buf)) > 0)
+		;
+	write(fd, "keyed", 5);
+	res = read(b, buf, sizeof(buf));
+	if (res != 5 || memcmp(buf, "keyed", 5)){
+		printf("attach: FAIL keyed channel gave \"%.*s\"\n", res > 0 ? res : 0, buf);
+		return 1;
+	}
+	/* Producer fd is write only, it can't read and never holds broadcast data */
+	attach.flags = SBERTASK_ATTACH_FD | SBERTASK_ATTACH_WRONLY;
+	w = ioctl(fd, SBERTASK_IOC_ATTACH, &attach);
+	if (w < 0 || read(w, buf, sizeof(buf)) != -1 || errno != EBADF || write(w, "wronly", 6) != 6){
+		printf("attach: FAIL write only fd\n");
+		return 1;
+	}
+	res = read(b, buf, sizeof(buf));
+	if (res != 6 || memcmp(buf, "wronly", 6)){
+		printf("attach: FAIL write only fd wrote \"%.*s\"\n", res > 0 ? res : 0, buf);
+		return 1;
+	}
+	close(w);
+	close(fd);
+	printf("attach: OK\n");
+	return 0;
+}
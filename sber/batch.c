@@ -0,0 +1,69 @@
+/*
+ * batch.c: SBERTASK_IOC_SENDMMSG and SBERTASK_IOC_RECVMMSG example.
+ * Three records go to channel in one call and come back in one call.
+ * Run after "sudo ./start.sh": ./batch [/dev/sbertask]
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include "sbertask.h"
+
+#define NR_MSGS 3
+
+int main(int argc, char **argv)
+{
+	const char *dev = argc > 1 ? argv[1] : "/dev/sbertask";
+	const char *out[NR_MSGS] = { "one", "two", "three" };
+	char in[NR_MSGS][16], junk[1000];
+	struct sbertask_msg msgs[NR_MSGS];
+	struct sbertask_mmsg mmsg;
+	int fd, i, res;
+
+	fd = open(dev, O_RDWR | O_NONBLOCK);
+	if (fd < 0){
+		perror(dev);
+		return 1;
+	}
+	/* Leftovers of other programs */
+	while (read(fd, junk, sizeof(junk)) > 0)
+		;
+
+	memset(&mmsg, 0, sizeof(mmsg));
+	for (i = 0; i < NR_MSGS; i++){
+		msgs[i].buf = (uintptr_t)out[i];
+		msgs[i].len = strlen(out[i]);
+		msgs[i].result = 0;
+	}
+	mmsg.msgs = (uintptr_t)msgs;
+	mmsg.count = NR_MSGS;
+	res = ioctl(fd, SBERTASK_IOC_SENDMMSG, &mmsg);
+	if (res != NR_MSGS){
+		printf("batch: FAIL sendmmsg returned %d, expected %d\n", res, NR_MSGS);
+		return 1;
+	}
+
+	/* Stream channel: buffers of exact sizes split bytes back into records */
+	memset(in, 0, sizeof(in));
+	for (i = 0; i < NR_MSGS; i++){
+		msgs[i].buf = (uintptr_t)in[i];
+		msgs[i].len = strlen(out[i]);
+		msgs[i].result = 0;
+	}
+	mmsg.flags = SBERTASK_MSG_DONTWAIT;
+	res = ioctl(fd, SBERTASK_IOC_RECVMMSG, &mmsg);
+	if (res != NR_MSGS){
+		printf("batch: FAIL recvmmsg returned %d, expected %d\n", res, NR_MSGS);
+		return 1;
+	}
+	for (i = 0; i < NR_MSGS; i++)
+		if (msgs[i].result != strlen(out[i]) || strcmp(in[i], out[i])){
+			printf("batch: FAIL record %d is \"%s\", expected \"%s\"\n", i, in[i], out[i]);
+			return 1;
+		}
+	close(fd);
+	printf("batch: OK\n");
+	return 0;
+}
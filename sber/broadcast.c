@@ -0,0 +1,94 @@
+/*
+ * broadcast.c: broadcast mode example. Every reader of SBERTASK_CH_BROADCAST
+ * channel gets all records, lagging one skips them with SBERTASK_CH_DROPSLOW.
+ * Run after "sudo ./start.sh": ./broadcast [/dev/sbertask]
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include "sbertask.h"
+
+#define REC 4
+#define NR_RECS 4
+
+int main(int argc, char **argv)
+{
+	const char *dev = argc > 1 ? argv[1] : "/dev/sbertask";
+	const char *out[NR_RECS] = { "rec0", "rec1", "rec2", "rec3" };
+	struct sbertask_config old, config;
+	struct sbertask_stats before, after;
+	int fd, r1, r2, i, res, ret = 1;
+	char buf[100];
+
+	fd = open(dev, O_RDWR | O_NONBLOCK);
+	if (fd < 0){
+		perror(dev);
+		return 1;
+	}
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+	if (ioctl(fd, SBERTASK_IOC_GET_CONFIG, &old)){
+		perror("SBERTASK_IOC_GET_CONFIG");
+		return 1;
+	}
+	config = old;
+	config.flags = SBERTASK_CH_PACKET | SBERTASK_CH_BROADCAST | SBERTASK_CH_DROPSLOW;
+	config.max_record = REC;
+	config.lag_limit = 2 * REC;
+	if (ioctl(fd, SBERTASK_IOC_SET_CONFIG, &config)){
+		perror("SBERTASK_IOC_SET_CONFIG");
+		return 1;
+	}
+	/* Readers join on first read, O_RDWR producer above never does and holds nothing */
+	r1 = open(dev, O_RDONLY | O_NONBLOCK);
+	r2 = open(dev, O_RDONLY | O_NONBLOCK);
+	if (r1 < 0 || r2 < 0){
+		perror(dev);
+		goto restore;
+	}
+	if (read(r1, buf, sizeof(buf)) != -1 || read(r2, buf, sizeof(buf)) != -1){
+		printf("broadcast: FAIL readers got data written before they joined\n");
+		goto close;
+	}
+
+	write(fd, "ping", REC);
+	if (read(r1, buf, sizeof(buf)) != REC || read(r2, buf + REC, sizeof(buf) - REC) != REC ||
+	    memcmp(buf, "pingping", 2 * REC)){
+		printf("broadcast: FAIL both readers must get the record\n");
+		goto close;
+	}
+
+	/* r2 doesn't read, writer never blocks, r2 skips what is over lag_limit */
+	ioctl(fd, SBERTASK_IOC_GET_STATS, &before);
+	for (i = 0; i < NR_RECS; i++){
+		res = write(fd, out[i], REC);
+		if (res != REC){
+			printf("broadcast: FAIL write %d returned %d\n", i, res);
+			goto close;
+		}
+		read(r1, buf, sizeof(buf));
+	}
+	ioctl(fd, SBERTASK_IOC_GET_STATS, &after);
+	res = read(r2, buf, sizeof(buf));
+	if (res != REC || memcmp(buf, out[NR_RECS - 2], REC)){
+		printf("broadcast: FAIL lagging reader got %d bytes \"%.*s\", expected \"%s\"\n",
+		       res, res > 0 ? res : 0, buf, out[NR_RECS - 2]);
+		goto close;
+	}
+	if (after.lag_drops - before.lag_drops != (NR_RECS - 2) * REC){
+		printf("broadcast: FAIL lag_drops %llu, expected %d\n",
+		       (unsigned long long)(after.lag_drops - before.lag_drops), (NR_RECS - 2) * REC);
+		goto close;
+	}
+	printf("broadcast: OK\n");
+	ret = 0;
+close:
+	close(r1);
+	close(r2);
+restore:
+	ioctl(fd, SBERTASK_IOC_SET_CONFIG, &old);
+	close(fd);
+	return ret;
+}
@@ -0,0 +1,92 @@
+/*
+ * codel.c: CoDel example. Records wait in SBERTASK_CH_CODEL channel over
+ * target for longer than interval, reads drop head ones. With SBERTASK_CH_ECN
+ * they are marked instead, SBERTASK_IOC_GET_SEQ reports marks.
+ * Run after "sudo ./start.sh": ./codel [/dev/sbertask]
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include "sbertask.h"
+
+#define NR_RECS 20
+#define TARGET_US 1000
+#define INTERVAL_US 10000
+
+/* Queue NR_RECS stale records and read them all, CoDel acts between reads */
+static int run(int fd, int flags, struct sbertask_stats *diff, unsigned int *marks)
+{
+	struct sbertask_config config;
+	struct sbertask_stats before, after;
+	struct sbertask_seq seq;
+	char buf[16];
+	int i, got = 0;
+
+	if (ioctl(fd, SBERTASK_IOC_GET_CONFIG, &config))
+		return -1;
+	config.flags = SBERTASK_CH_PACKET | SBERTASK_CH_CODEL | flags;
+	config.codel_target_us = TARGET_US;
+	config.codel_interval_us = INTERVAL_US;
+	if (ioctl(fd, SBERTASK_IOC_SET_CONFIG, &config))
+		return -1;
+	ioctl(fd, SBERTASK_IOC_GET_STATS, &before);
+	for (i = 0; i < NR_RECS; i++)
+		write(fd, "rec", 3);
+	*marks = 0;
+	/* First read over target starts interval, read after it begins dropping */
+	usleep(2 * TARGET_US);
+	for (i = 0; read(fd, buf, sizeof(buf)) > 0; i++){
+		got++;
+		ioctl(fd, SBERTASK_IOC_GET_SEQ, &seq);
+		*marks += seq.marks;
+		if (i == 0)
+			usleep(2 * INTERVAL_US);
+	}
+	ioctl(fd, SBERTASK_IOC_GET_STATS, &after);
+	diff->codel_drops = after.codel_drops - before.codel_drops;
+	diff->codel_marks = after.codel_marks - before.codel_marks;
+	return got;
+}
+
+int main(int argc, char **argv)
+{
+	const char *dev = argc > 1 ? argv[1] : "/dev/sbertask";
+	struct sbertask_config old;
+	struct sbertask_stats diff;
+	unsigned int marks;
+	int fd, got, ret = 1;
+	char buf[1000];
+
+	fd = open(dev, O_RDWR | O_NONBLOCK);
+	if (fd < 0){
+		perror(dev);
+		return 1;
+	}
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+	if (ioctl(fd, SBERTASK_IOC_GET_CONFIG, &old)){
+		perror("SBERTASK_IOC_GET_CONFIG");
+		return 1;
+	}
+
+	got = run(fd, 0, &diff, &marks);
+	if (got < 0 || diff.codel_drops == 0 || got + diff.codel_drops != NR_RECS || marks){
+		printf("codel: FAIL read %d records, %llu dropped, %u marked\n",
+		       got, (unsigned long long)diff.codel_drops, marks);
+		goto restore;
+	}
+	got = run(fd, SBERTASK_CH_ECN, &diff, &marks);
+	if (got != NR_RECS || diff.codel_drops || diff.codel_marks == 0 || marks != diff.codel_marks){
+		printf("codel: FAIL ecn read %d records, %llu dropped, %llu marked, %u marks seen\n",
+		       got, (unsigned long long)diff.codel_drops, (unsigned long long)diff.codel_marks, marks);
+		goto restore;
+	}
+	printf("codel: OK\n");
+	ret = 0;
+restore:
+	ioctl(fd, SBERTASK_IOC_SET_CONFIG, &old);
+	close(fd);
+	return ret;
+}
@@ -0,0 +1,111 @@
+/*
+ * ctl.c: /dev/sbertask-control example. New single mode device is made,
+ * used and removed at runtime.
+ * Run as root after "sudo ./start.sh": sudo ./ctl
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include "sbertask.h"
+
+#define CONTROL "/dev/sbertask-control"
+#define CAPACITY 2000
+
+/* First line of sysfs attribute of device, without newline */
+static int read_attr(int index, const char *attr, char *buf, size_t len)
+{
+	char path[100];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/sys/class/sbertask/sbertask%d/%s", index, attr);
+	f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+	if (fgets(buf, len, f) == NULL)
+		buf[0] = 0;
+	buf[strcspn(buf, "\n")] = 0;
+	fclose(f);
+	return 0;
+}
+
+int main(void)
+{
+	struct sbertask_ctl_dev ctl;
+	struct sbertask_config config;
+	char dev[32], attr[32], buf[100];
+	int cfd, fd, fd2, index, i, ret = 1;
+
+	cfd = open(CONTROL, O_RDWR);
+	if (cfd < 0){
+		perror(CONTROL);
+		return 1;
+	}
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.index = -1;
+	ctl.mode = SBERTASK_MODE_SINGLE;
+	ctl.capacity = CAPACITY;
+	ctl.flags = SBERTASK_CH_PACKET;
+	index = ioctl(cfd, SBERTASK_CTL_ADD, &ctl);
+	if (index <= 0){
+		perror("SBERTASK_CTL_ADD");
+		return 1;
+	}
+	snprintf(dev, sizeof(dev), "/dev/sbertask%d", index);
+	/* devtmpfs node shows up with device */
+	for (i = 0; i < 100 && (fd = open(dev, O_RDWR | O_NONBLOCK)) < 0 && errno == ENOENT; i++)
+		usleep(10000);
+	if (fd < 0){
+		perror(dev);
+		goto remove;
+	}
+
+	if (read_attr(index, "mode", attr, sizeof(attr)) || strcmp(attr, "single")){
+		printf("ctl: FAIL mode of %s is \"%s\"\n", dev, attr);
+		goto close;
+	}
+	if (read_attr(index, "capacity", attr, sizeof(attr)) || atoi(attr) != CAPACITY){
+		printf("ctl: FAIL capacity of %s is \"%s\"\n", dev, attr);
+		goto close;
+	}
+	if (ioctl(fd, SBERTASK_IOC_GET_CONFIG, &config) || config.flags != SBERTASK_CH_PACKET){
+		printf("ctl: FAIL channel of %s doesn't have device flags\n", dev);
+		goto close;
+	}
+	/* Single mode: second open fails */
+	fd2 = open(dev, O_RDWR | O_NONBLOCK);
+	if (fd2 >= 0 || errno != EBUSY){
+		printf("ctl: FAIL second open of single mode device\n");
+		goto close;
+	}
+	write(fd, "data", 4);
+	if (read(fd, buf, sizeof(buf)) != 4 || memcmp(buf, "data", 4)){
+		printf("ctl: FAIL %s didn't give written record back\n", dev);
+		goto close;
+	}
+	/* Device in use stays */
+	ctl.index = index;
+	if (ioctl(cfd, SBERTASK_CTL_REMOVE, &ctl) != -1 || errno != EBUSY){
+		printf("ctl: FAIL device in use was removed\n");
+		goto close;
+	}
+	ret = 0;
+close:
+	close(fd);
+remove:
+	ctl.index = index;
+	if (ioctl(cfd, SBERTASK_CTL_REMOVE, &ctl)){
+		perror("SBERTASK_CTL_REMOVE");
+		ret = 1;
+	} else if (open(dev, O_RDWR | O_NONBLOCK) >= 0){
+		printf("ctl: FAIL %s opens after removal\n", dev);
+		ret = 1;
+	}
+	if (!ret)
+		printf("ctl: OK\n");
+	close(cfd);
+	return ret;
+}
@@ -0,0 +1,77 @@
+/*
+ * dispatch.c: dispatch mode example. Pool of readers shares SBERTASK_CH_DISPATCH
+ * channel, each reader takes one chunk of queued data.
+ * Run after "sudo ./start.sh": ./dispatch [/dev/sbertask]
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include "sbertask.h"
+
+#define CHUNK 4
+#define READERS 3
+
+int main(int argc, char **argv)
+{
+	const char *dev = argc > 1 ? argv[1] : "/dev/sbertask";
+	struct sbertask_config old, config;
+	int fd, i, res, status, ret = 1;
+	char buf[100];
+	pid_t pids[READERS];
+
+	fd = open(dev, O_RDWR | O_NONBLOCK);
+	if (fd < 0){
+		perror(dev);
+		return 1;
+	}
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+	if (ioctl(fd, SBERTASK_IOC_GET_CONFIG, &old)){
+		perror("SBERTASK_IOC_GET_CONFIG");
+		return 1;
+	}
+	config = old;
+	config.flags = SBERTASK_CH_DISPATCH;
+	config.chunk = CHUNK;
+	if (ioctl(fd, SBERTASK_IOC_SET_CONFIG, &config)){
+		perror("SBERTASK_IOC_SET_CONFIG");
+		return 1;
+	}
+
+	/* One reader: big buffer still gets one chunk */
+	write(fd, "abcdefgh", 8);
+	res = read(fd, buf, sizeof(buf));
+	if (res != CHUNK || memcmp(buf, "abcd", CHUNK)){
+		printf("dispatch: FAIL read %d bytes, expected %d\n", res, CHUNK);
+		goto restore;
+	}
+	read(fd, buf, sizeof(buf));
+
+	/* Pool: one write feeds every sleeping reader with own chunk */
+	fcntl(fd, F_SETFL, 0);
+	for (i = 0; i < READERS; i++){
+		pids[i] = fork();
+		if (pids[i] == 0)
+			_exit(read(fd, buf, sizeof(buf)) == CHUNK ? 0 : 1);
+	}
+	usleep(50000);
+	write(fd, "0123456789ab", CHUNK * READERS);
+	ret = 0;
+	for (i = 0; i < READERS; i++){
+		waitpid(pids[i], &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			ret = 1;
+	}
+	if (ret){
+		printf("dispatch: FAIL reader of pool didn't get one chunk\n");
+		goto restore;
+	}
+	printf("dispatch: OK\n");
+restore:
+	ioctl(fd, SBERTASK_IOC_SET_CONFIG, &old);
+	close(fd);
+	return ret;
+}
@@ -0,0 +1,83 @@
+/*
+ * eventfd.c: SBERTASK_IOC_SET_EVENTFD example. eventfd is signalled once
+ * when queue becomes not empty and once when it frees up to threshold.
+ * Run after "sudo ./start.sh": ./eventfd [/dev/sbertask]
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include "sbertask.h"
+
+/* Signals since last call, 0 if none */
+static uint64_t events(int efd)
+{
+	uint64_t count;
+
+	if (read(efd, &count, sizeof(count)) != sizeof(count))
+		return 0;
+	return count;
+}
+
+int main(int argc, char **argv)
+{
+	const char *dev = argc > 1 ? argv[1] : "/dev/sbertask";
+	struct sbertask_eventfd ev;
+	uint64_t count;
+	int fd, efd, ret = 1;
+	char buf[100];
+
+	fd = open(dev, O_RDWR | O_NONBLOCK);
+	if (fd < 0){
+		perror(dev);
+		return 1;
+	}
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+	efd = eventfd(0, EFD_NONBLOCK);
+	if (efd < 0){
+		perror("eventfd");
+		return 1;
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.fd = efd;
+	ev.events = SBERTASK_EV_DATA | SBERTASK_EV_SPACE;
+	ev.space_threshold = 0;		/* queue depth: all of queue is free */
+	if (ioctl(fd, SBERTASK_IOC_SET_EVENTFD, &ev)){
+		perror("SBERTASK_IOC_SET_EVENTFD");
+		return 1;
+	}
+
+	write(fd, "0123456789", 10);
+	count = events(efd);
+	if (count != 1){
+		printf("eventfd: FAIL %llu signals when queue became not empty, expected 1\n",
+		       (unsigned long long)count);
+		goto unregister;
+	}
+	/* Edge triggered: queue wasn't empty, no signal */
+	write(fd, "0123456789", 10);
+	count = events(efd);
+	if (count != 0){
+		printf("eventfd: FAIL %llu signals on write to not empty queue\n", (unsigned long long)count);
+		goto unregister;
+	}
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+	count = events(efd);
+	if (count != 1){
+		printf("eventfd: FAIL %llu signals when queue was freed, expected 1\n", (unsigned long long)count);
+		goto unregister;
+	}
+	printf("eventfd: OK\n");
+	ret = 0;
+unregister:
+	ev.fd = -1;
+	ioctl(fd, SBERTASK_IOC_SET_EVENTFD, &ev);
+	close(efd);
+	close(fd);
+	return ret;
+}
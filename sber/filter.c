@@ -0,0 +1,150 @@
+/*
+ * filter.c: SBERTASK_IOC_SET_FILTER example. BPF socket filter looks at first
+ * byte of each record: 'd' is dropped, 'r' goes to other channel, rest pass.
+ * Loading BPF program needs root (or CAP_BPF).
+ * Run after "sudo ./start.sh": sudo ./filter [/dev/sbertask]
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#include "sbertask.h"
+
+#define REDIRECT_KEY 4000
+
+#define INSN(c, d, s, o, i)	((struct bpf_insn){ .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) })
+
+static int load_filter(void)
+{
+	struct bpf_insn prog[] = {
+		INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0),	/* r6 = skb, for ld_abs */
+		INSN(BPF_LD | BPF_ABS | BPF_B, 0, 0, 0, 0),			/* r0 = first byte */
+		INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 3, 'd'),
+		INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 4, 'r'),
+		INSN(BPF_ALU | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, SBERTASK_BPF_PASS),
+		INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+		INSN(BPF_ALU | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, SBERTASK_BPF_DROP),
+		INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+		INSN(BPF_ALU | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, (int32_t)SBERTASK_BPF_REDIRECT(0)),
+		INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+	};
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_SOCKET_FILTER;
+	attr.insns = (uintptr_t)prog;
+	attr.insn_cnt = sizeof(prog) / sizeof(prog[0]);
+	attr.license = (uintptr_t)"GPL";
+	return syscall(SYS_bpf, BPF_PROG_LOAD, &attr, sizeof(attr));
+}
+
+int main(int argc, char **argv)
+{
+	const char *dev = argc > 1 ? argv[1] : "/dev/sbertask";
+	struct sbertask_config old, config;
+	struct sbertask_stats before, after;
+	struct sbertask_filter filter;
+	struct sbertask_attach attach;
+	int fd, rfd, prog_fd, res, ret = 1;
+	char buf[100];
+
+	fd = open(dev, O_RDWR | O_NONBLOCK);
+	if (fd < 0){
+		perror(dev);
+		return 1;
+	}
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+	if (ioctl(fd, SBERTASK_IOC_GET_CONFIG, &old)){
+		perror("SBERTASK_IOC_GET_CONFIG");
+		return 1;
+	}
+	config = old;
+	config.flags = SBERTASK_CH_PACKET;
+	if (ioctl(fd, SBERTASK_IOC_SET_CONFIG, &config)){
+		perror("SBERTASK_IOC_SET_CONFIG");
+		return 1;
+	}
+	/* Redirect target */
+	memset(&attach, 0, sizeof(attach));
+	attach.key = REDIRECT_KEY;
+	attach.flags = SBERTASK_ATTACH_FD;
+	rfd = ioctl(fd, SBERTASK_IOC_ATTACH, &attach);
+	if (rfd < 0){
+		perror("SBERTASK_IOC_ATTACH");
+		goto restore;
+	}
+	fcntl(rfd, F_SETFL, O_NONBLOCK);
+	while (read(rfd, buf, sizeof(buf)) > 0)
+		;
+	prog_fd = load_filter();
+	if (prog_fd < 0){
+		perror("BPF_PROG_LOAD");
+		goto close;
+	}
+	memset(&filter, 0, sizeof(filter));
+	filter.fd = prog_fd;
+	filter.count = 1;
+	filter.targets = (uintptr_t)&attach.channel;
+	if (ioctl(fd, SBERTASK_IOC_SET_FILTER, &filter)){
+		perror("SBERTASK_IOC_SET_FILTER");
+		goto close;
+	}
+
+	ioctl(fd, SBERTASK_IOC_GET_STATS, &before);
+	/* Dropped and redirected records look written to writer */
+	if (write(fd, "drop", 4) != 4 || write(fd, "redir", 5) != 5 || write(fd, "pass", 4) != 4){
+		printf("filter: FAIL write of filtered record\n");
+		goto detach;
+	}
+	ioctl(fd, SBERTASK_IOC_GET_STATS, &after);
+	res = read(fd, buf, sizeof(buf));
+	if (res != 4 || memcmp(buf, "pass", 4) || read(fd, buf, sizeof(buf)) != -1){
+		printf("filter: FAIL channel must hold only \"pass\"\n");
+		goto detach;
+	}
+	res = read(rfd, buf, sizeof(buf));
+	if (res != 5 || memcmp(buf, "redir", 5)){
+		printf("filter: FAIL target channel must hold \"redir\"\n");
+		goto detach;
+	}
+	if (after.filter_drops - before.filter_drops != 1 || after.filter_redirects - before.filter_redirects != 1){
+		printf("filter: FAIL filter_drops %llu, filter_redirects %llu, expected 1 and 1\n",
+		       (unsigned long long)(after.filter_drops - before.filter_drops),
+		       (unsigned long long)(after.filter_redirects - before.filter_redirects));
+		goto detach;
+	}
+
+	/* Without filter record passes */
+	filter.fd = -1;
+	filter.count = 0;
+	if (ioctl(fd, SBERTASK_IOC_SET_FILTER, &filter)){
+		perror("SBERTASK_IOC_SET_FILTER");
+		goto close;
+	}
+	write(fd, "drop", 4);
+	res = read(fd, buf, sizeof(buf));
+	if (res != 4 || memcmp(buf, "drop", 4)){
+		printf("filter: FAIL detached filter still drops\n");
+		goto close;
+	}
+	printf("filter: OK\n");
+	ret = 0;
+	goto close;
+detach:
+	filter.fd = -1;
+	filter.count = 0;
+	ioctl(fd, SBERTASK_IOC_SET_FILTER, &filter);
+close:
+	if (prog_fd >= 0)
+		close(prog_fd);
+	close(rfd);
+restore:
+	ioctl(fd, SBERTASK_IOC_SET_CONFIG, &old);
+	close(fd);
+	return ret;
+}
@@ -0,0 +1,91 @@
+/*
+ * gather.c: SBERTASK_IOC_GATHER example. Three keyed channels, two of them
+ * have data, one call reads both.
+ * Run after "sudo ./start.sh": ./gather [/dev/sbertask]
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include "sbertask.h"
+
+#define NR_CHANS 3
+#define KEY_BASE 3400
+
+/* New fd of keyed channel, its channel key goes to *channel */
+static int attach_fd(int fd, __u64 key, __u64 *channel)
+{
+	struct sbertask_attach attach;
+	char junk[1000];
+	int chan_fd;
+
+	memset(&attach, 0, sizeof(attach));
+	attach.key = key;
+	attach.flags = SBERTASK_ATTACH_FD | SBERTASK_ATTACH_CLOEXEC;
+	chan_fd = ioctl(fd, SBERTASK_IOC_ATTACH, &attach);
+	if (chan_fd < 0)
+		return -1;
+	*channel = attach.channel;
+	fcntl(chan_fd, F_SETFL, O_NONBLOCK);
+	while (read(chan_fd, junk, sizeof(junk)) > 0)
+		;
+	return chan_fd;
+}
+
+int main(int argc, char **argv)
+{
+	const char *dev = argc > 1 ? argv[1] : "/dev/sbertask";
+	const char *out[NR_CHANS] = { "first", NULL, "third" };
+	struct sbertask_gather_chan chans[NR_CHANS];
+	struct sbertask_gather gather;
+	char in[NR_CHANS][16];
+	int fd, fds[NR_CHANS], i, res;
+
+	fd = open(dev, O_RDWR | O_NONBLOCK);
+	if (fd < 0){
+		perror(dev);
+		return 1;
+	}
+	memset(chans, 0, sizeof(chans));
+	memset(in, 0, sizeof(in));
+	for (i = 0; i < NR_CHANS; i++){
+		fds[i] = attach_fd(fd, KEY_BASE + i, &chans[i].channel);
+		if (fds[i] < 0){
+			perror("SBERTASK_IOC_ATTACH");
+			return 1;
+		}
+		chans[i].buf = (uintptr_t)in[i];
+		chans[i].len = sizeof(in[i]) - 1;
+		if (out[i])
+			write(fds[i], out[i], strlen(out[i]));
+	}
+
+	memset(&gather, 0, sizeof(gather));
+	gather.chans = (uintptr_t)chans;
+	gather.count = NR_CHANS;
+	gather.flags = SBERTASK_MSG_DONTWAIT;
+	res = ioctl(fd, SBERTASK_IOC_GATHER, &gather);
+	if (res != 2){
+		printf("gather: FAIL returned %d, expected 2 ready channels\n", res);
+		return 1;
+	}
+	for (i = 0; i < NR_CHANS; i++)
+		if (chans[i].result != (out[i] ? strlen(out[i]) : 0) || strcmp(in[i], out[i] ? out[i] : "")){
+			printf("gather: FAIL channel %d gave %u bytes \"%s\"\n", i, chans[i].result, in[i]);
+			return 1;
+		}
+	/* All read, nothing to wait for */
+	res = ioctl(fd, SBERTASK_IOC_GATHER, &gather);
+	if (res != -1 || errno != EAGAIN){
+		printf("gather: FAIL empty channels returned %d, expected EAGAIN\n", res);
+		return 1;
+	}
+	for (i = 0; i < NR_CHANS; i++)
+		close(fds[i]);
+	close(fd);
+	printf("gather: OK\n");
+	return 0;
+}
@@ -0,0 +1,103 @@
+/*
+ * group.c: consumer group example. Two readers of SBERTASK_CH_GROUP channel
+ * share its partitions, records of one key go to one reader in order.
+ * Run after "sudo ./start.sh": ./group [/dev/sbertask]
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include "sbertask.h"
+
+#define PARTS 4
+#define NR_KEYS 8
+#define PER_KEY 3
+
+int main(int argc, char **argv)
+{
+	const char *dev = argc > 1 ? argv[1] : "/dev/sbertask";
+	struct sbertask_config old, config;
+	struct sbertask_group g[2];
+	int fd, r[2], owner[NR_KEYS], next[NR_KEYS];
+	int i, j, res, got = 0, ret = 1;
+	char buf[100], rec[2];
+
+	fd = open(dev, O_RDWR | O_NONBLOCK);
+	if (fd < 0){
+		perror(dev);
+		return 1;
+	}
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+	if (ioctl(fd, SBERTASK_IOC_GET_CONFIG, &old)){
+		perror("SBERTASK_IOC_GET_CONFIG");
+		return 1;
+	}
+	config = old;
+	config.flags = SBERTASK_CH_PACKET | SBERTASK_CH_GROUP;
+	config.key_bytes = 1;
+	config.partitions = PARTS;
+	if (ioctl(fd, SBERTASK_IOC_SET_CONFIG, &config)){
+		perror("SBERTASK_IOC_SET_CONFIG");
+		return 1;
+	}
+	r[0] = open(dev, O_RDONLY | O_NONBLOCK);
+	r[1] = open(dev, O_RDONLY | O_NONBLOCK);
+	if (r[0] < 0 || r[1] < 0){
+		perror(dev);
+		goto restore;
+	}
+
+	/* Readers join on first read, producer which never reads doesn't */
+	for (i = 0; i < 2; i++)
+		read(r[i], buf, sizeof(buf));
+	for (i = 0; i < 2; i++)
+		if (ioctl(r[i], SBERTASK_IOC_GET_GROUP, &g[i])){
+			perror("SBERTASK_IOC_GET_GROUP");
+			goto close;
+		}
+	if (g[0].members != 2 || g[0].partitions != PARTS || (g[0].parts & g[1].parts) ||
+	    (g[0].parts | g[1].parts) != (1ULL << PARTS) - 1){
+		printf("group: FAIL %u members, partitions %llx and %llx\n", g[0].members,
+		       (unsigned long long)g[0].parts, (unsigned long long)g[1].parts);
+		goto close;
+	}
+
+	/* Record is key letter and its number for that key */
+	for (j = 0; j < PER_KEY; j++)
+		for (i = 0; i < NR_KEYS; i++){
+			rec[0] = 'a' + i;
+			rec[1] = '0' + j;
+			write(fd, rec, 2);
+		}
+	for (i = 0; i < NR_KEYS; i++){
+		owner[i] = -1;
+		next[i] = 0;
+	}
+	for (j = 0; j < 2; j++)
+		while ((res = read(r[j], buf, sizeof(buf))) > 0){
+			i = buf[0] - 'a';
+			if (res != 2 || i < 0 || i >= NR_KEYS || (owner[i] >= 0 && owner[i] != j) ||
+			    buf[1] != '0' + next[i]){
+				printf("group: FAIL reader %d got \"%.*s\" out of order or of other reader\n", j, res, buf);
+				goto close;
+			}
+			owner[i] = j;
+			next[i]++;
+			got++;
+		}
+	if (got != NR_KEYS * PER_KEY){
+		printf("group: FAIL readers got %d records, expected %d\n", got, NR_KEYS * PER_KEY);
+		goto close;
+	}
+	printf("group: OK\n");
+	ret = 0;
+close:
+	close(r[0]);
+	close(r[1]);
+restore:
+	ioctl(fd, SBERTASK_IOC_SET_CONFIG, &old);
+	close(fd);
+	return ret;
+}
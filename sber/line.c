@@ -0,0 +1,70 @@
+/*
+ * line.c: line mode example. Reads return whole lines ended by delimiter,
+ * unfinished line waits for its end.
+ * Run after "sudo ./start.sh": ./line [/dev/sbertask]
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include "sbertask.h"
+
+int main(int argc, char **argv)
+{
+	const char *dev = argc > 1 ? argv[1] : "/dev/sbertask";
+	struct sbertask_config old, config;
+	char buf[100];
+	int fd, res, ret = 1;
+
+	fd = open(dev, O_RDWR | O_NONBLOCK);
+	if (fd < 0){
+		perror(dev);
+		return 1;
+	}
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+	if (ioctl(fd, SBERTASK_IOC_GET_CONFIG, &old)){
+		perror("SBERTASK_IOC_GET_CONFIG");
+		return 1;
+	}
+	config = old;
+	config.flags = SBERTASK_CH_DELIM;
+	config.delimiter = ';';
+	if (ioctl(fd, SBERTASK_IOC_SET_CONFIG, &config)){
+		perror("SBERTASK_IOC_SET_CONFIG");
+		return 1;
+	}
+
+	write(fd, "ab;cd", 5);
+	write(fd, "e;f", 3);
+	res = read(fd, buf, sizeof(buf));
+	if (res != 3 || memcmp(buf, "ab;", 3)){
+		printf("line: FAIL first read returned %d bytes, expected \"ab;\"\n", res);
+		goto restore;
+	}
+	/* Line may come in several writes */
+	res = read(fd, buf, sizeof(buf));
+	if (res != 4 || memcmp(buf, "cde;", 4)){
+		printf("line: FAIL second read returned %d bytes, expected \"cde;\"\n", res);
+		goto restore;
+	}
+	res = read(fd, buf, sizeof(buf));
+	if (res != -1 || errno != EAGAIN){
+		printf("line: FAIL unfinished line was read\n");
+		goto restore;
+	}
+	write(fd, ";", 1);
+	res = read(fd, buf, sizeof(buf));
+	if (res != 2 || memcmp(buf, "f;", 2)){
+		printf("line: FAIL finished line read returned %d bytes, expected \"f;\"\n", res);
+		goto restore;
+	}
+	printf("line: OK\n");
+	ret = 0;
+restore:
+	ioctl(fd, SBERTASK_IOC_SET_CONFIG, &old);
+	close(fd);
+	return ret;
+}
@@ -0,0 +1,127 @@
+/*
+ * logseek.c: log mode example. SBERTASK_CH_LOG channel keeps last retain_bytes,
+ * reader replays them with lseek() and SBERTASK_IOC_SEEK.
+ * Run after "sudo ./start.sh": ./logseek [/dev/sbertask]
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include "sbertask.h"
+
+#define REC 4
+#define NR_RECS 5
+#define KEPT 3
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+	const char *dev = argc > 1 ? argv[1] : "/dev/sbertask";
+	const char *out[NR_RECS] = { "rec0", "rec1", "rec2", "rec3", "rec4" };
+	struct sbertask_config old, config;
+	struct sbertask_seek seek;
+	int64_t before_rec3 = 0;
+	int fd, wfd, rfd = -1, i, res, ret = 1;
+	char buf[100];
+
+	fd = open(dev, O_RDWR | O_NONBLOCK);
+	if (fd < 0){
+		perror(dev);
+		return 1;
+	}
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+	if (ioctl(fd, SBERTASK_IOC_GET_CONFIG, &old)){
+		perror("SBERTASK_IOC_GET_CONFIG");
+		return 1;
+	}
+	config = old;
+	config.flags = SBERTASK_CH_PACKET | SBERTASK_CH_TSTAMP | SBERTASK_CH_LOG;
+	config.max_record = REC;
+	config.retain_bytes = KEPT * REC;
+	config.retain_ms = 0;
+	if (ioctl(fd, SBERTASK_IOC_SET_CONFIG, &config)){
+		perror("SBERTASK_IOC_SET_CONFIG");
+		return 1;
+	}
+
+	/* Producer has no cursor, log drops oldest records and never blocks it */
+	wfd = open(dev, O_WRONLY | O_NONBLOCK);
+	if (wfd < 0){
+		perror(dev);
+		goto restore;
+	}
+	for (i = 0; i < NR_RECS; i++){
+		if (i == NR_RECS - KEPT + 1)
+			before_rec3 = now_ns();
+		if (write(wfd, out[i], REC) != REC){
+			printf("logseek: FAIL write %d\n", i);
+			goto close;
+		}
+		usleep(1000);
+	}
+	if (lseek(wfd, 0, SEEK_SET) != -1 || errno != EBADF){
+		printf("logseek: FAIL write-only file could seek\n");
+		goto close;
+	}
+
+	/* Consumer started late replays what log kept */
+	rfd = open(dev, O_RDONLY | O_NONBLOCK);
+	memset(&seek, 0, sizeof(seek));
+	seek.flags = SBERTASK_SEEK_QUERY;
+	if (rfd < 0 || ioctl(rfd, SBERTASK_IOC_SEEK, &seek)){
+		perror("SBERTASK_IOC_SEEK");
+		goto close;
+	}
+	if (seek.tail - seek.head != KEPT * REC || seek.offset != seek.tail){
+		printf("logseek: FAIL log keeps %llu bytes, cursor %llu of tail %llu\n",
+		       (unsigned long long)(seek.tail - seek.head), (unsigned long long)seek.offset,
+		       (unsigned long long)seek.tail);
+		goto close;
+	}
+	if (lseek(rfd, seek.head, SEEK_SET) != (off_t)seek.head){
+		perror("lseek");
+		goto close;
+	}
+	res = read(rfd, buf, sizeof(buf));
+	if (res != REC || memcmp(buf, out[NR_RECS - KEPT], REC)){
+		printf("logseek: FAIL oldest kept record is \"%.*s\", expected \"%s\"\n",
+		       res > 0 ? res : 0, buf, out[NR_RECS - KEPT]);
+		goto close;
+	}
+
+	memset(&seek, 0, sizeof(seek));
+	seek.flags = SBERTASK_SEEK_TSTAMP;
+	seek.tstamp_ns = before_rec3;
+	if (ioctl(rfd, SBERTASK_IOC_SEEK, &seek)){
+		perror("SBERTASK_IOC_SEEK");
+		goto close;
+	}
+	res = read(rfd, buf, sizeof(buf));
+	if (res != REC || memcmp(buf, out[NR_RECS - KEPT + 1], REC)){
+		printf("logseek: FAIL record at timestamp is \"%.*s\", expected \"%s\"\n",
+		       res > 0 ? res : 0, buf, out[NR_RECS - KEPT + 1]);
+		goto close;
+	}
+	printf("logseek: OK\n");
+	ret = 0;
+close:
+	if (rfd >= 0)
+		close(rfd);
+	close(wfd);
+restore:
+	ioctl(fd, SBERTASK_IOC_SET_CONFIG, &old);
+	close(fd);
+	return ret;
+}
@@ -0,0 +1,82 @@
+/*
+ * lowlat.c: low latency mode example. Reader of SBERTASK_CH_LOWLAT channel
+ * spins before sleep, SBERTASK_IOC_GET_STATS counts its spins.
+ * Run after "sudo ./start.sh": ./lowlat [/dev/sbertask]
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include "sbertask.h"
+
+#define ROUNDS 100
+
+int main(int argc, char **argv)
+{
+	const char *dev = argc > 1 ? argv[1] : "/dev/sbertask";
+	struct sbertask_config old, config;
+	struct sbertask_stats before, after;
+	char buf[100];
+	int fd, i, ret = 1;
+	pid_t pid;
+
+	fd = open(dev, O_RDWR | O_NONBLOCK);
+	if (fd < 0){
+		perror(dev);
+		return 1;
+	}
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+	if (ioctl(fd, SBERTASK_IOC_GET_CONFIG, &old)){
+		perror("SBERTASK_IOC_GET_CONFIG");
+		return 1;
+	}
+	config = old;
+	config.flags = SBERTASK_CH_LOWLAT;
+	config.spin_us = 1000;
+	if (ioctl(fd, SBERTASK_IOC_SET_CONFIG, &config)){
+		perror("SBERTASK_IOC_SET_CONFIG");
+		return 1;
+	}
+	fcntl(fd, F_SETFL, 0);
+	ioctl(fd, SBERTASK_IOC_GET_STATS, &before);
+
+	/* Ping: child writes a byte soon after reader found queue empty */
+	pid = fork();
+	if (pid == 0){
+		for (i = 0; i < ROUNDS; i++){
+			usleep(50);
+			write(fd, "x", 1);
+		}
+		_exit(0);
+	}
+	for (i = 0; i < ROUNDS; i++)
+		if (read(fd, buf, 1) != 1){
+			printf("lowlat: FAIL read %d\n", i);
+			waitpid(pid, NULL, 0);
+			goto restore;
+		}
+	waitpid(pid, NULL, 0);
+
+	if (ioctl(fd, SBERTASK_IOC_GET_STATS, &after)){
+		perror("SBERTASK_IOC_GET_STATS");
+		goto restore;
+	}
+	if (after.rx_spins == before.rx_spins || after.rx_spin_hits < before.rx_spin_hits ||
+	    after.rx_spin_hits - before.rx_spin_hits > after.rx_spins - before.rx_spins){
+		printf("lowlat: FAIL rx_spins %llu, rx_spin_hits %llu\n",
+		       (unsigned long long)(after.rx_spins - before.rx_spins),
+		       (unsigned long long)(after.rx_spin_hits - before.rx_spin_hits));
+		goto restore;
+	}
+	printf("lowlat: OK, %llu of %llu reader spins ended without sleep\n",
+	       (unsigned long long)(after.rx_spin_hits - before.rx_spin_hits),
+	       (unsigned long long)(after.rx_spins - before.rx_spins));
+	ret = 0;
+restore:
+	ioctl(fd, SBERTASK_IOC_SET_CONFIG, &old);
+	close(fd);
+	return ret;
+}
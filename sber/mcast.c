@@ -0,0 +1,99 @@
+/*
+ * mcast.c: SBERTASK_IOC_MCAST example. One record goes to two channels,
+ * full channel and missing one get own errors.
+ * Run after "sudo ./start.sh": ./mcast [/dev/sbertask]
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include "sbertask.h"
+
+#define NR_CHANS 4
+#define KEY_BASE 4300
+#define KEY_MISSING 4399
+
+/* New fd of keyed channel, its channel key goes to *channel */
+static int attach_fd(int fd, __u64 key, __u64 *channel)
+{
+	struct sbertask_attach attach;
+	char junk[1000];
+	int chan_fd;
+
+	memset(&attach, 0, sizeof(attach));
+	attach.key = key;
+	attach.flags = SBERTASK_ATTACH_FD | SBERTASK_ATTACH_CLOEXEC;
+	chan_fd = ioctl(fd, SBERTASK_IOC_ATTACH, &attach);
+	if (chan_fd < 0)
+		return -1;
+	*channel = attach.channel;
+	fcntl(chan_fd, F_SETFL, O_NONBLOCK);
+	while (read(chan_fd, junk, sizeof(junk)) > 0)
+		;
+	return chan_fd;
+}
+
+int main(int argc, char **argv)
+{
+	const char *dev = argc > 1 ? argv[1] : "/dev/sbertask";
+	const __s32 expected[NR_CHANS] = { 4, 4, -EAGAIN, -ENOENT };
+	struct sbertask_mcast mcast;
+	__u64 channels[NR_CHANS];
+	__s32 results[NR_CHANS];
+	int fd, fds[NR_CHANS - 1], i, res, ret = 1;
+	char buf[1000];
+
+	fd = open(dev, O_RDWR | O_NONBLOCK);
+	if (fd < 0){
+		perror(dev);
+		return 1;
+	}
+	for (i = 0; i < NR_CHANS - 1; i++){
+		fds[i] = attach_fd(fd, KEY_BASE + i, &channels[i]);
+		if (fds[i] < 0){
+			perror("SBERTASK_IOC_ATTACH");
+			return 1;
+		}
+	}
+	channels[NR_CHANS - 1] = SBERTASK_CHAN_KEYED | KEY_MISSING;
+	/* Third channel is full */
+	memset(buf, 'x', sizeof(buf));
+	while (write(fds[2], buf, sizeof(buf)) > 0)
+		;
+
+	memset(&mcast, 0, sizeof(mcast));
+	mcast.buf = (uintptr_t)"news";
+	mcast.len = 4;
+	mcast.count = NR_CHANS;
+	mcast.channels = (uintptr_t)channels;
+	mcast.results = (uintptr_t)results;
+	res = ioctl(fd, SBERTASK_IOC_MCAST, &mcast);
+	if (res != 2){
+		printf("mcast: FAIL returned %d, expected 2 channels\n", res);
+		goto close;
+	}
+	for (i = 0; i < NR_CHANS; i++)
+		if (results[i] != expected[i]){
+			printf("mcast: FAIL channel %d result %d, expected %d\n", i, results[i], expected[i]);
+			goto close;
+		}
+	for (i = 0; i < 2; i++){
+		res = read(fds[i], buf, sizeof(buf));
+		if (res != 4 || memcmp(buf, "news", 4)){
+			printf("mcast: FAIL channel %d holds \"%.*s\"\n", i, res > 0 ? res : 0, buf);
+			goto close;
+		}
+	}
+	printf("mcast: OK\n");
+	ret = 0;
+close:
+	while (read(fds[2], buf, sizeof(buf)) > 0)
+		;
+	for (i = 0; i < NR_CHANS - 1; i++)
+		close(fds[i]);
+	close(fd);
+	return ret;
+}
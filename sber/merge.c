@@ -0,0 +1,108 @@
+/*
+ * merge.c: SBERTASK_IOC_MERGE example. Records written to two channels in
+ * turn come back from one call in write order.
+ * Run after "sudo ./start.sh": ./merge [/dev/sbertask]
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include "sbertask.h"
+
+#define NR_CHANS 2
+#define NR_MSGS 4
+#define KEY_BASE 3500
+
+/* New fd of keyed SBERTASK_CH_TSTAMP channel, its channel key goes to *channel */
+static int attach_fd(int fd, __u64 key, __u64 *channel)
+{
+	struct sbertask_attach attach;
+	struct sbertask_config config;
+	char junk[1000];
+	int chan_fd;
+
+	memset(&attach, 0, sizeof(attach));
+	attach.key = key;
+	attach.flags = SBERTASK_ATTACH_FD | SBERTASK_ATTACH_CLOEXEC;
+	chan_fd = ioctl(fd, SBERTASK_IOC_ATTACH, &attach);
+	if (chan_fd < 0)
+		return -1;
+	*channel = attach.channel;
+	fcntl(chan_fd, F_SETFL, O_NONBLOCK);
+	while (read(chan_fd, junk, sizeof(junk)) > 0)
+		;
+	if (ioctl(chan_fd, SBERTASK_IOC_GET_CONFIG, &config))
+		return -1;
+	config.flags = SBERTASK_CH_PACKET | SBERTASK_CH_TSTAMP;
+	if (ioctl(chan_fd, SBERTASK_IOC_SET_CONFIG, &config))
+		return -1;
+	return chan_fd;
+}
+
+int main(int argc, char **argv)
+{
+	const char *dev = argc > 1 ? argv[1] : "/dev/sbertask";
+	const char *out[NR_MSGS] = { "a1", "b1", "a2", "b2" };
+	struct sbertask_msg msgs[NR_MSGS];
+	struct sbertask_tstamp tstamps[NR_MSGS];
+	struct sbertask_merge merge;
+	__u64 channels[NR_CHANS], sources[NR_MSGS];
+	char in[NR_MSGS][16];
+	int fd, fds[NR_CHANS], i, res;
+
+	fd = open(dev, O_RDWR | O_NONBLOCK);
+	if (fd < 0){
+		perror(dev);
+		return 1;
+	}
+	for (i = 0; i < NR_CHANS; i++){
+		fds[i] = attach_fd(fd, KEY_BASE + i, &channels[i]);
+		if (fds[i] < 0){
+			perror("attach");
+			return 1;
+		}
+	}
+	/* a* go to first channel, b* to second, interleaved in time */
+	for (i = 0; i < NR_MSGS; i++){
+		write(fds[i % NR_CHANS], out[i], strlen(out[i]));
+		usleep(1000);
+	}
+
+	memset(in, 0, sizeof(in));
+	for (i = 0; i < NR_MSGS; i++){
+		msgs[i].buf = (uintptr_t)in[i];
+		msgs[i].len = sizeof(in[i]) - 1;
+		msgs[i].result = 0;
+	}
+	memset(&merge, 0, sizeof(merge));
+	merge.channels = (uintptr_t)channels;
+	merge.count = NR_CHANS;
+	merge.flags = SBERTASK_MSG_DONTWAIT;
+	merge.msgs = (uintptr_t)msgs;
+	merge.msg_count = NR_MSGS;
+	merge.sources = (uintptr_t)sources;
+	merge.tstamps = (uintptr_t)tstamps;
+	res = ioctl(fd, SBERTASK_IOC_MERGE, &merge);
+	if (res != NR_MSGS){
+		printf("merge: FAIL returned %d, expected %d\n", res, NR_MSGS);
+		return 1;
+	}
+	for (i = 0; i < NR_MSGS; i++){
+		if (strcmp(in[i], out[i]) || sources[i] != channels[i % NR_CHANS]){
+			printf("merge: FAIL record %d is \"%s\" of channel %llx, expected \"%s\"\n",
+			       i, in[i], (unsigned long long)sources[i], out[i]);
+			return 1;
+		}
+		if (i && tstamps[i].enqueue_ns < tstamps[i - 1].enqueue_ns){
+			printf("merge: FAIL record %d was written before record %d\n", i, i - 1);
+			return 1;
+		}
+	}
+	for (i = 0; i < NR_CHANS; i++)
+		close(fds[i]);
+	close(fd);
+	printf("merge: OK\n");
+	return 0;
+}
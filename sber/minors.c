@@ -0,0 +1,110 @@
+/*
+ * minors.c: devices with own modes and capacities in one module. Each device
+ * behaves as its sysfs mode says, holds what its capacity says and doesn't
+ * share data with the other one.
+ * Run after "sudo insmod sbertask.ko modes=single,default capacities=1000,8000":
+ * sudo ./minors [/dev/sbertask /dev/sbertask1]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include "sbertask.h"
+
+#define NR_DEVS 2
+
+/* First line of sysfs attribute of device, without newline */
+static int read_attr(const char *dev, const char *attr, char *buf, size_t len)
+{
+	char path[100], name[32];
+	FILE *f;
+
+	strncpy(name, dev, sizeof(name) - 1);
+	name[sizeof(name) - 1] = 0;
+	snprintf(path, sizeof(path), "/sys/class/sbertask/%s/%s", basename(name), attr);
+	f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+	if (fgets(buf, len, f) == NULL)
+		buf[0] = 0;
+	buf[strcspn(buf, "\n")] = 0;
+	fclose(f);
+	return 0;
+}
+
+/* Device must behave as its mode and capacity say */
+static int check_dev(const char *dev, int fd)
+{
+	char mode[32], attr[32], buf[1000];
+	int fd2, capacity, res, total = 0;
+
+	if (read_attr(dev, "mode", mode, sizeof(mode)) || read_attr(dev, "capacity", attr, sizeof(attr))){
+		perror(dev);
+		return 1;
+	}
+	capacity = atoi(attr);
+	fd2 = open(dev, O_RDWR | O_NONBLOCK);
+	if (!strcmp(mode, "single") ? fd2 >= 0 || errno != EBUSY : fd2 < 0){
+		printf("minors: FAIL second open of %s mode device %s\n", mode, dev);
+		return 1;
+	}
+	if (fd2 >= 0)
+		close(fd2);
+	/* Queue takes capacity bytes */
+	memset(buf, 'x', sizeof(buf));
+	while ((res = write(fd, buf, sizeof(buf))) > 0)
+		total += res;
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+	if (total != capacity){
+		printf("minors: FAIL %s took %d bytes, capacity is %d\n", dev, total, capacity);
+		return 1;
+	}
+	printf("minors: %s is %s with capacity %d\n", dev, mode, capacity);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	const char *devs[NR_DEVS] = { "/dev/sbertask", "/dev/sbertask1" };
+	struct sbertask_config config;
+	char buf[1000];
+	int fds[NR_DEVS], i, res;
+
+	if (argc > NR_DEVS){
+		devs[0] = argv[1];
+		devs[1] = argv[2];
+	}
+	for (i = 0; i < NR_DEVS; i++){
+		fds[i] = open(devs[i], O_RDWR | O_NONBLOCK);
+		if (fds[i] < 0){
+			perror(devs[i]);
+			return 1;
+		}
+		while (read(fds[i], buf, sizeof(buf)) > 0)
+			;
+		/* Stream, so fill below counts bytes, not records */
+		if (ioctl(fds[i], SBERTASK_IOC_GET_CONFIG, &config) == 0 && config.flags){
+			printf("minors: FAIL %s must be run with chflags 0\n", devs[i]);
+			return 1;
+		}
+		if (check_dev(devs[i], fds[i]))
+			return 1;
+	}
+	/* Devices don't share channels */
+	write(fds[0], "only0", 5);
+	res = read(fds[1], buf, sizeof(buf));
+	read(fds[0], buf, sizeof(buf));
+	if (res != -1 || errno != EAGAIN){
+		printf("minors: FAIL %s got data written to %s\n", devs[1], devs[0]);
+		return 1;
+	}
+	for (i = 0; i < NR_DEVS; i++)
+		close(fds[i]);
+	printf("minors: OK\n");
+	return 0;
+}
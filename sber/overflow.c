@@ -0,0 +1,105 @@
+/*
+ * overflow.c: overflow policy example. Full SBERTASK_CH_DROPNEW channel drops
+ * written records, SBERTASK_CH_OVERWRITE one drops oldest. Reader sees loss
+ * as gap of SBERTASK_IOC_GET_SEQ numbers.
+ * Run after "sudo ./start.sh": ./overflow [/dev/sbertask]
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include "sbertask.h"
+
+#define EXTRA 2
+
+static int fd;
+static char buf[SBERTASK_CAPACITY_MAX];
+
+/* Fill queue of fits records and write EXTRA more, writer never blocks */
+static int overfill(int flags, int rec, int fits, struct sbertask_stats *before, struct sbertask_seq *seq)
+{
+	struct sbertask_config config;
+	int i;
+
+	if (ioctl(fd, SBERTASK_IOC_GET_CONFIG, &config))
+		return -1;
+	config.flags = SBERTASK_CH_PACKET | flags;
+	if (ioctl(fd, SBERTASK_IOC_SET_CONFIG, &config))
+		return -1;
+	ioctl(fd, SBERTASK_IOC_GET_STATS, before);
+	ioctl(fd, SBERTASK_IOC_GET_SEQ, seq);
+	memset(buf, 'x', sizeof(buf));
+	for (i = 0; i < fits + EXTRA; i++)
+		if (write(fd, buf, rec) != rec)
+			return -1;
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	const char *dev = argc > 1 ? argv[1] : "/dev/sbertask";
+	struct sbertask_config old;
+	struct sbertask_stats before, after;
+	struct sbertask_seq start, seq;
+	int i, rec, fits, got = 0, ret = 1;
+	unsigned int last = 0;
+
+	fd = open(dev, O_RDWR | O_NONBLOCK);
+	if (fd < 0){
+		perror(dev);
+		return 1;
+	}
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+	if (ioctl(fd, SBERTASK_IOC_GET_CONFIG, &old)){
+		perror("SBERTASK_IOC_GET_CONFIG");
+		return 1;
+	}
+	/* Ten records fill queue */
+	rec = old.max_record / 10;
+	fits = old.max_record / rec;
+
+	/* Drop new: queue keeps first records, gap comes after them */
+	if (overfill(SBERTASK_CH_DROPNEW, rec, fits, &before, &start)){
+		perror("dropnew");
+		goto restore;
+	}
+	ioctl(fd, SBERTASK_IOC_GET_STATS, &after);
+	while (read(fd, buf, sizeof(buf)) == rec){
+		ioctl(fd, SBERTASK_IOC_GET_SEQ, &seq);
+		last = seq.last;
+		got++;
+	}
+	write(fd, buf, rec);
+	read(fd, buf, sizeof(buf));
+	ioctl(fd, SBERTASK_IOC_GET_SEQ, &seq);
+	if (got != fits || after.overflow_drops - before.overflow_drops != EXTRA ||
+	    last != start.next + fits - 1 || seq.first != last + EXTRA + 1){
+		printf("overflow: FAIL dropnew kept %d records, dropped %llu, next read is record %u after %u\n",
+		       got, (unsigned long long)(after.overflow_drops - before.overflow_drops), seq.first, last);
+		goto restore;
+	}
+
+	/* Overwrite: queue keeps last records, gap comes before them */
+	if (overfill(SBERTASK_CH_OVERWRITE, rec, fits, &before, &start)){
+		perror("overwrite");
+		goto restore;
+	}
+	ioctl(fd, SBERTASK_IOC_GET_STATS, &after);
+	read(fd, buf, sizeof(buf));
+	ioctl(fd, SBERTASK_IOC_GET_SEQ, &seq);
+	for (i = 1; read(fd, buf, sizeof(buf)) == rec; i++)
+		;
+	if (i != fits || after.overwrites - before.overwrites != EXTRA || seq.first != start.next + EXTRA){
+		printf("overflow: FAIL overwrite kept %d records, dropped %llu, first is record %u of %u\n",
+		       i, (unsigned long long)(after.overwrites - before.overwrites), seq.first, start.next);
+		goto restore;
+	}
+	printf("overflow: OK\n");
+	ret = 0;
+restore:
+	ioctl(fd, SBERTASK_IOC_SET_CONFIG, &old);
+	close(fd);
+	return ret;
+}
@@ -0,0 +1,69 @@
+/*
+ * packet.c: packet mode example. Each write is one record, each read
+ * returns one record, record longer than max_record is refused.
+ * Run after "sudo ./start.sh": ./packet [/dev/sbertask]
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include "sbertask.h"
+
+int main(int argc, char **argv)
+{
+	const char *dev = argc > 1 ? argv[1] : "/dev/sbertask";
+	struct sbertask_config old, config;
+	char buf[100];
+	int fd, res, ret = 1;
+
+	fd = open(dev, O_RDWR | O_NONBLOCK);
+	if (fd < 0){
+		perror(dev);
+		return 1;
+	}
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+	if (ioctl(fd, SBERTASK_IOC_GET_CONFIG, &old)){
+		perror("SBERTASK_IOC_GET_CONFIG");
+		return 1;
+	}
+	config = old;
+	config.flags = SBERTASK_CH_PACKET;
+	config.max_record = 8;
+	if (ioctl(fd, SBERTASK_IOC_SET_CONFIG, &config)){
+		perror("SBERTASK_IOC_SET_CONFIG");
+		return 1;
+	}
+
+	write(fd, "hello", 5);
+	write(fd, "world!", 6);
+	res = read(fd, buf, sizeof(buf));
+	if (res != 5 || memcmp(buf, "hello", 5)){
+		printf("packet: FAIL first read returned %d bytes, expected record \"hello\"\n", res);
+		goto restore;
+	}
+	/* Short buffer gets head of record, its rest is dropped */
+	res = read(fd, buf, 3);
+	if (res != 3 || memcmp(buf, "wor", 3)){
+		printf("packet: FAIL short read returned %d bytes, expected \"wor\"\n", res);
+		goto restore;
+	}
+	res = read(fd, buf, sizeof(buf));
+	if (res != -1 || errno != EAGAIN){
+		printf("packet: FAIL rest of truncated record was read\n");
+		goto restore;
+	}
+	res = write(fd, "too long!", 9);
+	if (res != -1 || errno != EMSGSIZE){
+		printf("packet: FAIL record over max_record gave %d, expected EMSGSIZE\n", res);
+		goto restore;
+	}
+	printf("packet: OK\n");
+	ret = 0;
+restore:
+	ioctl(fd, SBERTASK_IOC_SET_CONFIG, &old);
+	close(fd);
+	return ret;
+}
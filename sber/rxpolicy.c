@@ -0,0 +1,91 @@
+/*
+ * rxpolicy.c: SBERTASK_IOC_SET_RXPOLICY example. Reader sleeps until
+ * min_bytes are queued, or until first byte waited max_delay_us.
+ * Run after "sudo ./start.sh": ./rxpolicy [/dev/sbertask]
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include "sbertask.h"
+
+#define DELAY_US 20000
+
+static int64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+int main(int argc, char **argv)
+{
+	const char *dev = argc > 1 ? argv[1] : "/dev/sbertask";
+	struct sbertask_rxpolicy policy, got;
+	int64_t start, took;
+	char buf[100];
+	int fd, res;
+	pid_t pid;
+
+	fd = open(dev, O_RDWR | O_NONBLOCK);
+	if (fd < 0){
+		perror(dev);
+		return 1;
+	}
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+	/* Reads below must sleep */
+	fcntl(fd, F_SETFL, 0);
+
+	/* Not enough bytes: read returns what is queued once delay passes */
+	policy.min_bytes = 8;
+	policy.max_delay_us = DELAY_US;
+	if (ioctl(fd, SBERTASK_IOC_SET_RXPOLICY, &policy) || ioctl(fd, SBERTASK_IOC_GET_RXPOLICY, &got)){
+		perror("rxpolicy");
+		return 1;
+	}
+	if (got.min_bytes != policy.min_bytes || got.max_delay_us != policy.max_delay_us){
+		printf("rxpolicy: FAIL got min_bytes %u max_delay_us %u\n", got.min_bytes, got.max_delay_us);
+		return 1;
+	}
+	start = now_us();
+	write(fd, "abcd", 4);
+	res = read(fd, buf, sizeof(buf));
+	took = now_us() - start;
+	if (res != 4 || took < DELAY_US){
+		printf("rxpolicy: FAIL read %d bytes after %lld us, expected 4 after %d us\n",
+		       res, (long long)took, DELAY_US);
+		return 1;
+	}
+
+	/* No delay limit: read waits for second write of other process */
+	policy.max_delay_us = 0;
+	if (ioctl(fd, SBERTASK_IOC_SET_RXPOLICY, &policy)){
+		perror("SBERTASK_IOC_SET_RXPOLICY");
+		return 1;
+	}
+	write(fd, "abcd", 4);
+	start = now_us();
+	pid = fork();
+	if (pid == 0){
+		usleep(DELAY_US);
+		write(fd, "efgh", 4);
+		_exit(0);
+	}
+	res = read(fd, buf, sizeof(buf));
+	took = now_us() - start;
+	waitpid(pid, NULL, 0);
+	if (res != 8 || took < DELAY_US){
+		printf("rxpolicy: FAIL read %d bytes after %lld us, expected 8 after %d us\n",
+		       res, (long long)took, DELAY_US);
+		return 1;
+	}
+	close(fd);
+	printf("rxpolicy: OK\n");
+	return 0;
+}
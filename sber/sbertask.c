@@ -35,55 +35,295 @@
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
 #include <linux/sched.h>
+#include <linux/sched/signal.h>
+#include <linux/sched/clock.h>
 #include <linux/rbtree.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/version.h>
+#include <linux/eventfd.h>
+#include <linux/uaccess.h>
+#include <linux/mm.h>
+#include <linux/workqueue.h>
+#include <linux/jhash.h>
+#include <linux/bpf.h>
+#include <linux/filter.h>
+#include <linux/skbuff.h>
+#include <linux/anon_inodes.h>
+#include <linux/pid.h>
+#include <linux/cdev.h>
+#include <linux/device.h>
+#include <linux/miscdevice.h>
+#include <linux/kernel.h>
+
+#include "sbertask.h"
 
 #define BUFFER_DEPTH 1000
 #define DEVICE_NAME "sbertask"
 
-#define MODE_DEFAULT 0
-#define MODE_SINGLE  1
-#define MODE_MULTI   2
+/* Low latency mode spin budget, ns */
+#define SPIN_DEFAULT_NS  20000
+#define SPIN_MIN_NS      500
+
+#define MODE_DEFAULT SBERTASK_MODE_DEFAULT
+#define MODE_SINGLE  SBERTASK_MODE_SINGLE
+#define MODE_MULTI   SBERTASK_MODE_MULTI
+
+/* buffer_element flags */
+#define ELEMENT_EOR  0x1	/* last byte of record, written by one write() */
+#define ELEMENT_MARK 0x2	/* first byte of record marked by CoDel */
+
+/* Channels where each reader has own cursor */
+#define CH_CURSOR    (SBERTASK_CH_BROADCAST | SBERTASK_CH_LOG)
+/* Channels which know their readers */
+#define CH_READERS   (CH_CURSOR | SBERTASK_CH_GROUP)
+/* Ways to consume data, channel uses one of them */
+#define CH_CONSUME   (CH_READERS | SBERTASK_CH_ACK)
+/* What full queue does instead of blocking writer */
+#define CH_OVERFLOW  (SBERTASK_CH_DROPNEW | SBERTASK_CH_OVERWRITE)
+
+/* CoDel defaults, RFC 8289 */
+#define CODEL_TARGET_US     5000
+#define CODEL_INTERVAL_US   100000
+
+/* Expiry sweep of channel runs no more often */
+#define TTL_SWEEP_MS        100
+
+#define GROUP_KEY_DEFAULT   8
+#define GROUP_PART_DEFAULT  16
+
+/* How buffer_get() splits queue */
+#define GET_STREAM   0
+#define GET_RECORD   1
+#define GET_LINE     2
+
+/* Device changes waiting for channel drain point */
+#define PENDING_CAPACITY 0x1
+#define PENDING_FLAGS    0x2
 
 /* Each buffer consists of buffer_element's */
 
 struct buffer_element {
 	struct list_head list;
 	char data;
+	unsigned char flags;
+	unsigned char part;	/* key partition of record */
+	u32 seq;		/* sequence number of record */
+	ktime_t tstamp;		/* enqueue time, if channel has SBERTASK_CH_TSTAMP */
+	ktime_t expires;	/* end of record time to live, 0 - never */
+};
+
+struct sbertask_file;
+
+/* Bytes taken by one read in ack mode, kept until reader acknowledges them */
+struct buffer_lease {
+	struct list_head list;		/* in channel's leases, oldest first */
+	struct list_head file_list;	/* in owner's leases */
+	struct list_head elements;	/* leased buffer_element's in queue order */
+	struct rb_buf_node *buf_node;
+	struct sbertask_file *owner;
+	u64 	id;
+	int 	length;
+	ktime_t expires;
 };
 
-/* Each fifo buffer placed in red black tree. Pid is a key. */
+/*
+ * Each fifo buffer placed in red black tree. Key is pid in multi mode,
+ * 0 in others, or SBERTASK_CHAN_KEYED key of channel attached by key or name.
+ */
 
 struct rb_buf_node {
 	struct 	rb_node node;
-	pid_t 	pid;
+	struct 	sbertask_dev *sdev;		/* device channel belongs to */
+	u64 	key;
+	char 	name[SBERTASK_NAME_MAX];	/* of SBERTASK_CHAN_NAMED channel */
+	unsigned int capacity;			/* queue depth */
 	struct 	buffer_element *buffer_head;
 	struct 	buffer_element *buffer_tail;
 	int 	buffer_length;
 	int 	write_ready;
 	int 	read_ready;
 	int 	finished;
+	unsigned int flags;		/* SBERTASK_CH_* */
+	unsigned int max_record;
+	char 	delimiter;
+	int 	delim_count;		/* delimiters in queue, lines ready to read */
+	/* Wakeup coalescing, set by sleeping readers with sbertask_rxpolicy */
+	int 	rx_waiting;		/* sleeping readers */
+	int 	wake_min;		/* wake readers when queue holds so many bytes */
+	unsigned int wake_delay;	/* or when first unread byte waits so long, us */
+	int 	rx_expired;		/* wake_delay passed */
+	ktime_t first_byte;		/* when queue became not empty */
+	struct 	hrtimer rx_timer;
+	/* Low latency mode, budgets adapt between SPIN_MIN_NS and spin_max_ns */
+	unsigned int spin_max_ns;
+	unsigned int rx_spin_ns;
+	unsigned int tx_spin_ns;
+	struct 	sbertask_stats stats;
+	unsigned int chunk;		/* dispatch mode: bytes per woken reader */
+	struct 	eventfd_ctx *evfd;	/* signalled on SBERTASK_EV_* transitions */
+	unsigned int ev_mask;
+	int 	ev_space;
+	ktime_t last_enqueue;		/* time of last write, if SBERTASK_CH_TSTAMP */
+	u64 	tail_off;		/* bytes ever queued, offset of next written byte */
+	u32 	seq_next;		/* sequence number of next written record */
+	u32 	rx_seq_first;		/* records of first and last byte taken by last get */
+	u32 	rx_seq_last;
+	u32 	rx_marks;		/* marked records taken by last get */
+	/* Broadcast mode: bytes are freed when the slowest reader cursor passes them */
+	struct 	list_head readers;	/* sbertask_file's reading this channel, see CH_READERS */
+	unsigned int lag_limit;
+	/* Log mode: bytes are kept by age and size, not by readers */
+	unsigned int retain_bytes;
+	unsigned int retain_ms;
+	/* Ack mode: leased bytes still take queue room */
+	struct 	list_head leases;
+	int 	leased;
+	unsigned int lease_ms;
+	struct 	delayed_work lease_work;
+	/* Group mode: partition of record is hash of its key */
+	unsigned int key_bytes;
+	unsigned int partitions;
+	unsigned int group_gen;		/* changes on rebalance */
+	int 	part_bytes[SBERTASK_PART_MAX];
+	/* BPF filter of written records, may redirect them to other channels */
+	struct 	bpf_prog *filter;
+	u64 	redirect[SBERTASK_REDIRECT_MAX];
+	unsigned int nr_redirect;
+	/* CoDel: head records are dropped or marked while queue delay stays over target */
+	unsigned int codel_target_us;
+	unsigned int codel_interval_us;
+	bool 	codel_dropping;
+	u32 	codel_count;		/* drops since dropping state began */
+	u32 	codel_lastcount;
+	ktime_t codel_first_above;	/* when delay over target allows drop, 0 - delay is fine */
+	ktime_t codel_drop_next;
+	/* Record time to live, expired records are dropped or go to dead letter channel */
+	unsigned int ttl_ms;
+	int 	ttl_bytes;		/* queued bytes which may expire */
+	ktime_t ttl_next;		/* when sweep is due */
+	struct 	delayed_work ttl_work;
+	u64 	dead_key;
+	bool 	dead_set;
+	/* Device reconfiguration, applied when queue drains, see PENDING_* */
+	unsigned int pending;
+	unsigned int pending_capacity;
+	unsigned int pending_flags;
 	wait_queue_head_t read_wq;
 	wait_queue_head_t write_wq;
 };
 
+/*
+ * Each minor is separate device with own mode, queue depth and tree of
+ * channels. Minor 0 is /dev/sbertask, others are made by control device.
+ */
+
+struct sbertask_dev {
+	int 	index;			/* minor */
+	int 	mode;			/* MODE_* */
+	unsigned int capacity;		/* queue depth of its channels */
+	unsigned int flags;		/* SBERTASK_CH_* of new channels */
+	struct 	sbertask_rxpolicy rx_policy;	/* of files which didn't set own one */
+	int 	pending_mode;		/* MODE_* set when device was open, -1 - none */
+	spinlock_t lock;		/* protects channels of device and their queues */
+	struct 	rb_root root;
+	struct 	mutex single_mutex;	/* single mode: held while device is open */
+	int 	users;			/* open files, under devices_mutex */
+	struct 	cdev *cdev;
+	struct 	device *device;
+};
+
+/* Each opened file has own state in private_data */
+
+struct sbertask_file {
+	struct sbertask_dev *sdev;
+	struct rb_buf_node *chan;		/* attached channel, NULL - channel of driver mode */
+	bool anon;				/* made by SBERTASK_ATTACH_FD, not by open() */
+	struct sbertask_tstamp last_tstamp;	/* times of last read */
+	struct sbertask_seq last_seq;		/* records of last read */
+	unsigned int ttl_ms;			/* time to live of written records, 0 - channel's one */
+	struct sbertask_rxpolicy rx_policy;
+	bool rx_policy_set;			/* rx_policy is set by file, not taken from device */
+	/* Broadcast, log or group reader */
+	struct rb_buf_node *reader_node;	/* channel file reads, NULL - none */
+	struct list_head reader_list;
+	u64 cursor;				/* offset of next byte to read */
+	struct rb_buf_node *open_node;		/* broadcast or log channel file was opened on */
+	u64 open_off;				/* its tail at open, first join starts there */
+	u64 hold;				/* broadcast bytes after it stay while read copies them */
+	unsigned int holds;			/* reads copying held bytes, 0 - hold is unused */
+	u64 parts;				/* group partitions of file */
+	/* Ack mode reader */
+	struct list_head leases;		/* not acknowledged yet, oldest first */
+	u64 lease_seq;				/* number of last lease */
+	struct buffer_lease *spare_lease;	/* allocated before lock for next read */
+};
+
 static DEFINE_SPINLOCK(buffer_lock);
-static DEFINE_SPINLOCK(rb_tree_lock);
-static struct mutex mode_single_mutex;
 
-static int driver_mode = MODE_DEFAULT;
 static char *mode = "default";
 module_param(mode, charp, 0000);
 
-static int major_number;
+/* Devices made at load, one per array entry: modes=single,default capacities=1000,8000 */
+static char *modes[SBERTASK_DEV_MAX];
+static int nr_modes;
+module_param_array(modes, charp, &nr_modes, 0000);
+static unsigned int capacities[SBERTASK_DEV_MAX];
+static int nr_capacities;
+module_param_array(capacities, uint, &nr_capacities, 0000);
+static unsigned int chflags[SBERTASK_DEV_MAX];
+static int nr_chflags;
+module_param_array(chflags, uint, &nr_chflags, 0000);
+
+/* File keeping queued data over module upgrade, may be set before rmmod */
+static char *snapshot;
+module_param(snapshot, charp, 0600);
+
+static const char * const mode_names[] = {
+	[MODE_DEFAULT] = "default",
+	[MODE_SINGLE]  = "single",
+	[MODE_MULTI]   = "multi",
+};
+
+static dev_t dev_base;
+static struct class *sbertask_class;
+static struct sbertask_dev *devices[SBERTASK_DEV_MAX];
+static DEFINE_MUTEX(devices_mutex);
 static struct kmem_cache *buffer_cache;
 
-static struct rb_root root = RB_ROOT;
+static const struct file_operations f_ops;
+
+/*
+ * Readers to wake. In dispatch mode readers wait exclusively, one reader
+ * is woken for each chunk of queued data. Otherwise all of them wake.
+ */
+static inline int dispatch_nr(struct rb_buf_node *buf_node)
+{
+	if (!(buf_node->flags & SBERTASK_CH_DISPATCH))
+		return 1;
+	return max(1, (int)DIV_ROUND_UP(READ_ONCE(buf_node->buffer_length), buf_node->chunk));
+}
+
+/* Reader waited long enough for more bytes, let it take what is queued */
+static enum hrtimer_restart rx_timer_expired(struct hrtimer *timer)
+{
+	struct rb_buf_node *buf_node = container_of(timer, struct rb_buf_node, rx_timer);
+
+	WRITE_ONCE(buf_node->rx_expired, 1);
+	WRITE_ONCE(buf_node->read_ready, 1);
+	wake_up_interruptible_nr(&buf_node->read_wq, dispatch_nr(buf_node));
+	return HRTIMER_NORESTART;
+}
+
+static void lease_timeout(struct work_struct *work);
+static void ttl_sweep(struct work_struct *work);
+static void rx_expire(struct rb_buf_node *buf_node);
 
-static int add_buffer(pid_t pid)
+static int add_buffer(struct sbertask_dev *sdev, u64 key)
 {
 	struct rb_buf_node *new_buffer;
 	struct rb_buf_node *buffer;
-	struct rb_node **node = &(root.rb_node); 
+	struct rb_node **node = &(sdev->root.rb_node); 
         struct rb_node *parent = NULL;
 	int ret = 0;
 
@@ -92,11 +332,11 @@ static int add_buffer(pid_t pid)
 	while (*node) {
 	        buffer = container_of(*node, struct rb_buf_node, node);
 		parent = *node;
-		if (pid < buffer->pid)
+		if (key < buffer->key)
 			node = &((*node)->rb_left);
-	      	else if (pid > buffer->pid)
+	      	else if (key > buffer->key)
 		      	node = &((*node)->rb_right);
-		else if (pid == buffer->pid)
+		else if (key == buffer->key)
 			goto exit;
 	}
 	new_buffer = kmalloc(sizeof(struct rb_buf_node), GFP_ATOMIC);
@@ -107,14 +347,71 @@ static int add_buffer(pid_t pid)
 	}
 	/* Add new node and rebalance tree. */
 	rb_link_node(&new_buffer->node, parent, node);
-	rb_insert_color(&new_buffer->node, &root);
-	new_buffer->pid = pid;
+	rb_insert_color(&new_buffer->node, &sdev->root);
+	new_buffer->sdev = sdev;
+	new_buffer->key = key;
+	memset(new_buffer->name, 0, sizeof(new_buffer->name));
+	new_buffer->capacity = sdev->capacity;
 	new_buffer->buffer_head = NULL;
 	new_buffer->buffer_tail = NULL;
 	new_buffer->buffer_length = 0;
 	new_buffer->read_ready = 0;
 	new_buffer->write_ready = 1;
 	new_buffer->finished = 0;
+	new_buffer->flags = sdev->flags;
+	new_buffer->max_record = sdev->capacity;
+	new_buffer->delimiter = '\n';
+	new_buffer->delim_count = 0;
+	new_buffer->rx_waiting = 0;
+	new_buffer->wake_min = 1;
+	new_buffer->wake_delay = 0;
+	new_buffer->rx_expired = 0;
+	new_buffer->first_byte = 0;
+	new_buffer->spin_max_ns = SPIN_DEFAULT_NS;
+	new_buffer->rx_spin_ns = SPIN_DEFAULT_NS;
+	new_buffer->tx_spin_ns = SPIN_DEFAULT_NS;
+	memset(&new_buffer->stats, 0, sizeof(new_buffer->stats));
+	new_buffer->chunk = sdev->capacity;
+	new_buffer->evfd = NULL;
+	new_buffer->ev_mask = 0;
+	new_buffer->ev_space = sdev->capacity;
+	new_buffer->last_enqueue = 0;
+	new_buffer->tail_off = 0;
+	new_buffer->seq_next = 0;
+	INIT_LIST_HEAD(&new_buffer->readers);
+	new_buffer->lag_limit = sdev->capacity;
+	new_buffer->retain_bytes = sdev->capacity;
+	new_buffer->retain_ms = 0;
+	INIT_LIST_HEAD(&new_buffer->leases);
+	new_buffer->leased = 0;
+	new_buffer->lease_ms = 0;
+	INIT_DELAYED_WORK(&new_buffer->lease_work, lease_timeout);
+	new_buffer->key_bytes = GROUP_KEY_DEFAULT;
+	new_buffer->partitions = GROUP_PART_DEFAULT;
+	new_buffer->group_gen = 0;
+	memset(new_buffer->part_bytes, 0, sizeof(new_buffer->part_bytes));
+	new_buffer->filter = NULL;
+	new_buffer->nr_redirect = 0;
+	new_buffer->codel_target_us = CODEL_TARGET_US;
+	new_buffer->codel_interval_us = CODEL_INTERVAL_US;
+	new_buffer->codel_dropping = false;
+	new_buffer->codel_count = 0;
+	new_buffer->codel_lastcount = 0;
+	new_buffer->codel_first_above = 0;
+	new_buffer->codel_drop_next = 0;
+	new_buffer->ttl_ms = 0;
+	new_buffer->ttl_bytes = 0;
+	new_buffer->ttl_next = 0;
+	INIT_DELAYED_WORK(&new_buffer->ttl_work, ttl_sweep);
+	new_buffer->dead_key = 0;
+	new_buffer->dead_set = false;
+	new_buffer->pending = 0;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+	hrtimer_setup(&new_buffer->rx_timer, rx_timer_expired, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#else
+	hrtimer_init(&new_buffer->rx_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	new_buffer->rx_timer.function = rx_timer_expired;
+#endif
 	init_waitqueue_head(&new_buffer->read_wq);
 	init_waitqueue_head(&new_buffer->write_wq);
 
@@ -124,334 +421,4462 @@ exit:
 }
 
 
-static struct rb_buf_node *get_buffer(pid_t pid)
+static struct rb_buf_node *get_buffer(struct sbertask_dev *sdev, u64 key)
 {
-	struct rb_node **node = &(root.rb_node); 
+	struct rb_node **node = &(sdev->root.rb_node); 
 	struct rb_buf_node * buffer;
 	
 	/* Sliding on tree */
 	while (*node) {
 	        buffer = container_of(*node, struct rb_buf_node, node);
-		if (pid < buffer->pid)
+		if (key < buffer->key)
 			node = &((*node)->rb_left);
-	      	else if (pid > buffer->pid)
+	      	else if (key > buffer->key)
 		      	node = &((*node)->rb_right);
-		else if (pid == buffer->pid)
+		else if (key == buffer->key)
 			return buffer;
 	}
-	pr_err("sbertask: get_buffer(): no buffer found by pid %u\n", current->pid);
+	/* Miss is normal for lookups by user key, callers which need channel log it */
 	return NULL;
 }
 
-static int rm_buffer(pid_t pid)
+static int rm_buffer(struct sbertask_dev *sdev, u64 key)
 {
 	struct rb_buf_node *rm_buffer;
         struct buffer_element *buffer_entry, *buffer_next;
-	rm_buffer = get_buffer(pid);
+	rm_buffer = get_buffer(sdev, key);
 	if (rm_buffer == NULL){
-		pr_err("sbertask: rm_buffer: buffer for pid %u not found\n", pid);
+		pr_err("sbertask: rm_buffer: buffer with key %llu not found\n", key);
 		goto exit;
 	}
  	if (rm_buffer->buffer_head != NULL){
                 list_for_each_entry_safe(buffer_entry, buffer_next, &rm_buffer->buffer_head->list, list){
                         kmem_cache_free(buffer_cache, buffer_entry);
                 }
+		kmem_cache_free(buffer_cache, rm_buffer->buffer_head);
 	}
-	rb_erase(&rm_buffer->node, &root);
+	hrtimer_cancel(&rm_buffer->rx_timer);
+	if (rm_buffer->evfd)
+		eventfd_ctx_put(rm_buffer->evfd);
+	if (rm_buffer->filter)
+		bpf_prog_put(rm_buffer->filter);
+	rb_erase(&rm_buffer->node, &sdev->root);
 	kfree(rm_buffer);
 exit:	
 	return 0;
 }
 
-
-
-
-static int sbertask_open (struct inode *inode, struct file *file_p)
+/* Buffer of calling process, depends on device mode. Called under device lock. */
+static struct rb_buf_node *current_buffer(struct sbertask_dev *sdev)
 {
-	int ret;
 	struct rb_buf_node *buf_node;
-	spin_lock(&rb_tree_lock);
-	pr_info("sbertask: sbertask_open() spinlock acquired\n");
-	switch (driver_mode){
-	case MODE_MULTI:
-		/* Just add buffer */
-		ret = add_buffer(current->pid);
-		buf_node = get_buffer(current->pid);
-		buf_node->finished = 0;
-		break;
-	case MODE_SINGLE: 
-		/* Add buffer and mutex protect */
-		if (!mutex_trylock(&mode_single_mutex)){
-			spin_unlock(&rb_tree_lock);
-			return -EBUSY;
-		}
-		ret = add_buffer(0);
-		buf_node = get_buffer(0);
-		buf_node->finished = 0;
-		break;	
-	case MODE_DEFAULT:
-		/* Add buffer with pid 0 */
-		ret = add_buffer(0);
-		buf_node = get_buffer(0);
-		buf_node->finished = 0;
-		break;
-	default:
-		pr_err("Undefined behavior in sbertask_open\n");
-	}
-	
-	spin_unlock(&rb_tree_lock);
-	pr_info("sbertask: sbertask_opei() spinlock released\n");
-	if (!ret)
-		pr_info("sbertask: process with pid %u opened device\n", current->pid);
-	else if (ret == -ENOMEM){ 
-		pr_err("sbertask: error - can't allocate buffer memory for pid %u\n", current->pid);
-		return -ENOMEM;
-	} else 
-		pr_err("sbertask: unknown add_buffer() error in sbertask_open(), return code is %d \n", ret);
-	
-	try_module_get(THIS_MODULE);
-
-	return 0;
-};
 
-static int sbertask_release (struct inode *inode, struct file *file_p)
-{
-	struct rb_buf_node *buf_node;
-	spin_lock(&rb_tree_lock);
-	pr_info("sbertask: sbertask_release() spinlock acquired\n");
-	switch (driver_mode) {
-		case MODE_SINGLE:
-			buf_node = get_buffer(0);
-			buf_node->finished = 1;
-			spin_unlock(&rb_tree_lock);
-			wake_up_interruptible(&buf_node->read_wq);
-			mutex_unlock(&mode_single_mutex);
-			break;
+	switch (sdev->mode) {
 		case MODE_DEFAULT:
-			buf_node = get_buffer(0);
-			buf_node->finished = 1;
-			spin_unlock(&rb_tree_lock);
-			wake_up_interruptible(&buf_node->read_wq);
-			break;
+		case MODE_SINGLE:
+			return get_buffer(sdev, 0);
 		case MODE_MULTI:
-			spin_unlock(&rb_tree_lock);
-			break;
+			buf_node = get_buffer(sdev, current->pid);
+			if (buf_node == NULL)
+				pr_err("sbertask: process with pid %u has no channel, it didn't open device\n",
+				       current->pid);
+			return buf_node;
 		default:
-			spin_unlock(&rb_tree_lock);
-			pr_err("Undefined_behavior in sbertask_release()\n");
+			pr_err("Undefined behavior in current_buffer()\n");
 	}
-	pr_info("sbertask: sbertask_release() spinlock released");
-        pr_info("sbertask: process with pid %u closes device\n", current->pid);
-	module_put(THIS_MODULE);
-	return 0;
-};
+	return NULL;
+}
 
-static  ssize_t sbertask_read (struct file *file_p, char __user *buf, size_t length, loff_t *off_p)
-{		
+/*
+ * Gather and merge read pid channel only of calling process, other pid
+ * channels are mailboxes of their owners. Key and name channels are for
+ * fan-in of many processes.
+ */
+static inline bool channel_readable(struct rb_buf_node *buf_node)
+{
+	if (buf_node->sdev->mode != MODE_MULTI || (buf_node->key & SBERTASK_CHAN_KEYED))
+		return true;
+	return buf_node->key == current->pid;
+}
+
+/* Channel file works with: attached one or one of calling process. Called under device lock. */
+static struct rb_buf_node *file_buffer(struct file *file_p)
+{
+	struct sbertask_file *file_ctx = file_p->private_data;
+
+	if (file_ctx->chan)
+		return file_ctx->chan;
+	return current_buffer(file_ctx->sdev);
+}
+
+static inline struct sbertask_dev *file_sdev(struct file *file_p)
+{
+	struct sbertask_file *file_ctx = file_p->private_data;
+
+	return file_ctx->sdev;
+}
+
+/* Largest record channel may hold, counting resize waiting for drain. Called under device lock. */
+static inline unsigned int channel_capacity(struct rb_buf_node *buf_node)
+{
+	if (buf_node->pending & PENDING_CAPACITY)
+		return max(buf_node->capacity, buf_node->pending_capacity);
+	return buf_node->capacity;
+}
+
+/* Queue depth of file's channel, bounds copies made before lock */
+static unsigned int file_capacity(struct file *file_p)
+{
+	struct sbertask_dev *sdev = file_sdev(file_p);
 	struct rb_buf_node *buf_node;
-	struct buffer_element *queue_iter, *queue_iter_next;
-	int c = 0, ret = 0;
+	unsigned int capacity;
 
-	pr_info("sbertask: process with pid %u reads device\n", current->pid);	
+	spin_lock(&sdev->lock);
+	buf_node = file_buffer(file_p);
+	capacity = buf_node ? channel_capacity(buf_node) : sdev->capacity;
+	spin_unlock(&sdev->lock);
+	return capacity;
+}
 
-	spin_lock(&rb_tree_lock);
-	pr_info("sbertask: sbertask_read() spinlock acquired\n");
-	switch (driver_mode) {
-		case MODE_DEFAULT:
-			buf_node = get_buffer(0);
-			break;
-		case MODE_SINGLE:
-			buf_node = get_buffer(0);
-			break;
-		case MODE_MULTI:
-                	buf_node = get_buffer(current->pid);
-			break;
-		default:
-			pr_err("Undefined behavior in sbertask_read()\n");
-	}
-      	if (buf_node == NULL){
-		spin_unlock(&rb_tree_lock);
-		return -EINVAL;	
-	}
-	/* sleep if empty buffer */
-	if(!buf_node->buffer_head || buf_node->buffer_length == 0){
-		pr_info("sbertask: queue is empty for process with pid %u\n", current->pid);
-		buf_node->read_ready = 0;
-		spin_unlock(&rb_tree_lock);
-		wait_event_interruptible(buf_node->read_wq, buf_node->read_ready || buf_node->finished);
-		spin_lock(&rb_tree_lock);
-		if ( !buf_node->read_ready || !buf_node->buffer_length) {
-			pr_info("sbertask: go to exit\n");
-			goto exit;
-		}
-	}
-	/* it is time to send byte and delete entry */
-	if (buf_node->buffer_length)
-		list_for_each_entry_safe(queue_iter, queue_iter_next, &buf_node->buffer_head->list, list){
-			if((c < buf_node->buffer_length) && (c < length)){
-				if(put_user(queue_iter->data, buf + c)){
-					pr_err("sbertask: can't put data to userspace!\n");
-					ret = -EINVAL;
-					goto exit;
-				}
-				pr_info("sbertask: sended '%c'\n", queue_iter->data);
-				list_del(&queue_iter->list);
-				kmem_cache_free(buffer_cache, queue_iter);
-				c++;
-			} else
-				break;
-		}
-	ret = c;
-	buf_node->buffer_length -= c;
-	if (buf_node->buffer_length == 0)
-		buf_node->read_ready = 0;
-	buf_node->write_ready = 1;
-	wake_up_interruptible(&buf_node->write_wq);
+/* Wakeup policy set by file, or default one of its device */
+static inline struct sbertask_rxpolicy file_rx_policy(struct file *file_p)
+{
+	struct sbertask_file *file_ctx = file_p->private_data;
 
-exit:
-	spin_unlock(&rb_tree_lock);
-	pr_info("sbertask: sbertask_read() spinlock released\n");
-	return ret;
-};
+	if (file_ctx->rx_policy_set)
+		return file_ctx->rx_policy;
+	return file_ctx->sdev->rx_policy;
+}
 
-static	ssize_t sbertask_write (struct file *file_p, const char __user *buf, size_t length, loff_t *off_p)
+/* Time to live of record file writes to channel, 0 - never */
+static inline unsigned int file_ttl(struct file *file_p, struct rb_buf_node *buf_node)
 {
-	struct rb_buf_node * buf_node;
-	long unsigned i, ret = 0;
+	struct sbertask_file *file_ctx = file_p->private_data;
 
-	pr_info("sbertask: process with pid %u writes to device\n", current->pid);	
-	spin_lock(&rb_tree_lock);
-	pr_info("sbertask: sbertask_write() spin_lock acquired\n");
-	switch (driver_mode) {
-		case MODE_DEFAULT:
-			buf_node=get_buffer(0);
-			break;
-		case MODE_SINGLE:
-			buf_node=get_buffer(0);
-			break;
-		case MODE_MULTI:
-                	buf_node = get_buffer(current->pid);
-			break;
-		default:
-			pr_err("Undefined behavior in sbertask_write()\n");
-	}
+	return READ_ONCE(file_ctx->ttl_ms) ?: buf_node->ttl_ms;
+}
 
-	if (buf_node == NULL){
-		pr_err("sbertask: can't get buffer\n");
-		goto exit;
-	}
-	if (buf_node->buffer_length >= BUFFER_DEPTH){	
-		pr_info("sbertask: buffer full\n");
-		buf_node->write_ready = 0;
-		wait_event_interruptible(buf_node->write_wq, buf_node->write_ready != 0);
+/*
+ * BPF filter of channel (file's one if NULL) with reference, NULL if there is none.
+ * Without CONFIG_BPF_SYSCALL filter can't be attached at all.
+ */
+static struct bpf_prog *filter_get(struct file *file_p, struct rb_buf_node *buf_node)
+{
+	struct sbertask_dev *sdev = file_sdev(file_p);
+	struct bpf_prog *prog = NULL;
+
+	spin_lock(&sdev->lock);
+	if (buf_node == NULL)
+		buf_node = file_buffer(file_p);
+	if (buf_node && buf_node->filter){
+		prog = buf_node->filter;
+		bpf_prog_inc(prog);
 	}
-	if (buf_node->buffer_length == 0){
-		pr_info("sbertask: making new buffer's queue list\n");
-		buf_node->buffer_head = kmem_cache_alloc(buffer_cache, GFP_ATOMIC);
-		INIT_LIST_HEAD(&buf_node->buffer_head->list);
-		buf_node->buffer_tail = buf_node->buffer_head;	
+	spin_unlock(&sdev->lock);
+	return prog;
+}
+
+/*
+ * Run filter on record as socket filter runs on packet. Called without
+ * locks, program may take a while. Returns SBERTASK_BPF_* verdict.
+ */
+static u32 filter_run(struct bpf_prog *prog, const char *data, size_t length)
+{
+	struct sk_buff *skb;
+	u32 verdict;
+
+	skb = alloc_skb(length, GFP_KERNEL);
+	if (skb == NULL)
+		return SBERTASK_BPF_PASS;
+	skb_put_data(skb, data, length);
+	verdict = bpf_prog_run_pin_on_cpu(prog, skb);
+	consume_skb(skb);
+	return verdict;
+}
+
+/*
+ * Channel record goes to by filter verdict, NULL - drop it. Record redirected
+ * to channel which doesn't exist is dropped. Called under device lock.
+ */
+static struct rb_buf_node *filter_target(struct rb_buf_node *buf_node, u32 verdict)
+{
+	struct rb_buf_node *target;
+	u32 idx;
+
+	if (verdict == SBERTASK_BPF_DROP){
+		buf_node->stats.filter_drops++;
+		return NULL;
 	}
-	for (i = 0; i < length && buf_node->buffer_length < BUFFER_DEPTH ; buf++, i++){
-		buf_node->buffer_tail = kmem_cache_alloc(buffer_cache, GFP_ATOMIC);
-		if (buf_node->buffer_tail == NULL){
-			pr_err("sbertask: can't allocate buffer element!\n");
-			ret = -EINVAL;
-			goto exit;
-		}
-		list_add_tail(&buf_node->buffer_tail->list, &buf_node->buffer_head->list);
-		if (get_user(buf_node->buffer_tail->data, buf)){
-			pr_err("sbertask: can't get data from userspace\n");
-			ret = -EINVAL;
-			goto exit;
-		}
-		buf_node->buffer_length++;
-		pr_info("sbertask: getted '%c'\n", buf_node->buffer_tail->data);
+	if (!(verdict & 0x80000000u))
+		return buf_node;
+	idx = verdict & ~0x80000000u;
+	if (idx >= buf_node->nr_redirect)
+		return buf_node;
+	target = get_buffer(buf_node->sdev, buf_node->redirect[idx]);
+	if (target == NULL){
+		buf_node->stats.filter_drops++;
+		return NULL;
 	}
-	ret = i;
+	buf_node->stats.filter_redirects++;
+	return target;
+}
 
-exit:
-	buf_node->read_ready = 1;
-	wake_up_interruptible(&buf_node->read_wq);
-	spin_unlock(&rb_tree_lock);
-	pr_info("sbertask: sbertask_write() spinlock released\n");
-	return ret;
-};
+/* Broadcast channel holds no more than slowest reader may lag, log no more than it keeps */
+static inline int buffer_depth(struct rb_buf_node *buf_node)
+{
+	if (buf_node->flags & SBERTASK_CH_BROADCAST)
+		return buf_node->lag_limit;
+	if (buf_node->flags & SBERTASK_CH_LOG)
+		return buf_node->retain_bytes;
+	return buf_node->capacity;
+}
 
+static inline int buffer_room(struct rb_buf_node *buf_node)
+{
+	return buffer_depth(buf_node) - buf_node->buffer_length - buf_node->leased;
+}
 
+/* Offset of first queued byte */
+static inline u64 buffer_head_off(struct rb_buf_node *buf_node)
+{
+	return buf_node->tail_off - buf_node->buffer_length;
+}
 
-const struct file_operations f_ops = {
-	.owner   = THIS_MODULE,
-	.open    = sbertask_open,
-	.release = sbertask_release,
-	.read    = sbertask_read,
-	.write   = sbertask_write,
-};
+/* Queued bytes of group partitions */
+static int group_avail(struct rb_buf_node *buf_node, u64 parts)
+{
+	unsigned int part;
+	int avail = 0;
 
-static int __init module_start(void)
+	for (part = 0; part < buf_node->partitions; part++)
+		if (parts & BIT_ULL(part))
+			avail += buf_node->part_bytes[part];
+	return avail;
+}
+
+/*
+ * Bytes reader may take: unread bytes after its cursor in broadcast and log
+ * mode, bytes of its partitions in group mode, whole queue otherwise.
+ */
+static inline int rx_avail(struct file *file_p, struct rb_buf_node *buf_node)
 {
-	if 	(!strcmp(mode, "default"))
-		driver_mode = MODE_DEFAULT;
-	else if (!strcmp(mode, "single"))
-		driver_mode = MODE_SINGLE;
-	else if (!strcmp(mode, "multi"))
-		driver_mode = MODE_MULTI;
-	else {
-		pr_err("sbertask: wrong mode setted. Only default/single/multi modes supported\n");
-		return -EINVAL;
-	};
+	struct sbertask_file *file_ctx = file_p->private_data;
 
-	pr_info("sbertask: module runned in %s mode\n", mode);
-	
-	/* Register /dev/sbertask */
-	major_number = register_chrdev(0, DEVICE_NAME, &f_ops);
-	if (major_number < 0){
-		pr_err("sbertask: can't register device %s\n", DEVICE_NAME);
-		return -ENXIO;
-	}
-	pr_info("sbertask: assigned major number %d\n", major_number);
+	if (!(buf_node->flags & CH_READERS))
+		return buf_node->buffer_length;
+	if (file_ctx->reader_node != buf_node)
+		return 0;
+	if (buf_node->flags & SBERTASK_CH_GROUP)
+		return group_avail(buf_node, file_ctx->parts);
+	return buf_node->tail_off - max(file_ctx->cursor, buffer_head_off(buf_node));
+}
 
-	/* Cache create */
-	buffer_cache = kmem_cache_create("sbertask_buffer", sizeof(struct buffer_element), 0, SLAB_HWCACHE_ALIGN, NULL);
-	if (buffer_cache == NULL){
-		pr_err("sbertask: can't create buffer cache\n");
-		unregister_chrdev(major_number, DEVICE_NAME);
-		return -ENOMEM;
-	}
+/* Record boundaries are kept for channel in packet mode or for O_DIRECT file, like pipe */
+static inline bool packet_mode(struct file *file_p, struct rb_buf_node *buf_node)
+{
+	return (buf_node->flags & SBERTASK_CH_PACKET) || (file_p->f_flags & O_DIRECT);
+}
 
-	if (driver_mode == MODE_SINGLE){
-		mutex_init(&mode_single_mutex);
-	}
-		
-	pr_info("sbertask: module successfully loaded\n");
+/* Splitting of queue for reader, packet mode wins over line mode */
+static inline int read_how(struct file *file_p, struct rb_buf_node *buf_node)
+{
+	if (packet_mode(file_p, buf_node))
+		return GET_RECORD;
+	if (buf_node->flags & SBERTASK_CH_DELIM)
+		return GET_LINE;
+	return GET_STREAM;
+}
 
-	return 0;
+/*
+ * In line mode reader waits for whole line. Partial line is given only if
+ * queue is full and line can't be finished, or writer has gone.
+ */
+static inline bool buffer_readable(struct file *file_p, struct rb_buf_node *buf_node)
+{
+	if (!rx_avail(file_p, buf_node))
+		return false;
+	if (read_how(file_p, buf_node) != GET_LINE)
+		return true;
+	return buf_node->delim_count || buffer_room(buf_node) <= 0 || buf_node->finished;
+}
 
+/* Sync wakeup keeps woken task on waker's cpu, it is cheaper for ping-pong */
+static inline void buffer_wake(struct rb_buf_node *buf_node, wait_queue_head_t *wq)
+{
+	if (buf_node->flags & SBERTASK_CH_LOWLAT)
+		wake_up_interruptible_sync(wq);
+	else
+		wake_up_interruptible(wq);
+}
 
-};
+static void buffer_wake_readers(struct rb_buf_node *buf_node)
+{
+	if (buf_node->flags & SBERTASK_CH_DISPATCH)
+		wake_up_interruptible_nr(&buf_node->read_wq, dispatch_nr(buf_node));
+	else
+		buffer_wake(buf_node, &buf_node->read_wq);
+}
 
-static void __exit module_stop(void)
+static inline void buffer_event(struct rb_buf_node *buf_node, unsigned int event)
 {
-	struct rb_node *node;
-	/* Iterate over rb tree */
-	for (node = rb_first(&root); node; node = rb_next(node)){
-		struct rb_buf_node *buf_node;
-                buf_node = container_of( node, struct rb_buf_node, node);
-		spin_lock(&buffer_lock);
-		switch (driver_mode){
-		case MODE_DEFAULT:
-		case MODE_SINGLE:
-			rm_buffer(0);
-			break;
-		case MODE_MULTI:	
-			rm_buffer(buf_node->pid);	
+	if (!(buf_node->ev_mask & event))
+		return;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+	eventfd_signal(buf_node->evfd);
+#else
+	eventfd_signal(buf_node->evfd, 1);
+#endif
+}
+
+/*
+ * Low latency mode: spin with lock released until reader sees need more
+ * bytes written (or writer has gone), or writer sees room for need bytes.
+ * Called and returns with device lock held. Budget is doubled after success and
+ * halved after failure, so useless spinning fades out.
+ * Returns true if sleep is not needed.
+ */
+static bool buffer_spin(struct rb_buf_node *buf_node, bool reader, int need)
+{
+	unsigned int *budget = reader ? &buf_node->rx_spin_ns : &buf_node->tx_spin_ns;
+	unsigned int limit = *budget;
+	u64 tail = buf_node->tail_off;
+	bool hit = false;
+	u64 start;
+
+	if (!(buf_node->flags & SBERTASK_CH_LOWLAT))
+		return false;
+	spin_unlock(&buf_node->sdev->lock);
+	start = local_clock();
+	do {
+		if (reader ? READ_ONCE(buf_node->tail_off) - tail >= need || READ_ONCE(buf_node->finished)
+			   : buffer_depth(buf_node) - READ_ONCE(buf_node->buffer_length) -
+			     READ_ONCE(buf_node->leased) >= need){
+			hit = true;
 			break;
-		default:
-			pr_err("sbertask: indefined behavior in module_stop()\n");
 		}
-		spin_unlock(&buffer_lock);
+		cpu_relax();
+	} while (!need_resched() && local_clock() - start < limit);
+	spin_lock(&buf_node->sdev->lock);
+
+	if (reader){
+		buf_node->stats.rx_spins++;
+		buf_node->stats.rx_spin_hits += hit;
+	} else {
+		buf_node->stats.tx_spins++;
+		buf_node->stats.tx_spin_hits += hit;
 	}
+	if (hit)
+		*budget = min(*budget * 2, buf_node->spin_max_ns);
+	else
+		*budget = max_t(unsigned int, *budget / 2, min_t(unsigned int, SPIN_MIN_NS, buf_node->spin_max_ns));
+	return hit;
+}
+
+static void elements_free(struct list_head *elements)
+{
+	struct buffer_element *queue_iter, *queue_iter_next;
+
+	list_for_each_entry_safe(queue_iter, queue_iter_next, elements, list)
+		kmem_cache_free(buffer_cache, queue_iter);
+	INIT_LIST_HEAD(elements);
+}
+
+/* Sweep channel when record expires, even if nobody reads it. Caller holds device lock. */
+static void ttl_arm(struct rb_buf_node *buf_node, ktime_t expires)
+{
+	s64 delay = ktime_to_ns(ktime_sub(expires, ktime_get()));
+
+	if (delayed_work_pending(&buf_node->ttl_work) && !ktime_before(expires, buf_node->ttl_next))
+		return;
+	buf_node->ttl_next = expires;
+	mod_delayed_work(system_wq, &buf_node->ttl_work,
+			 max(nsecs_to_jiffies(max_t(s64, delay, 0)) + 1, msecs_to_jiffies(TTL_SWEEP_MS)));
+}
+
+/*
+ * Link length elements of record to queue tail. They are new ones from
+ * buffer_put() or expired record of other channel. Caller holds device lock.
+ * Returns false if there is no queue list, elements are not taken then.
+ */
+static bool buffer_queue(struct rb_buf_node *buf_node, struct list_head *record, size_t length,
+			 unsigned int ttl_ms)
+{
+	unsigned char key[SBERTASK_KEY_MAX];
+	struct buffer_element *element;
+	ktime_t now = 0, expires = 0;
+	unsigned char part = 0;
+	size_t i = 0;
+
+	/* List head is allocated once and lives until rm_buffer() */
+	if (buf_node->buffer_head == NULL){
+		pr_info("sbertask: making new buffer's queue list\n");
+		buf_node->buffer_head = kmem_cache_alloc(buffer_cache, GFP_ATOMIC);
+		if (buf_node->buffer_head == NULL){
+			pr_err("sbertask: can't allocate buffer element!\n");
+			return false;
+		}
+		INIT_LIST_HEAD(&buf_node->buffer_head->list);
+		buf_node->buffer_tail = buf_node->buffer_head;
+	}
+	/* Log is kept and searched by age, CoDel drops by it */
+	if (buf_node->flags & (SBERTASK_CH_TSTAMP | SBERTASK_CH_LOG | SBERTASK_CH_CODEL)){
+		now = ktime_get();
+		buf_node->last_enqueue = now;
+	}
+	/* Cursors are offsets, records can't go out of broadcast or log middle */
+	if (ttl_ms && !(buf_node->flags & CH_CURSOR))
+		expires = ktime_add_ms(now ? now : ktime_get(), ttl_ms);
+	/* Records with the same key go to the same group reader */
+	if (buf_node->flags & SBERTASK_CH_GROUP){
+		list_for_each_entry(element, record, list){
+			if (i == buf_node->key_bytes)
+				break;
+			key[i++] = element->data;
+		}
+		part = jhash(key, i, 0) % buf_node->partitions;
+	}
+	if (buf_node->buffer_length == 0){
+		/* First unread byte, reader's max delay counts from here */
+		buf_node->first_byte = now ? now : ktime_get();
+		buf_node->rx_expired = 0;
+		if (buf_node->rx_waiting && buf_node->wake_delay)
+			hrtimer_start(&buf_node->rx_timer, ns_to_ktime((u64)buf_node->wake_delay * NSEC_PER_USEC),
+				      HRTIMER_MODE_REL);
+	}
+	list_for_each_entry(element, record, list){
+		element->flags = 0;
+		element->part = part;
+		element->seq = buf_node->seq_next;
+		element->tstamp = now;
+		element->expires = expires;
+		if (element->data == buf_node->delimiter)
+			buf_node->delim_count++;
+		if (expires)
+			buf_node->ttl_bytes++;
+	}
+	list_splice_tail_init(record, &buf_node->buffer_head->list);
+	buf_node->buffer_tail = list_last_entry(&buf_node->buffer_head->list, struct buffer_element, list);
+	buf_node->buffer_tail->flags |= ELEMENT_EOR;
+	buf_node->buffer_length += length;
+	buf_node->part_bytes[part] += length;
+	buf_node->tail_off += length;
+	buf_node->seq_next++;
+	if (buf_node->buffer_length == length)
+		buffer_event(buf_node, SBERTASK_EV_DATA);
+	/* Sleeping readers are woken only when enough is queued or queue is full */
+	if (buf_node->buffer_length >= buf_node->wake_min || buffer_room(buf_node) <= 0)
+		buf_node->read_ready = 1;
+	if (expires)
+		ttl_arm(buf_node, expires);
+	return true;
+}
+
+/*
+ * Append bytes to queue tail as one record. Caller holds device lock.
+ * Returns number of queued bytes, it is less than length if queue is full.
+ */
+static size_t buffer_put(struct rb_buf_node *buf_node, const char *data, size_t length, unsigned int ttl_ms)
+{
+	struct buffer_element *element;
+	LIST_HEAD(record);
+	size_t i, room = max(buffer_room(buf_node), 0);
+
+	for (i = 0; i < length && i < room; i++){
+		element = kmem_cache_alloc(buffer_cache, GFP_ATOMIC);
+		if (element == NULL){
+			pr_err("sbertask: can't allocate buffer element!\n");
+			break;
+		}
+		element->data = data[i];
+		list_add_tail(&element->list, &record);
+		pr_debug("sbertask: getted '%c'\n", element->data);
+	}
+	if (i && !buffer_queue(buf_node, &record, i, ttl_ms)){
+		elements_free(&record);
+		return 0;
+	}
+	return i;
+}
+
+/* New queue depth. Limits left at old depth follow it, bigger ones are cut. */
+static void channel_resize(struct rb_buf_node *buf_node, unsigned int capacity)
+{
+	unsigned int *limits[] = { &buf_node->max_record, &buf_node->chunk,
+				   &buf_node->lag_limit, &buf_node->retain_bytes };
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(limits); i++)
+		if (*limits[i] == buf_node->capacity || *limits[i] > capacity)
+			*limits[i] = capacity;
+	if (buf_node->ev_space == buf_node->capacity || buf_node->ev_space > capacity)
+		buf_node->ev_space = capacity;
+	if (buf_node->wake_min > capacity)
+		buf_node->wake_min = capacity;
+	buf_node->capacity = capacity;
+}
+
+static void channel_set_flags(struct rb_buf_node *buf_node, unsigned int flags)
+{
+	buf_node->flags = flags;
+	/* Record longer than lag limit or log size would never fit */
+	if (flags & SBERTASK_CH_BROADCAST)
+		buf_node->max_record = min(buf_node->max_record, buf_node->lag_limit);
+	if (flags & SBERTASK_CH_LOG)
+		buf_node->max_record = min(buf_node->max_record, buf_node->retain_bytes);
+}
+
+/*
+ * Apply device changes when channel holds no bytes. Flags also wait for
+ * readers with cursors or partitions to leave. Caller holds device lock.
+ */
+static void channel_apply_pending(struct rb_buf_node *buf_node)
+{
+	if (!buf_node->pending || buf_node->buffer_length || buf_node->leased)
+		return;
+	if (buf_node->pending & PENDING_CAPACITY){
+		channel_resize(buf_node, buf_node->pending_capacity);
+		buf_node->pending &= ~PENDING_CAPACITY;
+		buf_node->write_ready = 1;
+	}
+	if ((buf_node->pending & PENDING_FLAGS) && list_empty(&buf_node->readers)){
+		channel_set_flags(buf_node, buf_node->pending_flags);
+		buf_node->pending &= ~PENDING_FLAGS;
+	}
+}
+
+/* Take element out of queue, to lease or back to cache. Caller holds device lock. */
+static void buffer_unlink(struct rb_buf_node *buf_node, struct buffer_element *element, struct list_head *lease)
+{
+	if (element->data == buf_node->delimiter)
+		buf_node->delim_count--;
+	buf_node->part_bytes[element->part]--;
+	if (element->expires)
+		buf_node->ttl_bytes--;
+	list_del(&element->list);
+	if (lease)
+		list_add_tail(&element->list, lease);
+	else
+		kmem_cache_free(buffer_cache, element);
+}
+
+/* Account count bytes taken out of queue by buffer_unlink(). Caller holds device lock. */
+static void buffer_unlinked(struct rb_buf_node *buf_node, size_t count, struct list_head *lease)
+{
+	if (!count)
+		return;
+	if (!lease && buffer_room(buf_node) < buf_node->ev_space &&
+	    buffer_room(buf_node) + count >= buf_node->ev_space)
+		buffer_event(buf_node, SBERTASK_EV_SPACE);
+	buf_node->buffer_length -= count;
+	if (lease)
+		buf_node->leased += count;
+	else
+		buf_node->write_ready = 1;
+	if (buf_node->buffer_length == 0){
+		buf_node->read_ready = 0;
+		buf_node->buffer_tail = buf_node->buffer_head;
+		buf_node->rx_expired = 0;
+		hrtimer_try_to_cancel(&buf_node->rx_timer);
+		channel_apply_pending(buf_node);
+	} else
+		/* Group reader may take the last record out of queue middle */
+		buf_node->buffer_tail = list_last_entry(&buf_node->buffer_head->list, struct buffer_element, list);
+}
+
+/* Note record of byte given to reader, caller takes it under the same lock */
+static inline void rx_note(struct rb_buf_node *buf_node, struct buffer_element *element, bool first)
+{
+	if (first){
+		buf_node->rx_seq_first = element->seq;
+		buf_node->rx_marks = 0;
+	}
+	buf_node->rx_seq_last = element->seq;
+	if (element->flags & ELEMENT_MARK)
+		buf_node->rx_marks++;
+}
+
+/*
+ * Times of record being read. LOG and CODEL channels stamp records for
+ * themselves, but times are reported only with SBERTASK_CH_TSTAMP.
+ */
+static void rx_tstamp(struct rb_buf_node *buf_node, struct buffer_element *element,
+		      struct sbertask_tstamp *tstamp)
+{
+	if (buf_node->flags & SBERTASK_CH_TSTAMP){
+		tstamp->enqueue_ns = ktime_to_ns(element->tstamp);
+		tstamp->dequeue_ns = ktime_get_ns();
+	} else {
+		tstamp->enqueue_ns = 0;
+		tstamp->dequeue_ns = 0;
+	}
+}
+
+/*
+ * Move up to length bytes from queue head to data. Caller holds device lock.
+ * GET_RECORD stops at the end of head record and drops its bytes which
+ * don't fit, like pipe in packet mode. GET_LINE stops after delimiter, rest
+ * of long line stays for next read. If tstamp is given, it gets times of
+ * first moved byte. Without data bytes are just freed. With lease taken
+ * elements are moved to it instead of freeing, they keep their queue room.
+ * Returns number of moved bytes.
+ */
+static size_t buffer_get(struct rb_buf_node *buf_node, char *data, size_t length, int how,
+			 struct sbertask_tstamp *tstamp, struct list_head *lease)
+{
+	bool record = how == GET_RECORD;
+	struct buffer_element *queue_iter, *queue_iter_next;
+	size_t c = 0, dropped = 0;
+	unsigned char flags;
+	bool delim;
+
+	if (!buf_node->buffer_length)
+		return 0;
+	if (tstamp){
+		queue_iter = list_first_entry(&buf_node->buffer_head->list, struct buffer_element, list);
+		rx_tstamp(buf_node, queue_iter, tstamp);
+	}
+	list_for_each_entry_safe(queue_iter, queue_iter_next, &buf_node->buffer_head->list, list){
+		if (c >= length && !record)
+			break;
+		if (c < length){
+			if (data){
+				rx_note(buf_node, queue_iter, !c);
+				data[c] = queue_iter->data;
+			}
+			c++;
+			pr_debug("sbertask: sended '%c'\n", queue_iter->data);
+		} else
+			dropped++;
+		flags = queue_iter->flags;
+		delim = queue_iter->data == buf_node->delimiter;
+		buffer_unlink(buf_node, queue_iter, lease);
+		if (record && (flags & ELEMENT_EOR))
+			break;
+		if (how == GET_LINE && delim)
+			break;
+	}
+	if (dropped)
+		pr_info("sbertask: %zu bytes of record dropped, read buffer is too small\n", dropped);
+	buffer_unlinked(buf_node, c + dropped, lease);
+	return c;
+}
+
+/* Log mode: free records older than retain_ms. Caller holds device lock. */
+static void log_expire(struct rb_buf_node *buf_node)
+{
+	struct buffer_element *queue_iter;
+	ktime_t oldest;
+	size_t expired = 0;
+
+	if (!buf_node->retain_ms || !buf_node->buffer_length)
+		return;
+	oldest = ktime_sub(ktime_get(), ms_to_ktime(buf_node->retain_ms));
+	/* Bytes of one record have the same stamp, so records go whole */
+	list_for_each_entry(queue_iter, &buf_node->buffer_head->list, list){
+		if (!ktime_before(queue_iter->tstamp, oldest))
+			break;
+		expired++;
+	}
+	if (expired)
+		buffer_get(buf_node, NULL, expired, GET_STREAM, NULL, NULL);
+}
+
+/*
+ * Broadcast mode: free bytes passed by all reader cursors and not held by
+ * reads still copying them. Bytes written while channel has no readers
+ * are freed at once, nobody would read them.
+ * Log mode: free expired records, readers don't hold them.
+ * Caller holds device lock.
+ */
+static void buffer_trim(struct rb_buf_node *buf_node)
+{
+	struct sbertask_file *reader;
+	u64 passed = buf_node->tail_off;
+
+	if (buf_node->flags & SBERTASK_CH_LOG){
+		log_expire(buf_node);
+		return;
+	}
+	if (!(buf_node->flags & SBERTASK_CH_BROADCAST))
+		return;
+	list_for_each_entry(reader, &buf_node->readers, reader_list)
+		passed = min(passed, reader->holds ? reader->hold : reader->cursor);
+	if (passed > buffer_head_off(buf_node))
+		buffer_get(buf_node, NULL, passed - buffer_head_off(buf_node), GET_STREAM, NULL, NULL);
+}
+
+/*
+ * Group mode: deal partitions to readers round robin in join order and
+ * wake them to look at their new partitions. Caller holds device lock.
+ */
+static void group_rebalance(struct rb_buf_node *buf_node)
+{
+	struct sbertask_file *reader;
+	unsigned int members = 0, i = 0, part;
+
+	if (!(buf_node->flags & SBERTASK_CH_GROUP))
+		return;
+	list_for_each_entry(reader, &buf_node->readers, reader_list)
+		members++;
+	list_for_each_entry(reader, &buf_node->readers, reader_list){
+		reader->parts = 0;
+		for (part = i++; part < buf_node->partitions; part += members)
+			reader->parts |= BIT_ULL(part);
+	}
+	buf_node->group_gen++;
+	buf_node->stats.rebalances++;
+	wake_up_interruptible_all(&buf_node->read_wq);
+}
+
+/* Hash keys of queued records again after group config change. Caller holds device lock. */
+static void group_repartition(struct rb_buf_node *buf_node)
+{
+	struct buffer_element *queue_iter, *record = NULL;
+	unsigned char key[SBERTASK_KEY_MAX];
+	unsigned int len = 0, count = 0;
+	unsigned char part;
+
+	memset(buf_node->part_bytes, 0, sizeof(buf_node->part_bytes));
+	if (!buf_node->buffer_length)
+		return;
+	list_for_each_entry(queue_iter, &buf_node->buffer_head->list, list){
+		if (record == NULL){
+			record = queue_iter;
+			len = count = 0;
+		}
+		count++;
+		if (len < buf_node->key_bytes)
+			key[len++] = queue_iter->data;
+		if (!(queue_iter->flags & ELEMENT_EOR))
+			continue;
+		part = jhash(key, len, 0) % buf_node->partitions;
+		for (; record != queue_iter; record = list_next_entry(record, list))
+			record->part = part;
+		queue_iter->part = part;
+		buf_node->part_bytes[part] += count;
+		record = NULL;
+	}
+}
+
+/* Bytes held for leaving reader may be freed, its partitions go to others. Caller holds device lock. */
+static void reader_detach(struct sbertask_file *file_ctx)
+{
+	struct rb_buf_node *buf_node = file_ctx->reader_node;
+
+	list_del(&file_ctx->reader_list);
+	file_ctx->reader_node = NULL;
+	file_ctx->parts = 0;
+	file_ctx->holds = 0;
+	buffer_trim(buf_node);
+	group_rebalance(buf_node);
+	channel_apply_pending(buf_node);
+}
+
+/*
+ * Where cursor of joining reader starts: channel tail, or tail at open for
+ * file opened on this channel, as far as those bytes are still queued.
+ * Caller holds device lock.
+ */
+static u64 reader_start(struct sbertask_file *file_ctx, struct rb_buf_node *buf_node)
+{
+	if (file_ctx->open_node != buf_node)
+		return buf_node->tail_off;
+	return clamp(file_ctx->open_off, buffer_head_off(buf_node), buf_node->tail_off);
+}
+
+/*
+ * Attach file to channel which knows its readers, done on first read or
+ * seek, so file which never reads holds no data. Cursor is put by
+ * reader_start(), log reader seeks back for older bytes. Group reader gets
+ * its partitions. Caller holds device lock.
+ */
+static void reader_attach(struct sbertask_file *file_ctx, struct rb_buf_node *buf_node)
+{
+	if (file_ctx->reader_node == buf_node)
+		return;
+	if (file_ctx->reader_node)
+		reader_detach(file_ctx);
+	file_ctx->reader_node = buf_node;
+	file_ctx->cursor = reader_start(file_ctx, buf_node);
+	file_ctx->open_node = NULL;
+	list_add_tail(&file_ctx->reader_list, &buf_node->readers);
+	group_rebalance(buf_node);
+}
+
+/* Readable file of broadcast or log channel will join from tail it sees now. Caller holds device lock. */
+static void reader_open(struct sbertask_file *file_ctx, struct rb_buf_node *buf_node, fmode_t mode)
+{
+	if (!(buf_node->flags & CH_CURSOR) || !(mode & FMODE_READ))
+		return;
+	file_ctx->open_node = buf_node;
+	file_ctx->open_off = buf_node->tail_off;
+}
+
+/*
+ * Copy bytes after file's cursor and move it, bytes stay queued for other
+ * readers. Splits queue like buffer_get(), line mode is not used with
+ * broadcast. Caller holds device lock.
+ */
+static size_t cursor_get(struct rb_buf_node *buf_node, struct sbertask_file *file_ctx, char *data,
+			 size_t length, int how, struct sbertask_tstamp *tstamp)
+{
+	struct buffer_element *queue_iter;
+	size_t c = 0, passed = 0;
+	u64 skip;
+
+	file_ctx->cursor = max(file_ctx->cursor, buffer_head_off(buf_node));
+	if (file_ctx->cursor >= buf_node->tail_off)
+		return 0;
+	skip = file_ctx->cursor - buffer_head_off(buf_node);
+	list_for_each_entry(queue_iter, &buf_node->buffer_head->list, list){
+		if (skip){
+			skip--;
+			continue;
+		}
+		if (c >= length && how != GET_RECORD)
+			break;
+		if (!passed && tstamp){
+			rx_tstamp(buf_node, queue_iter, tstamp);
+		}
+		if (c < length){
+			rx_note(buf_node, queue_iter, !c);
+			data[c++] = queue_iter->data;
+		}
+		passed++;
+		if (how == GET_RECORD && (queue_iter->flags & ELEMENT_EOR))
+			break;
+	}
+	if (passed > c)
+		pr_info("sbertask: %zu bytes of record dropped, read buffer is too small\n", passed - c);
+	file_ctx->cursor += passed;
+	return c;
+}
+
+/*
+ * Group mode: take records of reader's partitions, records of other
+ * partitions stay queued for their readers. Splits records and keeps
+ * them in lease like buffer_get(). Caller holds device lock.
+ */
+static size_t group_get(struct rb_buf_node *buf_node, u64 parts, char *data, size_t length, int how,
+			struct sbertask_tstamp *tstamp, struct list_head *lease)
+{
+	struct buffer_element *queue_iter, *queue_iter_next;
+	size_t c = 0, dropped = 0;
+	unsigned char flags;
+
+	if (!buf_node->buffer_length)
+		return 0;
+	list_for_each_entry_safe(queue_iter, queue_iter_next, &buf_node->buffer_head->list, list){
+		if (!(parts & BIT_ULL(queue_iter->part)))
+			continue;
+		if (c >= length && how != GET_RECORD)
+			break;
+		if (!c && !dropped && tstamp){
+			rx_tstamp(buf_node, queue_iter, tstamp);
+		}
+		if (c < length){
+			rx_note(buf_node, queue_iter, !c);
+			data[c++] = queue_iter->data;
+		} else
+			dropped++;
+		flags = queue_iter->flags;
+		buffer_unlink(buf_node, queue_iter, lease);
+		if (how == GET_RECORD && (flags & ELEMENT_EOR))
+			break;
+	}
+	if (dropped)
+		pr_info("sbertask: %zu bytes of record dropped, read buffer is too small\n", dropped);
+	buffer_unlinked(buf_node, c + dropped, lease);
+	return c;
+}
+
+/*
+ * Ack mode: take bytes like buffer_get() and keep them in new lease of
+ * file. Uses lease allocated before lock, or atomic one for next records
+ * of batched read. Caller holds device lock.
+ */
+static ssize_t lease_get(struct sbertask_file *file_ctx, struct rb_buf_node *buf_node, char *data,
+			size_t length, int how, struct sbertask_tstamp *tstamp)
+{
+	struct buffer_lease *lease = file_ctx->spare_lease;
+	size_t c;
+
+	if (lease == NULL)
+		lease = kmalloc(sizeof(*lease), GFP_ATOMIC);
+	if (lease == NULL)
+		return -ENOMEM;
+	file_ctx->spare_lease = lease;
+	INIT_LIST_HEAD(&lease->elements);
+	lease->length = buf_node->leased;
+	c = buffer_get(buf_node, data, length, how, tstamp, &lease->elements);
+	if (list_empty(&lease->elements))
+		return c;
+	file_ctx->spare_lease = NULL;
+	lease->length = buf_node->leased - lease->length;
+	lease->buf_node = buf_node;
+	lease->owner = file_ctx;
+	lease->id = ++file_ctx->lease_seq;
+	lease->expires = ktime_add_ms(ktime_get(), buf_node->lease_ms);
+	list_add_tail(&lease->list, &buf_node->leases);
+	list_add_tail(&lease->file_list, &file_ctx->leases);
+	if (buf_node->lease_ms)
+		schedule_delayed_work(&buf_node->lease_work, msecs_to_jiffies(buf_node->lease_ms));
+	return c;
+}
+
+static void lease_free(struct buffer_lease *lease)
+{
+	list_del(&lease->list);
+	list_del(&lease->file_list);
+	kfree(lease);
+}
+
+/* Writers get room of length bytes held out of queue. Caller holds device lock. */
+static void buffer_release(struct rb_buf_node *buf_node, size_t length)
+{
+	if (!length)
+		return;
+	if (buffer_room(buf_node) < buf_node->ev_space && buffer_room(buf_node) + length >= buf_node->ev_space)
+		buffer_event(buf_node, SBERTASK_EV_SPACE);
+	buf_node->leased -= length;
+	buf_node->write_ready = 1;
+	channel_apply_pending(buf_node);
+}
+
+/* Put elements taken from queue head back to it. Caller holds device lock. */
+static void buffer_requeue(struct rb_buf_node *buf_node, struct list_head *elements)
+{
+	struct buffer_element *queue_iter;
+	size_t length = 0;
+
+	if (list_empty(elements))
+		return;
+	list_for_each_entry(queue_iter, elements, list){
+		if (queue_iter->data == buf_node->delimiter)
+			buf_node->delim_count++;
+		buf_node->part_bytes[queue_iter->part]++;
+		if (queue_iter->expires){
+			buf_node->ttl_bytes++;
+			ttl_arm(buf_node, queue_iter->expires);
+		}
+		length++;
+	}
+	if (buf_node->buffer_length == 0){
+		buf_node->buffer_tail = list_last_entry(elements, struct buffer_element, list);
+		buf_node->first_byte = ktime_get();
+	}
+	list_splice_init(elements, &buf_node->buffer_head->list);
+	buf_node->buffer_length += length;
+	buf_node->read_ready = 1;
+}
+
+/* Acknowledged bytes are freed, writers get their room. Caller holds device lock. */
+static void lease_commit(struct buffer_lease *lease)
+{
+	struct rb_buf_node *buf_node = lease->buf_node;
+	size_t length = lease->length;
+
+	elements_free(&lease->elements);
+	lease_free(lease);
+	buffer_release(buf_node, length);
+}
+
+/* Put leased bytes back to queue head, lease must be the newest one of channel. Caller holds device lock. */
+static void lease_requeue(struct buffer_lease *lease)
+{
+	struct rb_buf_node *buf_node = lease->buf_node;
+
+	buffer_requeue(buf_node, &lease->elements);
+	buf_node->leased -= lease->length;
+	lease_free(lease);
+}
+
+/*
+ * Put lease back to queue head, next read gets it again. Newer leases of
+ * channel, other readers' too, go back before it, so queue keeps its order
+ * and their acks fail. Caller holds device lock.
+ * Returns number of returned leases.
+ */
+static int lease_return(struct buffer_lease *lease)
+{
+	struct rb_buf_node *buf_node = lease->buf_node;
+	bool empty = buf_node->buffer_length == 0;
+	struct buffer_lease *newest;
+	int n = 0;
+
+	do {
+		newest = list_last_entry(&buf_node->leases, struct buffer_lease, list);
+		lease_requeue(newest);
+		n++;
+	} while (newest != lease);
+	if (empty)
+		buffer_event(buf_node, SBERTASK_EV_DATA);
+	return n;
+}
+
+/* Return leases which were not acknowledged in lease_ms, with all newer ones */
+static void lease_timeout(struct work_struct *work)
+{
+	struct rb_buf_node *buf_node = container_of(to_delayed_work(work), struct rb_buf_node, lease_work);
+	struct buffer_lease *lease, *expired = NULL;
+	ktime_t now = ktime_get(), next = KTIME_MAX;
+	bool returned = false;
+
+	spin_lock(&buf_node->sdev->lock);
+	/* Oldest first, older leases which are still valid stay with their readers */
+	list_for_each_entry(lease, &buf_node->leases, list){
+		if (!ktime_before(now, lease->expires)){
+			if (expired == NULL)
+				expired = lease;
+			buf_node->stats.lease_timeouts++;
+		} else if (expired == NULL)
+			next = min(next, lease->expires);
+	}
+	if (expired){
+		lease_return(expired);
+		returned = true;
+	}
+	if (next != KTIME_MAX)
+		schedule_delayed_work(&buf_node->lease_work, nsecs_to_jiffies(ktime_to_ns(ktime_sub(next, now))) + 1);
+	spin_unlock(&buf_node->sdev->lock);
+	if (returned){
+		pr_info("sbertask: lease timeout, data returned to queue\n");
+		buffer_wake_readers(buf_node);
+	}
+}
+
+/* Offset of first record start at or after offset, tail if there is none */
+static u64 buffer_record_start(struct rb_buf_node *buf_node, u64 offset)
+{
+	struct buffer_element *queue_iter;
+	u64 pos = buffer_head_off(buf_node);
+
+	list_for_each_entry(queue_iter, &buf_node->buffer_head->list, list){
+		pos++;
+		if (pos >= offset && (queue_iter->flags & ELEMENT_EOR))
+			return pos;
+	}
+	return buf_node->tail_off;
+}
+
+/*
+ * CoDel (RFC 8289): head record may go when its queue delay stayed over
+ * target for interval. The only record is kept, reader came for it.
+ */
+static bool codel_ok_to_drop(struct rb_buf_node *buf_node, ktime_t now)
+{
+	struct buffer_element *head;
+	u64 head_off = buffer_head_off(buf_node);
+
+	if (!buf_node->buffer_length || buffer_record_start(buf_node, head_off + 1) >= buf_node->tail_off){
+		buf_node->codel_first_above = 0;
+		return false;
+	}
+	head = list_first_entry(&buf_node->buffer_head->list, struct buffer_element, list);
+	/* Queued before CoDel was on, age is unknown */
+	if (!head->tstamp || ktime_us_delta(now, head->tstamp) < buf_node->codel_target_us){
+		buf_node->codel_first_above = 0;
+		return false;
+	}
+	if (!buf_node->codel_first_above){
+		buf_node->codel_first_above = ktime_add_us(now, buf_node->codel_interval_us);
+		return false;
+	}
+	return !ktime_before(now, buf_node->codel_first_above);
+}
+
+/* Next drop comes sooner as drops go on: interval / sqrt(count) */
+static ktime_t codel_control_law(struct rb_buf_node *buf_node, ktime_t t)
+{
+	return ktime_add_ns(t, div_u64((u64)buf_node->codel_interval_us * NSEC_PER_USEC,
+				       int_sqrt(max(buf_node->codel_count, 1u))));
+}
+
+/* Drop head record, or mark it with SBERTASK_CH_ECN. Returns true if record stays queued. */
+static bool codel_signal(struct rb_buf_node *buf_node)
+{
+	struct buffer_element *head = list_first_entry(&buf_node->buffer_head->list, struct buffer_element, list);
+	u64 head_off = buffer_head_off(buf_node);
+
+	if (buf_node->flags & SBERTASK_CH_ECN){
+		if (!(head->flags & ELEMENT_MARK)){
+			head->flags |= ELEMENT_MARK;
+			buf_node->stats.codel_marks++;
+		}
+		return true;
+	}
+	buffer_get(buf_node, NULL, buffer_record_start(buf_node, head_off + 1) - head_off, GET_STREAM, NULL, NULL);
+	buf_node->stats.codel_drops++;
+	return false;
+}
+
+/* CoDel state machine, runs before each read takes queue head. Caller holds device lock. */
+static void codel_dequeue(struct rb_buf_node *buf_node)
+{
+	ktime_t now = ktime_get();
+	bool drop = codel_ok_to_drop(buf_node, now);
+	u32 delta;
+
+	if (buf_node->codel_dropping){
+		if (!drop){
+			buf_node->codel_dropping = false;
+			return;
+		}
+		while (buf_node->codel_dropping && !ktime_before(now, buf_node->codel_drop_next)){
+			buf_node->codel_count++;
+			buf_node->codel_drop_next = codel_control_law(buf_node, buf_node->codel_drop_next);
+			/* Marked record goes to reader */
+			if (codel_signal(buf_node))
+				return;
+			if (!codel_ok_to_drop(buf_node, now))
+				buf_node->codel_dropping = false;
+		}
+		return;
+	}
+	if (!drop)
+		return;
+	codel_signal(buf_node);
+	buf_node->codel_dropping = true;
+	/* Delay came back soon, start from drop rate it had */
+	delta = buf_node->codel_count - buf_node->codel_lastcount;
+	if (delta > 1 && ktime_us_delta(now, buf_node->codel_drop_next) < 16 * (s64)buf_node->codel_interval_us)
+		buf_node->codel_count = delta;
+	else
+		buf_node->codel_count = 1;
+	buf_node->codel_lastcount = buf_node->codel_count;
+	buf_node->codel_drop_next = codel_control_law(buf_node, now);
+}
+
+/*
+ * What read took from channel while its copy to user is not done: queue
+ * elements, cursor and lease number before read. Failed copy puts it all
+ * back, so bad user buffer loses no bytes.
+ */
+struct rx_undo {
+	struct list_head elements;
+	struct rb_buf_node *buf_node;
+	struct sbertask_file *file_ctx;		/* reader, NULL - bytes come from queue head only */
+	u64 	cursor;
+	u64 	lease_seq;
+	bool 	held;
+};
+
+/* Start read of file from channel, file_ctx is NULL for gather and merge. Caller holds device lock. */
+static void rx_undo_begin(struct rx_undo *undo, struct sbertask_file *file_ctx, struct rb_buf_node *buf_node)
+{
+	INIT_LIST_HEAD(&undo->elements);
+	undo->buf_node = buf_node;
+	undo->file_ctx = file_ctx;
+	undo->held = false;
+	if (file_ctx == NULL)
+		return;
+	undo->cursor = file_ctx->cursor;
+	undo->lease_seq = file_ctx->lease_seq;
+	/* Broadcast bytes are not freed until copy is done, other readers may pass them */
+	undo->held = (buf_node->flags & SBERTASK_CH_BROADCAST) && file_ctx->reader_node == buf_node;
+	if (undo->held && !file_ctx->holds++)
+		file_ctx->hold = file_ctx->cursor;
+}
+
+/* Let held broadcast bytes go. Caller holds device lock. */
+static void rx_unhold(struct rx_undo *undo)
+{
+	struct sbertask_file *file_ctx = undo->file_ctx;
+
+	if (!undo->held || file_ctx->reader_node != undo->buf_node || !file_ctx->holds)
+		return;
+	if (--file_ctx->holds == 0)
+		buffer_trim(undo->buf_node);
+}
+
+/* Copy to user is done, taken bytes are freed. Called without lock. */
+static void rx_undo_end(struct rx_undo *undo)
+{
+	struct rb_buf_node *buf_node = undo->buf_node;
+
+	elements_free(&undo->elements);
+	if (!undo->held)
+		return;
+	spin_lock(&buf_node->sdev->lock);
+	rx_unhold(undo);
+	spin_unlock(&buf_node->sdev->lock);
+	buffer_wake(buf_node, &buf_node->write_wq);
+}
+
+/* Copy to user failed, channel gets bytes back for next read. Called without lock. */
+static void rx_undo_abort(struct rx_undo *undo)
+{
+	struct rb_buf_node *buf_node = undo->buf_node;
+	struct sbertask_file *file_ctx = undo->file_ctx;
+	struct buffer_lease *lease;
+	bool empty;
+
+	spin_lock(&buf_node->sdev->lock);
+	if (!list_empty(&undo->elements)){
+		empty = buf_node->buffer_length == 0;
+		buffer_requeue(buf_node, &undo->elements);
+		if (empty)
+			buffer_event(buf_node, SBERTASK_EV_DATA);
+	}
+	if (file_ctx == NULL)
+		goto unlock;
+	if (file_ctx->reader_node == buf_node && (buf_node->flags & CH_CURSOR))
+		file_ctx->cursor = undo->held && file_ctx->holds ? file_ctx->hold : undo->cursor;
+	rx_unhold(undo);
+	/* Leases of read go back with newer ones, like on timeout */
+	list_for_each_entry(lease, &file_ctx->leases, file_list)
+		if (lease->id > undo->lease_seq){
+			lease_return(lease);
+			break;
+		}
+unlock:
+	spin_unlock(&buf_node->sdev->lock);
+	buffer_wake_readers(buf_node);
+}
+
+/* Take bytes from queue head to undo, writers get their room at once. Caller holds device lock. */
+static size_t rx_take(struct rb_buf_node *buf_node, char *data, size_t length, int how,
+		      struct sbertask_tstamp *tstamp, struct rx_undo *undo)
+{
+	int leased = buf_node->leased;
+	size_t c;
+
+	c = buffer_get(buf_node, data, length, how, tstamp, &undo->elements);
+	buffer_release(buf_node, buf_node->leased - leased);
+	return c;
+}
+
+/*
+ * Take bytes for reader: from own cursor in broadcast and log mode, from
+ * queue head otherwise. Taken elements go to undo, writers get their room
+ * at once. Caller holds device lock.
+ */
+static ssize_t rx_get(struct file *file_p, struct rb_buf_node *buf_node, char *data, size_t length, int how,
+		     struct sbertask_tstamp *tstamp, struct rx_undo *undo)
+{
+	struct sbertask_file *file_ctx = file_p->private_data;
+	int leased = buf_node->leased;
+	size_t c;
+
+	rx_expire(buf_node);
+	if (buf_node->flags & SBERTASK_CH_CODEL)
+		codel_dequeue(buf_node);
+	if (buf_node->flags & SBERTASK_CH_ACK)
+		return lease_get(file_ctx, buf_node, data, length, how, tstamp);
+	if (buf_node->flags & CH_CURSOR){
+		if (file_ctx->reader_node != buf_node)
+			return 0;
+		c = cursor_get(buf_node, file_ctx, data, length, how, tstamp);
+		buffer_trim(buf_node);
+		return c;
+	}
+	if (!(buf_node->flags & SBERTASK_CH_GROUP))
+		return rx_take(buf_node, data, length, how, tstamp, undo);
+	if (file_ctx->reader_node != buf_node)
+		return 0;
+	c = group_get(buf_node, file_ctx->parts, data, length, how, tstamp, &undo->elements);
+	buffer_release(buf_node, buf_node->leased - leased);
+	return c;
+}
+
+/* Offset of first record written at or after tstamp, tail if there is none */
+static u64 buffer_find_tstamp(struct rb_buf_node *buf_node, ktime_t tstamp)
+{
+	struct buffer_element *queue_iter;
+	u64 pos = buffer_head_off(buf_node);
+	bool start = true;
+
+	if (!buf_node->buffer_length)
+		return buf_node->tail_off;
+	list_for_each_entry(queue_iter, &buf_node->buffer_head->list, list){
+		if (start && !ktime_before(queue_iter->tstamp, tstamp))
+			return pos;
+		start = queue_iter->flags & ELEMENT_EOR;
+		pos++;
+	}
+	return buf_node->tail_off;
+}
+
+/*
+ * Broadcast mode with SBERTASK_CH_DROPSLOW: readers which would lag more
+ * than lag_limit after need bytes are written skip to next record start,
+ * so writer doesn't wait for them. Caller holds device lock.
+ * Returns true if some reader was moved.
+ */
+static bool buffer_drop_slow(struct rb_buf_node *buf_node, int need)
+{
+	struct sbertask_file *reader;
+	u64 target, pos, next;
+	bool moved = false;
+
+	if ((buf_node->flags & (SBERTASK_CH_BROADCAST | SBERTASK_CH_DROPSLOW)) !=
+	    (SBERTASK_CH_BROADCAST | SBERTASK_CH_DROPSLOW))
+		return false;
+	if (buf_node->buffer_length + need <= buf_node->lag_limit)
+		return false;
+	target = min(buf_node->tail_off + need - buf_node->lag_limit, buf_node->tail_off);
+	list_for_each_entry(reader, &buf_node->readers, reader_list){
+		pos = max(reader->cursor, buffer_head_off(buf_node));
+		if (pos >= target && !(reader->holds && reader->hold < target))
+			continue;
+		next = buffer_record_start(buf_node, target);
+		if (pos < target){
+			buf_node->stats.lag_drops += next - pos;
+			reader->cursor = next;
+		}
+		/* Held bytes are let go too, failed copy doesn't get them back */
+		if (reader->holds)
+			reader->hold = min(max(reader->hold, next), reader->cursor);
+		moved = true;
+	}
+	if (moved)
+		buffer_trim(buf_node);
+	return moved;
+}
+
+/* Sequence number of record at queue head, next one if queue is empty */
+static u32 buffer_head_seq(struct rb_buf_node *buf_node)
+{
+	if (!buf_node->buffer_length)
+		return buf_node->seq_next;
+	return list_first_entry(&buf_node->buffer_head->list, struct buffer_element, list)->seq;
+}
+
+/*
+ * Make room for need bytes without waiting for readers: log and
+ * SBERTASK_CH_OVERWRITE channel drop their oldest records, broadcast
+ * channel may drop slow readers. Caller holds device lock.
+ * Returns true if something was freed.
+ */
+static bool buffer_make_room(struct rb_buf_node *buf_node, int need)
+{
+	u64 head = buffer_head_off(buf_node);
+	u32 seq;
+
+	if (!(buf_node->flags & (SBERTASK_CH_LOG | SBERTASK_CH_OVERWRITE)))
+		return buffer_drop_slow(buf_node, need);
+	if (buffer_room(buf_node) >= need || !buf_node->buffer_length)
+		return false;
+	seq = buffer_head_seq(buf_node);
+	need = min(need, buf_node->buffer_length + buffer_room(buf_node));
+	buffer_get(buf_node, NULL, buffer_record_start(buf_node, head + need - buffer_room(buf_node)) - head,
+		   GET_STREAM, NULL, NULL);
+	if (buf_node->flags & SBERTASK_CH_OVERWRITE)
+		buf_node->stats.overwrites += buffer_head_seq(buf_node) - seq;
+	return true;
+}
+
+/*
+ * SBERTASK_CH_DROPNEW: record which doesn't fit is lost at once, writer
+ * doesn't wait. It still takes sequence number, so readers see the gap.
+ * Caller holds device lock. Returns true if record was dropped.
+ */
+static bool buffer_drop_new(struct rb_buf_node *buf_node, int need)
+{
+	if (!(buf_node->flags & SBERTASK_CH_DROPNEW) || buffer_room(buf_node) >= need)
+		return false;
+	buf_node->seq_next++;
+	buf_node->stats.overflow_drops++;
+	return true;
+}
+
+/*
+ * Move expired record to dead letter channel, it takes record as new one
+ * without time to live. Caller holds device lock.
+ * Returns false if there is no room for it, record is not taken then.
+ */
+static bool dead_letter(struct rb_buf_node *dead, struct list_head *record, size_t len)
+{
+	buffer_make_room(dead, len);
+	if (buffer_room(dead) < (int)len)
+		return false;
+	return buffer_queue(dead, record, len, 0);
+}
+
+/*
+ * Take records whose time to live passed out of queue: from its head up to
+ * first live record, or from whole queue if all is set. First byte of
+ * record decides for all of it. Caller holds device lock.
+ * Returns dead letter channel if some records went there.
+ */
+static struct rb_buf_node *buffer_expire(struct rb_buf_node *buf_node, ktime_t now, bool all)
+{
+	struct buffer_element *queue_iter, *queue_iter_next;
+	struct rb_buf_node *dead = NULL;
+	bool expired = false, start = true, sent = false;
+	size_t count = 0, len = 0;
+	LIST_HEAD(record);
+
+	/* Cursors are offsets, records can't go out of queue middle */
+	if (!buf_node->ttl_bytes || (buf_node->flags & CH_CURSOR))
+		return NULL;
+	if (buf_node->dead_set)
+		dead = get_buffer(buf_node->sdev, buf_node->dead_key);
+	list_for_each_entry_safe(queue_iter, queue_iter_next, &buf_node->buffer_head->list, list){
+		if (start){
+			expired = queue_iter->expires && !ktime_before(now, queue_iter->expires);
+			if (!expired && !all)
+				break;
+			len = 0;
+		}
+		start = queue_iter->flags & ELEMENT_EOR;
+		if (!expired)
+			continue;
+		buffer_unlink(buf_node, queue_iter, &record);
+		len++;
+		if (!start)
+			continue;
+		count += len;
+		buf_node->stats.ttl_expired++;
+		if (dead && dead_letter(dead, &record, len)){
+			buf_node->stats.dead_letters++;
+			sent = true;
+		} else
+			elements_free(&record);
+	}
+	buffer_unlinked(buf_node, count, NULL);
+	return sent ? dead : NULL;
+}
+
+/* Expiry at dequeue, reader never gets stale record. Caller holds device lock. */
+static void rx_expire(struct rb_buf_node *buf_node)
+{
+	struct rb_buf_node *dead;
+	int length = buf_node->buffer_length;
+
+	if (!buf_node->ttl_bytes)
+		return;
+	/* Group reader takes records out of queue middle, stale ones may be anywhere */
+	dead = buffer_expire(buf_node, ktime_get(), buf_node->flags & SBERTASK_CH_GROUP);
+	if (dead)
+		buffer_wake_readers(dead);
+	if (buf_node->buffer_length != length)
+		buffer_wake(buf_node, &buf_node->write_wq);
+}
+
+/* Expire records of queue nobody reads, then sleep until next one expires */
+static void ttl_sweep(struct work_struct *work)
+{
+	struct rb_buf_node *buf_node = container_of(to_delayed_work(work), struct rb_buf_node, ttl_work);
+	struct buffer_element *queue_iter;
+	ktime_t now = ktime_get(), next = KTIME_MAX;
+	struct rb_buf_node *dead;
+	bool freed;
+	int length;
+
+	spin_lock(&buf_node->sdev->lock);
+	length = buf_node->buffer_length;
+	dead = buffer_expire(buf_node, now, true);
+	freed = buf_node->buffer_length != length;
+	if (buf_node->ttl_bytes && !(buf_node->flags & CH_CURSOR)){
+		list_for_each_entry(queue_iter, &buf_node->buffer_head->list, list)
+			if (queue_iter->expires)
+				next = min(next, queue_iter->expires);
+		ttl_arm(buf_node, next);
+	}
+	if (dead)
+		buffer_wake_readers(dead);
+	spin_unlock(&buf_node->sdev->lock);
+	if (freed){
+		pr_info("sbertask: records expired, %d bytes freed\n", length - buf_node->buffer_length);
+		buffer_wake(buf_node, &buf_node->write_wq);
+	}
+}
+
+/* Reader may take data now: whole line is ready and enough bytes queued or waited enough */
+static inline bool rx_ready(struct file *file_p, struct rb_buf_node *buf_node, int min_bytes)
+{
+	if (!buffer_readable(file_p, buf_node))
+		return false;
+	return rx_avail(file_p, buf_node) >= min_bytes || buf_node->rx_expired || buffer_room(buf_node) <= 0;
+}
+
+/* Publish reader's policy for writers and arm delay timer. Caller holds device lock. */
+static void rx_wait_begin(struct rb_buf_node *buf_node, int min_bytes, unsigned int delay_us)
+{
+	if (!buf_node->rx_waiting || min_bytes < buf_node->wake_min)
+		buf_node->wake_min = min_bytes;
+	if (delay_us && (!buf_node->rx_waiting || !buf_node->wake_delay || delay_us < buf_node->wake_delay))
+		buf_node->wake_delay = delay_us;
+	buf_node->rx_waiting++;
+	buf_node->read_ready = 0;
+	/* Bytes are already waiting, delay counts from the first of them */
+	if (delay_us && buf_node->buffer_length && !hrtimer_active(&buf_node->rx_timer))
+		hrtimer_start(&buf_node->rx_timer, ktime_add_us(buf_node->first_byte, delay_us), HRTIMER_MODE_ABS);
+}
+
+static void rx_wait_end(struct rb_buf_node *buf_node)
+{
+	if (--buf_node->rx_waiting == 0){
+		buf_node->wake_min = 1;
+		buf_node->wake_delay = 0;
+	}
+}
+
+/*
+ * Writer can't go on until readers take data, so they must not wait for more:
+ * broadcast, log and leases may stop it before queue holds wake_min bytes,
+ * and record may not fit into room left. Caller holds device lock.
+ */
+static void rx_writer_blocked(struct rb_buf_node *buf_node)
+{
+	if (buf_node->read_ready || !buf_node->rx_waiting)
+		return;
+	buf_node->rx_expired = 1;
+	buf_node->read_ready = 1;
+	buffer_wake_readers(buf_node);
+}
+
+/*
+ * Sleep until reader may take data, see rx_ready(). Reader needs no more
+ * than want bytes. Called and returns with device lock held.
+ * Returns 0 if data is ready, 1 if queue is empty and writer has gone,
+ * or negative error.
+ */
+static int buffer_wait_readable(struct file *file_p, struct rb_buf_node *buf_node, size_t want, bool nonblock)
+{
+	struct sbertask_dev *sdev = file_sdev(file_p);
+	struct sbertask_rxpolicy policy = file_rx_policy(file_p);
+	int min_bytes = clamp_t(size_t, policy.min_bytes, 1, want);
+	unsigned int gen;
+	u64 tail;
+	int ret;
+
+	for (;;){
+		/* Stale records don't count, reader sleeps on if nothing else is queued */
+		rx_expire(buf_node);
+		if (rx_ready(file_p, buf_node, min_bytes))
+			break;
+		if (buf_node->finished)
+			return rx_avail(file_p, buf_node) ? 0 : 1;
+		if (nonblock)
+			return -EAGAIN;
+		if (buffer_spin(buf_node, true, max(1, min_bytes - rx_avail(file_p, buf_node))))
+			continue;
+		pr_debug("sbertask: queue is empty for process with pid %u\n", current->pid);
+		rx_wait_begin(buf_node, min_bytes, policy.max_delay_us);
+		tail = buf_node->tail_off;
+		gen = buf_node->group_gen;
+		spin_unlock(&sdev->lock);
+		/* Exclusive wait, so writer wakes only readers it has data for */
+		if (buf_node->flags & SBERTASK_CH_DISPATCH)
+			ret = wait_event_interruptible_exclusive(buf_node->read_wq,
+								 buf_node->read_ready || buf_node->finished);
+		/* Data for other group readers doesn't stop waiting, only new records or rebalance */
+		else if (buf_node->flags & SBERTASK_CH_GROUP)
+			ret = wait_event_interruptible(buf_node->read_wq, READ_ONCE(buf_node->tail_off) != tail ||
+						       READ_ONCE(buf_node->group_gen) != gen || buf_node->finished);
+		else
+			ret = wait_event_interruptible(buf_node->read_wq, buf_node->read_ready || buf_node->finished);
+		spin_lock(&sdev->lock);
+		rx_wait_end(buf_node);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/* Device of minor with its user counted, NULL if it is removed */
+static struct sbertask_dev *sdev_get(int index)
+{
+	struct sbertask_dev *sdev;
+
+	mutex_lock(&devices_mutex);
+	sdev = devices[index];
+	if (sdev)
+		sdev->users++;
+	mutex_unlock(&devices_mutex);
+	return sdev;
+}
+
+static void sdev_put(struct sbertask_dev *sdev)
+{
+	mutex_lock(&devices_mutex);
+	sdev->users--;
+	/* Mode set through sysfs while device was open */
+	if (!sdev->users && sdev->pending_mode >= 0){
+		sdev->mode = sdev->pending_mode;
+		sdev->pending_mode = -1;
+		pr_info("sbertask: device %d switched to %s mode\n", sdev->index, mode_names[sdev->mode]);
+	}
+	mutex_unlock(&devices_mutex);
+}
+
+static int sbertask_open (struct inode *inode, struct file *file_p)
+{
+	int ret;
+	struct rb_buf_node *buf_node;
+	struct sbertask_file *file_ctx;
+	struct sbertask_dev *sdev;
+
+	sdev = sdev_get(iminor(inode));
+	if (sdev == NULL)
+		return -ENODEV;
+	file_ctx = kzalloc(sizeof(struct sbertask_file), GFP_KERNEL);
+	if (file_ctx == NULL){
+		sdev_put(sdev);
+		return -ENOMEM;
+	}
+	file_ctx->sdev = sdev;
+	INIT_LIST_HEAD(&file_ctx->leases);
+	spin_lock(&sdev->lock);
+	pr_info("sbertask: sbertask_open() spinlock acquired\n");
+	switch (sdev->mode){
+	case MODE_MULTI:
+		/* Just add buffer */
+		ret = add_buffer(sdev, current->pid);
+		buf_node = get_buffer(sdev, current->pid);
+		buf_node->finished = 0;
+		break;
+	case MODE_SINGLE: 
+		/* Add buffer and mutex protect */
+		if (!mutex_trylock(&sdev->single_mutex)){
+			spin_unlock(&sdev->lock);
+			kfree(file_ctx);
+			sdev_put(sdev);
+			return -EBUSY;
+		}
+		ret = add_buffer(sdev, 0);
+		buf_node = get_buffer(sdev, 0);
+		buf_node->finished = 0;
+		break;	
+	case MODE_DEFAULT:
+		/* Add buffer with pid 0 */
+		ret = add_buffer(sdev, 0);
+		buf_node = get_buffer(sdev, 0);
+		buf_node->finished = 0;
+		break;
+	default:
+		pr_err("Undefined behavior in sbertask_open\n");
+	}
+	/* Broadcast or log reader joins on first read from here, producer which never reads holds no data */
+	if (!ret)
+		reader_open(file_ctx, buf_node, file_p->f_mode);
+	
+	spin_unlock(&sdev->lock);
+	pr_info("sbertask: sbertask_opei() spinlock released\n");
+	if (!ret)
+		pr_info("sbertask: process with pid %u opened device\n", current->pid);
+	else if (ret == -ENOMEM){ 
+		pr_err("sbertask: error - can't allocate buffer memory for pid %u\n", current->pid);
+		if (sdev->mode == MODE_SINGLE)
+			mutex_unlock(&sdev->single_mutex);
+		kfree(file_ctx);
+		sdev_put(sdev);
+		return -ENOMEM;
+	} else 
+		pr_err("sbertask: unknown add_buffer() error in sbertask_open(), return code is %d \n", ret);
+	
+	file_p->private_data = file_ctx;
+	try_module_get(THIS_MODULE);
+#ifdef FMODE_CAN_ODIRECT
+	/* O_DIRECT selects packet mode, like for pipes */
+	file_p->f_mode |= FMODE_CAN_ODIRECT;
+#endif
+
+	return 0;
+};
+
+static int sbertask_release (struct inode *inode, struct file *file_p)
+{
+	struct sbertask_file *file_ctx = file_p->private_data;
+	struct sbertask_dev *sdev = file_ctx->sdev;
+	struct rb_buf_node *buf_node, *reader_node;
+	struct buffer_lease *lease, *lease_prev;
+	spin_lock(&sdev->lock);
+	pr_info("sbertask: sbertask_release() spinlock acquired\n");
+	/* Not acknowledged data goes back to queue head for other readers, newest lease first */
+	list_for_each_entry_safe_reverse(lease, lease_prev, &file_ctx->leases, file_list){
+		buf_node = lease->buf_node;
+		lease_return(lease);
+		buffer_wake_readers(buf_node);
+	}
+	/* Bytes kept for this reader may be freed, writers may go on */
+	reader_node = file_ctx->reader_node;
+	if (reader_node){
+		reader_detach(file_ctx);
+		wake_up_interruptible(&reader_node->write_wq);
+	}
+	/* Anon inode file has no driver mode state */
+	if (file_ctx->anon){
+		spin_unlock(&sdev->lock);
+		goto exit;
+	}
+	switch (sdev->mode) {
+		case MODE_SINGLE:
+			buf_node = get_buffer(sdev, 0);
+			buf_node->finished = 1;
+			spin_unlock(&sdev->lock);
+			wake_up_interruptible_all(&buf_node->read_wq);
+			mutex_unlock(&sdev->single_mutex);
+			break;
+		case MODE_DEFAULT:
+			buf_node = get_buffer(sdev, 0);
+			buf_node->finished = 1;
+			spin_unlock(&sdev->lock);
+			wake_up_interruptible_all(&buf_node->read_wq);
+			break;
+		case MODE_MULTI:
+			spin_unlock(&sdev->lock);
+			break;
+		default:
+			spin_unlock(&sdev->lock);
+			pr_err("Undefined_behavior in sbertask_release()\n");
+	}
+exit:
+	pr_info("sbertask: sbertask_release() spinlock released");
+        pr_info("sbertask: process with pid %u closes device\n", current->pid);
+	kfree(file_ctx->spare_lease);
+	kfree(file_ctx);
+	sdev_put(sdev);
+	module_put(THIS_MODULE);
+	return 0;
+};
+
+static  ssize_t sbertask_read (struct file *file_p, char __user *buf, size_t length, loff_t *off_p)
+{		
+	struct sbertask_file *file_ctx = file_p->private_data;
+	struct sbertask_dev *sdev = file_ctx->sdev;
+	struct rb_buf_node *buf_node;
+	struct buffer_lease *lease = NULL;
+	struct rx_undo undo;
+	char *data;
+	size_t want = length, size;
+	ssize_t ret = 0;
+	bool more = false;
+
+	pr_debug("sbertask: process with pid %u reads device\n", current->pid);	
+
+	if (length == 0)
+		return 0;
+	size = min_t(size_t, want, file_capacity(file_p));
+again:
+	length = size;
+	data = kmalloc(length, GFP_KERNEL);
+	if (data == NULL)
+		return -ENOMEM;
+	/* Lease for ack mode, kept for next read if unused */
+	if (READ_ONCE(file_ctx->spare_lease) == NULL)
+		lease = kmalloc(sizeof(*lease), GFP_KERNEL);
+
+	spin_lock(&sdev->lock);
+	pr_debug("sbertask: sbertask_read() spinlock acquired\n");
+	buf_node = file_buffer(file_p);
+      	if (buf_node == NULL){
+		spin_unlock(&sdev->lock);
+		kfree(lease);
+		kfree(data);
+		return -EINVAL;	
+	}
+	if (file_ctx->spare_lease == NULL)
+		swap(file_ctx->spare_lease, lease);
+	/* Each reader takes one chunk in dispatch mode */
+	if (buf_node->flags & SBERTASK_CH_DISPATCH)
+		length = min_t(size_t, length, buf_node->chunk);
+	/* Broadcast, log and group readers join on first read */
+	if (buf_node->flags & CH_READERS){
+		reader_attach(file_ctx, buf_node);
+		buffer_trim(buf_node);
+	}
+	/* sleep if empty buffer, no whole line or too few bytes */
+	ret = buffer_wait_readable(file_p, buf_node, length, file_p->f_flags & O_NONBLOCK);
+	if (ret){
+		pr_debug("sbertask: go to exit\n");
+		if (ret > 0)
+			ret = 0;
+		goto exit;
+	}
+	/* Channel grew at drain while reader slept, record may not fit copy */
+	if (size < want && channel_capacity(buf_node) > size){
+		size = min_t(size_t, want, channel_capacity(buf_node));
+		spin_unlock(&sdev->lock);
+		kfree(lease);
+		kfree(data);
+		lease = NULL;
+		goto again;
+	}
+	/* it is time to take bytes, they are sent after unlock */
+	rx_undo_begin(&undo, file_ctx, buf_node);
+	ret = rx_get(file_p, buf_node, data, length, read_how(file_p, buf_node), &file_ctx->last_tstamp, &undo);
+	if (ret <= 0)
+		rx_unhold(&undo);
+	if (ret > 0){
+		file_ctx->last_seq.first = buf_node->rx_seq_first;
+		file_ctx->last_seq.last = buf_node->rx_seq_last;
+		file_ctx->last_seq.marks = buf_node->rx_marks;
+	}
+	buffer_wake(buf_node, &buf_node->write_wq);
+	more = (buf_node->flags & SBERTASK_CH_DISPATCH) && buf_node->read_ready;
+
+exit:
+	spin_unlock(&sdev->lock);
+	/* Data is left, pass wakeup to next exclusive reader */
+	if (more)
+		wake_up_interruptible(&buf_node->read_wq);
+	pr_debug("sbertask: sbertask_read() spinlock released\n");
+	if (ret > 0){
+		if (copy_to_user(buf, data, ret)){
+			pr_err("sbertask: can't put data to userspace!\n");
+			rx_undo_abort(&undo);
+			ret = -EFAULT;
+		} else
+			rx_undo_end(&undo);
+	}
+	kfree(lease);
+	kfree(data);
+	return ret;
+};
+
+/*
+ * Queue one record to dst, or to file's channel if dst is NULL. Waits for
+ * room unless nonblock is set.
+ */
+static ssize_t channel_write(struct file *file_p, struct rb_buf_node *dst, const char __user *buf,
+			     size_t length, bool nonblock)
+{
+	struct sbertask_dev *sdev = file_sdev(file_p);
+	struct rb_buf_node * buf_node;
+	struct bpf_prog *prog;
+	char *data;
+	size_t count, size;
+	ssize_t ret = 0;
+	u32 verdict;
+	bool packet, wake;
+
+	if (length == 0)
+		return 0;
+	size = min_t(size_t, length, file_capacity(file_p));
+again:
+	/* Copy from userspace before lock, it may sleep on page fault */
+	count = size;
+	verdict = SBERTASK_BPF_PASS;
+	data = memdup_user(buf, count);
+	if (IS_ERR(data)){
+		pr_err("sbertask: can't get data from userspace\n");
+		return PTR_ERR(data);
+	}
+	prog = filter_get(file_p, dst);
+	if (prog){
+		verdict = filter_run(prog, data, count);
+		bpf_prog_put(prog);
+	}
+
+	spin_lock(&sdev->lock);
+	pr_debug("sbertask: sbertask_write() spin_lock acquired\n");
+	buf_node = dst ? dst : file_buffer(file_p);
+	if (buf_node == NULL){
+		pr_err("sbertask: can't get buffer\n");
+		spin_unlock(&sdev->lock);
+		kfree(data);
+		return -EINVAL;
+	}
+	/* Dropped record is consumed as if it was queued */
+	buf_node = filter_target(buf_node, verdict);
+	if (buf_node == NULL){
+		spin_unlock(&sdev->lock);
+		kfree(data);
+		return count;
+	}
+	/* Target is larger than file's channel or grew at drain */
+	if (count < length && channel_capacity(buf_node) > count){
+		size = min_t(size_t, length, channel_capacity(buf_node));
+		spin_unlock(&sdev->lock);
+		kfree(data);
+		goto again;
+	}
+	packet = packet_mode(file_p, buf_node);
+	if (packet && length > buf_node->max_record){
+		spin_unlock(&sdev->lock);
+		kfree(data);
+		return -EMSGSIZE;
+	}
+	/* Record is queued whole, so writers never interleave inside it */
+	buffer_make_room(buf_node, count);
+	while (packet ? buffer_room(buf_node) < count : buffer_room(buf_node) <= 0){	
+		if (buffer_make_room(buf_node, count))
+			continue;
+		/* Lost record is consumed as if it was queued */
+		if (buffer_drop_new(buf_node, packet ? count : 1)){
+			spin_unlock(&sdev->lock);
+			kfree(data);
+			return count;
+		}
+		if (!nonblock && buffer_spin(buf_node, false, packet ? count : 1))
+			continue;
+		pr_debug("sbertask: buffer full\n");
+		rx_writer_blocked(buf_node);
+		buf_node->write_ready = 0;
+		spin_unlock(&sdev->lock);
+		if (nonblock){
+			kfree(data);
+			return -EAGAIN;
+		}
+		if (wait_event_interruptible(buf_node->write_wq, buf_node->write_ready != 0)){
+			kfree(data);
+			return -ERESTARTSYS;
+		}
+		spin_lock(&sdev->lock);
+	}
+	ret = buffer_put(buf_node, data, count, file_ttl(file_p, buf_node));
+	if (ret == 0)
+		ret = -ENOMEM;
+	wake = buf_node->read_ready;
+	buffer_trim(buf_node);
+
+	spin_unlock(&sdev->lock);
+	if (wake)
+		buffer_wake_readers(buf_node);
+	pr_debug("sbertask: sbertask_write() spinlock released\n");
+	kfree(data);
+	return ret;
+}
+
+static	ssize_t sbertask_write (struct file *file_p, const char __user *buf, size_t length, loff_t *off_p)
+{
+	pr_debug("sbertask: process with pid %u writes to device\n", current->pid);	
+
+	return channel_write(file_p, NULL, buf, length, false);
+};
+
+/*
+ * Batched write, like sendmmsg(). All records are copied from userspace
+ * first, then queued under one lock acquisition and readers woken once.
+ * Record is queued whole or not at all. Sleeps only until first record fits.
+ */
+static long sbertask_sendmmsg(struct file *file_p, struct sbertask_mmsg __user *argp)
+{
+	struct sbertask_dev *sdev = file_sdev(file_p);
+	struct sbertask_mmsg mmsg;
+	struct sbertask_msg *msgs;
+	struct sbertask_msg __user *umsgs;
+	struct rb_buf_node *buf_node, *target, **targets = NULL;
+	struct bpf_prog *prog;
+	u32 *verdicts = NULL;
+	char *data, *p;
+	size_t total = 0;
+	unsigned int i, capacity;
+	long ret;
+	bool wake;
+
+	if (copy_from_user(&mmsg, argp, sizeof(mmsg)))
+		return -EFAULT;
+	if (mmsg.count == 0 || mmsg.count > SBERTASK_MMSG_MAX)
+		return -EINVAL;
+	umsgs = u64_to_user_ptr(mmsg.msgs);
+	msgs = memdup_user(umsgs, array_size(mmsg.count, sizeof(*msgs)));
+	if (IS_ERR(msgs))
+		return PTR_ERR(msgs);
+	targets = kcalloc(mmsg.count, sizeof(*targets), GFP_KERNEL);
+	if (targets == NULL){
+		ret = -ENOMEM;
+		goto free_msgs;
+	}
+
+	capacity = file_capacity(file_p);
+	for (i = 0; i < mmsg.count; i++){
+		if (msgs[i].len > capacity){
+			ret = -EMSGSIZE;
+			goto free_msgs;
+		}
+		total += msgs[i].len;
+	}
+	data = kvmalloc(total ? total : 1, GFP_KERNEL);
+	if (data == NULL){
+		ret = -ENOMEM;
+		goto free_msgs;
+	}
+	for (p = data, i = 0; i < mmsg.count; p += msgs[i].len, i++)
+		if (copy_from_user(p, u64_to_user_ptr(msgs[i].buf), msgs[i].len)){
+			ret = -EFAULT;
+			goto free_data;
+		}
+	/* Filter runs before lock, verdicts are turned into channels under it */
+	prog = filter_get(file_p, NULL);
+	if (prog){
+		verdicts = kmalloc_array(mmsg.count, sizeof(*verdicts), GFP_KERNEL);
+		if (verdicts == NULL){
+			bpf_prog_put(prog);
+			ret = -ENOMEM;
+			goto free_data;
+		}
+		for (p = data, i = 0; i < mmsg.count; p += msgs[i].len, i++)
+			verdicts[i] = filter_run(prog, p, msgs[i].len);
+		bpf_prog_put(prog);
+	}
+
+	spin_lock(&sdev->lock);
+	buf_node = file_buffer(file_p);
+	if (buf_node == NULL){
+		spin_unlock(&sdev->lock);
+		ret = -EINVAL;
+		goto free_data;
+	}
+	for (i = 0; i < mmsg.count; i++){
+		targets[i] = verdicts ? filter_target(buf_node, verdicts[i]) : buf_node;
+		/* Record must fit queue it goes to, or writer would wait forever */
+		if (targets[i] && (msgs[i].len > channel_capacity(targets[i]) ||
+				   (packet_mode(file_p, targets[i]) && msgs[i].len > targets[i]->max_record))){
+			spin_unlock(&sdev->lock);
+			ret = -EMSGSIZE;
+			goto free_data;
+		}
+	}
+	/* Wait for room in channel of first record which is not dropped */
+	for (i = 0; i < mmsg.count - 1 && targets[i] == NULL; i++)
+		;
+	if (targets[i])
+		buf_node = targets[i];
+	buffer_make_room(buf_node, msgs[i].len);
+	while (targets[i] && buffer_room(buf_node) < msgs[i].len){
+		if (buffer_make_room(buf_node, msgs[i].len))
+			continue;
+		/* Record is dropped below */
+		if (buf_node->flags & SBERTASK_CH_DROPNEW)
+			break;
+		if (!(mmsg.flags & SBERTASK_MSG_DONTWAIT) && !(file_p->f_flags & O_NONBLOCK) &&
+		    buffer_spin(buf_node, false, msgs[i].len))
+			continue;
+		rx_writer_blocked(buf_node);
+		buf_node->write_ready = 0;
+		spin_unlock(&sdev->lock);
+		if ((mmsg.flags & SBERTASK_MSG_DONTWAIT) || (file_p->f_flags & O_NONBLOCK)){
+			ret = -EAGAIN;
+			goto free_data;
+		}
+		if (wait_event_interruptible(buf_node->write_wq, buf_node->write_ready != 0)){
+			ret = -ERESTARTSYS;
+			goto free_data;
+		}
+		spin_lock(&sdev->lock);
+	}
+	buf_node = file_buffer(file_p);
+	for (p = data, i = 0; i < mmsg.count; p += msgs[i].len, i++){
+		target = targets[i];
+		if (target == NULL){
+			msgs[i].result = msgs[i].len;
+			continue;
+		}
+		buffer_make_room(target, msgs[i].len);
+		if (buffer_drop_new(target, msgs[i].len)){
+			msgs[i].result = msgs[i].len;
+			continue;
+		}
+		if (buffer_room(target) < msgs[i].len)
+			break;
+		msgs[i].result = buffer_put(target, p, msgs[i].len, file_ttl(file_p, target));
+		if (target != buf_node){
+			/* Redirected record, wake its readers now */
+			buffer_trim(target);
+			if (target->read_ready)
+				buffer_wake_readers(target);
+		}
+		if (msgs[i].result < msgs[i].len){
+			i++;
+			break;
+		}
+	}
+	wake = buf_node->read_ready;
+	buffer_trim(buf_node);
+	spin_unlock(&sdev->lock);
+	if (wake)
+		buffer_wake_readers(buf_node);
+
+	ret = i;
+	for (i = 0; i < ret; i++)
+		if (put_user(msgs[i].result, &umsgs[i].result)){
+			ret = -EFAULT;
+			break;
+		}
+free_data:
+	kvfree(data);
+free_msgs:
+	kfree(verdicts);
+	kfree(targets);
+	kfree(msgs);
+	return ret;
+}
+
+/*
+ * Batched read, like recvmmsg(). Sleeps until queue is not empty, then
+ * fills slots under one lock acquisition, each slot takes up to its length,
+ * or one record in packet mode, or one line in line mode.
+ */
+static long sbertask_recvmmsg(struct file *file_p, struct sbertask_mmsg __user *argp)
+{
+	struct sbertask_dev *sdev = file_sdev(file_p);
+	struct sbertask_file *file_ctx = file_p->private_data;
+	struct sbertask_mmsg mmsg;
+	struct sbertask_tstamp *tstamps = NULL;
+	struct sbertask_msg *msgs;
+	struct sbertask_msg __user *umsgs;
+	struct rb_buf_node *buf_node;
+	struct buffer_lease *lease = NULL;
+	struct rx_undo undo;
+	char *data, *p;
+	size_t want = 0, size, total;
+	unsigned int i, received = 0;
+	ssize_t got = 0;
+	long ret = 0;
+	bool more, grown = false;
+	int how;
+
+	if (copy_from_user(&mmsg, argp, sizeof(mmsg)))
+		return -EFAULT;
+	if (mmsg.count == 0 || mmsg.count > SBERTASK_MMSG_MAX)
+		return -EINVAL;
+	umsgs = u64_to_user_ptr(mmsg.msgs);
+	msgs = memdup_user(umsgs, array_size(mmsg.count, sizeof(*msgs)));
+	if (IS_ERR(msgs))
+		return PTR_ERR(msgs);
+
+	/* Queue never holds more than capacity bytes */
+	for (i = 0; i < mmsg.count; i++){
+		msgs[i].result = 0;
+		want += msgs[i].len;
+	}
+	size = min_t(size_t, want, file_capacity(file_p));
+again:
+	total = size;
+	data = kmalloc(total ? total : 1, GFP_KERNEL);
+	if (data == NULL){
+		ret = -ENOMEM;
+		goto free_msgs;
+	}
+	if (mmsg.tstamps){
+		tstamps = kcalloc(mmsg.count, sizeof(*tstamps), GFP_KERNEL);
+		if (tstamps == NULL){
+			ret = -ENOMEM;
+			goto free_data;
+		}
+	}
+	if (READ_ONCE(file_ctx->spare_lease) == NULL)
+		lease = kmalloc(sizeof(*lease), GFP_KERNEL);
+
+	spin_lock(&sdev->lock);
+	buf_node = file_buffer(file_p);
+	if (buf_node == NULL){
+		spin_unlock(&sdev->lock);
+		ret = -EINVAL;
+		goto free_data;
+	}
+	if (file_ctx->spare_lease == NULL)
+		swap(file_ctx->spare_lease, lease);
+	if (buf_node->flags & SBERTASK_CH_DISPATCH)
+		total = min_t(size_t, total, buf_node->chunk);
+	if (buf_node->flags & CH_READERS){
+		reader_attach(file_ctx, buf_node);
+		buffer_trim(buf_node);
+	}
+	ret = buffer_wait_readable(file_p, buf_node, total,
+				   (mmsg.flags & SBERTASK_MSG_DONTWAIT) || (file_p->f_flags & O_NONBLOCK));
+	if (ret){
+		spin_unlock(&sdev->lock);
+		if (ret > 0)
+			ret = 0;
+		goto free_data;
+	}
+	/* Channel grew at drain while reader slept, record may not fit copy */
+	if (size < want && channel_capacity(buf_node) > size){
+		size = min_t(size_t, want, channel_capacity(buf_node));
+		spin_unlock(&sdev->lock);
+		grown = true;
+		goto free_data;
+	}
+	how = read_how(file_p, buf_node);
+	rx_undo_begin(&undo, file_ctx, buf_node);
+	for (p = data, i = 0; i < mmsg.count && p < data + total; i++){
+		if (!buffer_readable(file_p, buf_node))
+			break;
+		got = rx_get(file_p, buf_node, p, min_t(size_t, msgs[i].len, data + total - p), how,
+			     tstamps ? &tstamps[i] : &file_ctx->last_tstamp, &undo);
+		if (got <= 0)
+			break;
+		msgs[i].result = got;
+		if (!received){
+			file_ctx->last_seq.first = buf_node->rx_seq_first;
+			file_ctx->last_seq.marks = 0;
+		}
+		file_ctx->last_seq.last = buf_node->rx_seq_last;
+		file_ctx->last_seq.marks += buf_node->rx_marks;
+		p += msgs[i].result;
+		received++;
+	}
+	if (tstamps && received)
+		file_ctx->last_tstamp = tstamps[received - 1];
+	if (!received)
+		rx_unhold(&undo);
+	more = (buf_node->flags & SBERTASK_CH_DISPATCH) && buf_node->read_ready;
+	spin_unlock(&sdev->lock);
+	buffer_wake(buf_node, &buf_node->write_wq);
+	if (more)
+		wake_up_interruptible(&buf_node->read_wq);
+
+	ret = received;
+	for (p = data, i = 0; i < received; p += msgs[i].result, i++)
+		if (copy_to_user(u64_to_user_ptr(msgs[i].buf), p, msgs[i].result) ||
+		    put_user(msgs[i].result, &umsgs[i].result)){
+			ret = -EFAULT;
+			break;
+		}
+	if (ret > 0 && tstamps &&
+	    copy_to_user(u64_to_user_ptr(mmsg.tstamps), tstamps, array_size(received, sizeof(*tstamps))))
+		ret = -EFAULT;
+	/* Nothing is received if any slot is bad, all bytes go back to channel */
+	if (ret < 0){
+		pr_err("sbertask: can't put data to userspace!\n");
+		rx_undo_abort(&undo);
+	} else if (received)
+		rx_undo_end(&undo);
+	/* Lease of first record failed, later failure only ends the batch */
+	if (!received && got < 0)
+		ret = got;
+free_data:
+	kfree(lease);
+	kfree(tstamps);
+	kfree(data);
+	if (grown){
+		lease = NULL;
+		tstamps = NULL;
+		grown = false;
+		goto again;
+	}
+free_msgs:
+	kfree(msgs);
+	return ret;
+}
+
+/* Recount lines after delimiter change. Caller holds device lock. */
+static void buffer_count_delimiters(struct rb_buf_node *buf_node)
+{
+	struct buffer_element *queue_iter;
+
+	buf_node->delim_count = 0;
+	if (!buf_node->buffer_length)
+		return;
+	list_for_each_entry(queue_iter, &buf_node->buffer_head->list, list)
+		if (queue_iter->data == buf_node->delimiter)
+			buf_node->delim_count++;
+}
+
+static long sbertask_get_config(struct file *file_p, struct sbertask_config __user *argp)
+{
+	struct sbertask_dev *sdev = file_sdev(file_p);
+	struct sbertask_config config = { 0 };
+	struct rb_buf_node *buf_node;
+
+	spin_lock(&sdev->lock);
+	buf_node = file_buffer(file_p);
+	if (buf_node == NULL){
+		spin_unlock(&sdev->lock);
+		return -EINVAL;
+	}
+	config.flags = buf_node->flags;
+	config.max_record = buf_node->max_record;
+	config.delimiter = (unsigned char)buf_node->delimiter;
+	config.spin_us = buf_node->spin_max_ns / NSEC_PER_USEC;
+	config.chunk = buf_node->chunk;
+	config.lag_limit = buf_node->lag_limit;
+	config.retain_bytes = buf_node->retain_bytes;
+	config.retain_ms = buf_node->retain_ms;
+	config.lease_ms = buf_node->lease_ms;
+	config.key_bytes = buf_node->key_bytes;
+	config.partitions = buf_node->partitions;
+	config.codel_target_us = buf_node->codel_target_us;
+	config.codel_interval_us = buf_node->codel_interval_us;
+	config.ttl_ms = buf_node->ttl_ms;
+	spin_unlock(&sdev->lock);
+
+	if (copy_to_user(argp, &config, sizeof(config)))
+		return -EFAULT;
+	return 0;
+}
+
+/* Channel flags which may go together */
+static bool flags_valid(unsigned int flags)
+{
+	if (flags & ~SBERTASK_CH_MASK)
+		return false;
+	if ((flags & SBERTASK_CH_PACKET) && (flags & SBERTASK_CH_DELIM))
+		return false;
+	if (hweight32(flags & CH_CONSUME) > 1)
+		return false;
+	/* Broadcast, log and group readers don't share data, so nothing to split into lines or chunks */
+	if ((flags & CH_READERS) && (flags & (SBERTASK_CH_DELIM | SBERTASK_CH_DISPATCH)))
+		return false;
+	/* CoDel drops at queue head, readers with cursors or partitions don't take from it */
+	if (((flags & SBERTASK_CH_CODEL) && (flags & CH_READERS)) ||
+	    ((flags & SBERTASK_CH_ECN) && !(flags & SBERTASK_CH_CODEL)))
+		return false;
+	/* One overflow policy, broadcast and log have their own */
+	if (hweight32(flags & CH_OVERFLOW) > 1 || ((flags & CH_OVERFLOW) && (flags & CH_CURSOR)))
+		return false;
+	return true;
+}
+
+/*
+ * Check sizes of config against capacity of channel it is set on, zero
+ * ones take capacity. Called under device lock.
+ */
+static bool config_fit(struct sbertask_config *config, unsigned int capacity)
+{
+	if (config->max_record > capacity || config->chunk > capacity ||
+	    config->lag_limit > capacity || config->retain_bytes > capacity)
+		return false;
+	if (config->max_record == 0)
+		config->max_record = capacity;
+	if (config->chunk == 0)
+		config->chunk = capacity;
+	if (config->lag_limit == 0)
+		config->lag_limit = capacity;
+	if (config->retain_bytes == 0)
+		config->retain_bytes = capacity;
+	/* Record longer than lag limit or log size would never fit */
+	if ((config->flags & SBERTASK_CH_BROADCAST) && config->max_record > config->lag_limit)
+		return false;
+	if ((config->flags & SBERTASK_CH_LOG) && config->max_record > config->retain_bytes)
+		return false;
+	return true;
+}
+
+static long sbertask_set_config(struct file *file_p, struct sbertask_config __user *argp)
+{
+	struct sbertask_dev *sdev = file_sdev(file_p);
+	struct sbertask_config config;
+	struct rb_buf_node *buf_node;
+	unsigned int i;
+	bool regroup;
+
+	if (copy_from_user(&config, argp, sizeof(config)))
+		return -EFAULT;
+	if (!flags_valid(config.flags))
+		return -EINVAL;
+	if (config.delimiter > 0xff)
+		return -EINVAL;
+	for (i = 0; i < ARRAY_SIZE(config.reserved); i++)
+		if (config.reserved[i])
+			return -EINVAL;
+	/* Spinning longer than a tick only burns cpu */
+	if (config.spin_us > USEC_PER_SEC / HZ)
+		return -EINVAL;
+	if (config.spin_us == 0)
+		config.spin_us = SPIN_DEFAULT_NS / NSEC_PER_USEC;
+	if (config.key_bytes > SBERTASK_KEY_MAX || config.partitions > SBERTASK_PART_MAX)
+		return -EINVAL;
+	if (config.key_bytes == 0)
+		config.key_bytes = GROUP_KEY_DEFAULT;
+	if (config.partitions == 0)
+		config.partitions = GROUP_PART_DEFAULT;
+	if (config.codel_target_us == 0)
+		config.codel_target_us = CODEL_TARGET_US;
+	if (config.codel_interval_us == 0)
+		config.codel_interval_us = CODEL_INTERVAL_US;
+	if (config.codel_target_us > config.codel_interval_us)
+		return -EINVAL;
+	/* Broadcast and log readers hold cursors, records stay until they pass */
+	if (config.ttl_ms && (config.flags & CH_CURSOR))
+		return -EINVAL;
+
+	spin_lock(&sdev->lock);
+	buf_node = file_buffer(file_p);
+	if (buf_node == NULL || !config_fit(&config, buf_node->capacity)){
+		spin_unlock(&sdev->lock);
+		return -EINVAL;
+	}
+	regroup = (config.flags & SBERTASK_CH_GROUP) &&
+		  (!(buf_node->flags & SBERTASK_CH_GROUP) || buf_node->key_bytes != config.key_bytes ||
+		   buf_node->partitions != config.partitions);
+	/* Channel's own config wins over device flags waiting for drain */
+	buf_node->pending &= ~PENDING_FLAGS;
+	buf_node->flags = config.flags;
+	buf_node->max_record = config.max_record;
+	buf_node->spin_max_ns = config.spin_us * NSEC_PER_USEC;
+	buf_node->chunk = config.chunk;
+	buf_node->lag_limit = config.lag_limit;
+	buf_node->retain_bytes = config.retain_bytes;
+	buf_node->retain_ms = config.retain_ms;
+	buf_node->lease_ms = config.lease_ms;
+	buf_node->key_bytes = config.key_bytes;
+	buf_node->partitions = config.partitions;
+	buf_node->codel_target_us = config.codel_target_us;
+	buf_node->codel_interval_us = config.codel_interval_us;
+	buf_node->ttl_ms = config.ttl_ms;
+	buf_node->rx_spin_ns = buf_node->spin_max_ns;
+	buf_node->tx_spin_ns = buf_node->spin_max_ns;
+	if (buf_node->delimiter != (char)config.delimiter){
+		buf_node->delimiter = config.delimiter;
+		buffer_count_delimiters(buf_node);
+	}
+	/* Queued bytes no reader has cursor for are dropped, log is cut to new size */
+	buffer_make_room(buf_node, 0);
+	buffer_trim(buf_node);
+	if (regroup){
+		group_repartition(buf_node);
+		group_rebalance(buf_node);
+	}
+	if (buf_node->buffer_length)
+		buf_node->read_ready = 1;
+	spin_unlock(&sdev->lock);
+	/* Line may be ready with new delimiter */
+	wake_up_interruptible_all(&buf_node->read_wq);
+	wake_up_interruptible_all(&buf_node->write_wq);
+	pr_info("sbertask: channel flags 0x%x, max record %u\n", config.flags, config.max_record);
+	return 0;
+}
+
+static long sbertask_get_stats(struct file *file_p, struct sbertask_stats __user *argp)
+{
+	struct sbertask_dev *sdev = file_sdev(file_p);
+	struct sbertask_stats stats;
+	struct rb_buf_node *buf_node;
+
+	spin_lock(&sdev->lock);
+	buf_node = file_buffer(file_p);
+	if (buf_node == NULL){
+		spin_unlock(&sdev->lock);
+		return -EINVAL;
+	}
+	stats = buf_node->stats;
+	spin_unlock(&sdev->lock);
+
+	if (copy_to_user(argp, &stats, sizeof(stats)))
+		return -EFAULT;
+	return 0;
+}
+
+/* Register eventfd of channel, previous one is released */
+static long sbertask_set_eventfd(struct file *file_p, struct sbertask_eventfd __user *argp)
+{
+	struct sbertask_dev *sdev = file_sdev(file_p);
+	struct sbertask_eventfd ev;
+	struct eventfd_ctx *evfd = NULL, *old;
+	struct rb_buf_node *buf_node;
+
+	if (copy_from_user(&ev, argp, sizeof(ev)))
+		return -EFAULT;
+	if (ev.reserved || (ev.events & ~(SBERTASK_EV_DATA | SBERTASK_EV_SPACE)))
+		return -EINVAL;
+	if (ev.fd >= 0){
+		evfd = eventfd_ctx_fdget(ev.fd);
+		if (IS_ERR(evfd))
+			return PTR_ERR(evfd);
+	}
+
+	spin_lock(&sdev->lock);
+	buf_node = file_buffer(file_p);
+	if (buf_node == NULL || ev.space_threshold > buf_node->capacity){
+		spin_unlock(&sdev->lock);
+		if (evfd)
+			eventfd_ctx_put(evfd);
+		return -EINVAL;
+	}
+	if (ev.space_threshold == 0)
+		ev.space_threshold = buf_node->capacity;
+	old = buf_node->evfd;
+	buf_node->evfd = evfd;
+	buf_node->ev_mask = evfd ? ev.events : 0;
+	buf_node->ev_space = ev.space_threshold;
+	spin_unlock(&sdev->lock);
+
+	if (old)
+		eventfd_ctx_put(old);
+	return 0;
+}
+
+static long sbertask_set_rxpolicy(struct file *file_p, struct sbertask_rxpolicy __user *argp)
+{
+	struct sbertask_file *file_ctx = file_p->private_data;
+	struct sbertask_rxpolicy policy;
+
+	if (copy_from_user(&policy, argp, sizeof(policy)))
+		return -EFAULT;
+	if (policy.min_bytes > file_capacity(file_p))
+		return -EINVAL;
+	/* Applied on next sleep of this file's reader */
+	file_ctx->rx_policy = policy;
+	file_ctx->rx_policy_set = true;
+	return 0;
+}
+
+static long sbertask_get_seq(struct file *file_p, struct sbertask_seq __user *argp)
+{
+	struct sbertask_dev *sdev = file_sdev(file_p);
+	struct sbertask_file *file_ctx = file_p->private_data;
+	struct sbertask_seq seq = file_ctx->last_seq;
+	struct rb_buf_node *buf_node;
+
+	spin_lock(&sdev->lock);
+	buf_node = file_buffer(file_p);
+	if (buf_node)
+		seq.next = buf_node->seq_next;
+	spin_unlock(&sdev->lock);
+	if (buf_node == NULL)
+		return -EINVAL;
+	if (copy_to_user(argp, &seq, sizeof(seq)))
+		return -EFAULT;
+	return 0;
+}
+
+/* Time to live of records this file writes, channel's one is used while it is 0 */
+static long sbertask_set_ttl(struct file *file_p, struct sbertask_ttl __user *argp)
+{
+	struct sbertask_file *file_ctx = file_p->private_data;
+	struct sbertask_ttl ttl;
+
+	if (copy_from_user(&ttl, argp, sizeof(ttl)))
+		return -EFAULT;
+	if (ttl.reserved)
+		return -EINVAL;
+	WRITE_ONCE(file_ctx->ttl_ms, ttl.ttl_ms);
+	return 0;
+}
+
+/* Expired records of channel go to dead letter channel instead of being dropped */
+static long sbertask_set_deadletter(struct file *file_p, struct sbertask_deadletter __user *argp)
+{
+	struct sbertask_dev *sdev = file_sdev(file_p);
+	struct sbertask_deadletter dl;
+	struct rb_buf_node *buf_node;
+	int ret = 0;
+
+	if (copy_from_user(&dl, argp, sizeof(dl)))
+		return -EFAULT;
+	if (dl.reserved || (dl.flags & ~SBERTASK_DEADLETTER_ON))
+		return -EINVAL;
+
+	spin_lock(&sdev->lock);
+	buf_node = file_buffer(file_p);
+	if (buf_node == NULL || ((dl.flags & SBERTASK_DEADLETTER_ON) && dl.channel == buf_node->key)){
+		ret = -EINVAL;
+		goto unlock;
+	}
+	if ((dl.flags & SBERTASK_DEADLETTER_ON) && add_buffer(sdev, dl.channel)){
+		ret = -ENOMEM;
+		goto unlock;
+	}
+	buf_node->dead_key = dl.channel;
+	buf_node->dead_set = dl.flags & SBERTASK_DEADLETTER_ON;
+unlock:
+	spin_unlock(&sdev->lock);
+	return ret;
+}
+
+static long sbertask_get_rxpolicy(struct file *file_p, struct sbertask_rxpolicy __user *argp)
+{
+	struct sbertask_rxpolicy policy = file_rx_policy(file_p);
+
+	if (copy_to_user(argp, &policy, sizeof(policy)))
+		return -EFAULT;
+	return 0;
+}
+
+/* Partitions of file in group channel, zero if file is not group reader */
+static long sbertask_get_group(struct file *file_p, struct sbertask_group __user *argp)
+{
+	struct sbertask_dev *sdev = file_sdev(file_p);
+	struct sbertask_file *file_ctx = file_p->private_data;
+	struct sbertask_group group = { 0 };
+	struct sbertask_file *reader;
+	struct rb_buf_node *buf_node;
+
+	spin_lock(&sdev->lock);
+	buf_node = file_buffer(file_p);
+	if (buf_node == NULL || !(buf_node->flags & SBERTASK_CH_GROUP)){
+		spin_unlock(&sdev->lock);
+		return -EINVAL;
+	}
+	if (file_ctx->reader_node == buf_node)
+		group.parts = file_ctx->parts;
+	list_for_each_entry(reader, &buf_node->readers, reader_list)
+		group.members++;
+	group.partitions = buf_node->partitions;
+	spin_unlock(&sdev->lock);
+
+	if (copy_to_user(argp, &group, sizeof(group)))
+		return -EFAULT;
+	return 0;
+}
+
+/*
+ * Attach socket filter program to channel, it sees every written record
+ * and may drop it or redirect it to one of targets. Replaces old filter.
+ */
+static long sbertask_set_filter(struct file *file_p, struct sbertask_filter __user *argp)
+{
+	struct sbertask_dev *sdev = file_sdev(file_p);
+	struct sbertask_filter filter;
+	struct bpf_prog *prog = NULL, *old;
+	struct rb_buf_node *buf_node;
+	u64 targets[SBERTASK_REDIRECT_MAX];
+
+	if (copy_from_user(&filter, argp, sizeof(filter)))
+		return -EFAULT;
+	if (filter.count > SBERTASK_REDIRECT_MAX)
+		return -EINVAL;
+	if (filter.count && copy_from_user(targets, u64_to_user_ptr(filter.targets),
+					   filter.count * sizeof(targets[0])))
+		return -EFAULT;
+	if (filter.fd >= 0){
+		prog = bpf_prog_get_type_dev(filter.fd, BPF_PROG_TYPE_SOCKET_FILTER, false);
+		if (IS_ERR(prog))
+			return PTR_ERR(prog);
+	}
+
+	spin_lock(&sdev->lock);
+	buf_node = file_buffer(file_p);
+	if (buf_node == NULL){
+		spin_unlock(&sdev->lock);
+		if (prog)
+			bpf_prog_put(prog);
+		return -EINVAL;
+	}
+	old = buf_node->filter;
+	buf_node->filter = prog;
+	memcpy(buf_node->redirect, targets, filter.count * sizeof(targets[0]));
+	buf_node->nr_redirect = filter.count;
+	spin_unlock(&sdev->lock);
+
+	/* Writers running old program hold own reference */
+	if (old)
+		bpf_prog_put(old);
+	return 0;
+}
+
+/* Channel with key, created if there is none. Caller holds device lock. */
+static struct rb_buf_node *attach_buffer(struct sbertask_dev *sdev, u64 key, const char *name)
+{
+	struct rb_buf_node *buf_node;
+
+	if (add_buffer(sdev, key))
+		return ERR_PTR(-ENOMEM);
+	buf_node = get_buffer(sdev, key);
+	if (name){
+		/* Name hashes are 62 bit, but still may collide */
+		if (buf_node->name[0] == 0)
+			strscpy_pad(buf_node->name, name, sizeof(buf_node->name));
+		else if (strncmp(buf_node->name, name, sizeof(buf_node->name)))
+			return ERR_PTR(-EEXIST);
+	}
+	buf_node->finished = 0;
+	return buf_node;
+}
+
+/*
+ * Attach this file to channel by key or name, or make new anon inode file
+ * bound to it. Such fd may be passed to other process with SCM_RIGHTS, it
+ * works without any lookup by pid.
+ */
+static long sbertask_attach(struct file *file_p, struct sbertask_attach __user *argp)
+{
+	struct sbertask_dev *sdev = file_sdev(file_p);
+	struct sbertask_file *file_ctx = file_p->private_data, *new_ctx = NULL;
+	struct sbertask_attach attach;
+	struct rb_buf_node *buf_node, *reader_node = NULL;
+	char name[SBERTASK_NAME_MAX + 1];
+	size_t len;
+	u64 key;
+	int fd, access = O_RDWR;
+
+	if (copy_from_user(&attach, argp, sizeof(attach)))
+		return -EFAULT;
+	if (attach.reserved || (attach.flags & ~(SBERTASK_ATTACH_NAME | SBERTASK_ATTACH_FD | SBERTASK_ATTACH_CLOEXEC |
+						  SBERTASK_ATTACH_RDONLY | SBERTASK_ATTACH_WRONLY)))
+		return -EINVAL;
+	/* Access mode is of new fd, this file keeps its own */
+	if (attach.flags & (SBERTASK_ATTACH_RDONLY | SBERTASK_ATTACH_WRONLY)){
+		if (!(attach.flags & SBERTASK_ATTACH_FD) ||
+		    ((attach.flags & SBERTASK_ATTACH_RDONLY) && (attach.flags & SBERTASK_ATTACH_WRONLY)))
+			return -EINVAL;
+		access = (attach.flags & SBERTASK_ATTACH_RDONLY) ? O_RDONLY : O_WRONLY;
+	}
+	if (attach.flags & SBERTASK_ATTACH_NAME){
+		len = strnlen(attach.name, SBERTASK_NAME_MAX);
+		if (len == 0)
+			return -EINVAL;
+		memcpy(name, attach.name, len);
+		name[len] = 0;
+		key = ((u64)jhash(name, len, 0) << 32 | jhash(name, len, 1)) & SBERTASK_CHAN_KEY_MASK;
+		key |= SBERTASK_CHAN_NAMED;
+	} else {
+		if (attach.key > SBERTASK_CHAN_KEY_MASK)
+			return -EINVAL;
+		key = attach.key;
+	}
+	key |= SBERTASK_CHAN_KEYED;
+	attach.channel = key;
+	if (copy_to_user(&argp->channel, &attach.channel, sizeof(attach.channel)))
+		return -EFAULT;
+
+	if (attach.flags & SBERTASK_ATTACH_FD){
+		new_ctx = kzalloc(sizeof(struct sbertask_file), GFP_KERNEL);
+		if (new_ctx == NULL)
+			return -ENOMEM;
+		INIT_LIST_HEAD(&new_ctx->leases);
+		new_ctx->anon = true;
+		new_ctx->sdev = sdev;
+	}
+
+	spin_lock(&sdev->lock);
+	buf_node = attach_buffer(sdev, key, (attach.flags & SBERTASK_ATTACH_NAME) ? name : NULL);
+	if (IS_ERR(buf_node)){
+		spin_unlock(&sdev->lock);
+		kfree(new_ctx);
+		return PTR_ERR(buf_node);
+	}
+	if (new_ctx){
+		new_ctx->chan = buf_node;
+		/* Like opened file, reader joins on first read */
+		reader_open(new_ctx, buf_node, access == O_WRONLY ? 0 : FMODE_READ);
+		spin_unlock(&sdev->lock);
+
+		/* Released like opened file, so it holds module and device the same way */
+		__module_get(THIS_MODULE);
+		sdev_get(new_ctx->sdev->index);
+		fd = anon_inode_getfd(DEVICE_NAME, &f_ops, new_ctx,
+				      access | ((attach.flags & SBERTASK_ATTACH_CLOEXEC) ? O_CLOEXEC : 0));
+		if (fd < 0){
+			sdev_put(new_ctx->sdev);
+			kfree(new_ctx);
+			module_put(THIS_MODULE);
+		}
+		return fd;
+	}
+	/* Leases belong to old channel, they must be acknowledged first */
+	if (!list_empty(&file_ctx->leases)){
+		spin_unlock(&sdev->lock);
+		return -EBUSY;
+	}
+	if (file_ctx->reader_node && file_ctx->reader_node != buf_node){
+		reader_node = file_ctx->reader_node;
+		reader_detach(file_ctx);
+	}
+	file_ctx->chan = buf_node;
+	reader_open(file_ctx, buf_node, file_p->f_mode);
+	spin_unlock(&sdev->lock);
+	if (reader_node)
+		wake_up_interruptible(&reader_node->write_wq);
+	return 0;
+}
+
+/*
+ * Multi mode mailbox: write record to channel of other process, it reads
+ * it as written to own channel. Blocks while mailbox is full, like write().
+ * Returns bytes queued.
+ */
+static long sbertask_sendto(struct file *file_p, struct sbertask_sendto __user *argp)
+{
+	struct sbertask_dev *sdev = file_sdev(file_p);
+	struct sbertask_sendto msg;
+	struct rb_buf_node *buf_node;
+	pid_t pid;
+
+	if (copy_from_user(&msg, argp, sizeof(msg)))
+		return -EFAULT;
+	if (msg.reserved || (msg.flags & ~SBERTASK_MSG_DONTWAIT) || msg.pid <= 0)
+		return -EINVAL;
+	if (sdev->mode != MODE_MULTI)
+		return -EOPNOTSUPP;
+	/* Pid is seen from caller's namespace, channels are keyed by global one */
+	rcu_read_lock();
+	pid = pid_nr(find_vpid(msg.pid));
+	rcu_read_unlock();
+	if (pid == 0)
+		return -ESRCH;
+
+	/* Mailbox exists since owner opened device and lives as long as device */
+	spin_lock(&sdev->lock);
+	buf_node = get_buffer(sdev, pid);
+	spin_unlock(&sdev->lock);
+	if (buf_node == NULL)
+		return -ESRCH;
+	return channel_write(file_p, buf_node, u64_to_user_ptr(msg.buf), msg.len,
+			     (msg.flags & SBERTASK_MSG_DONTWAIT) || (file_p->f_flags & O_NONBLOCK));
+}
+
+/*
+ * Multicast write: record is copied from userspace once and queued to
+ * every channel under one lock acquisition. Never sleeps, full channel
+ * gets -EAGAIN in its result. Returns number of channels record went to.
+ */
+static long sbertask_mcast(struct file *file_p, struct sbertask_mcast __user *argp)
+{
+	struct sbertask_dev *sdev = file_sdev(file_p);
+	struct sbertask_mcast mcast;
+	struct rb_buf_node **nodes = NULL, *target;
+	struct bpf_prog *prog;
+	u64 *channels;
+	s32 *results = NULL;
+	u32 *verdicts = NULL;
+	char *data = NULL;
+	unsigned int i, j;
+	long ret = 0;
+
+	if (copy_from_user(&mcast, argp, sizeof(mcast)))
+		return -EFAULT;
+	if (mcast.count == 0 || mcast.count > SBERTASK_MCAST_MAX || mcast.flags || mcast.reserved)
+		return -EINVAL;
+	/* Bound of copy, each channel checks its own capacity below */
+	if (mcast.len > SBERTASK_CAPACITY_MAX)
+		return -EMSGSIZE;
+	channels = memdup_user(u64_to_user_ptr(mcast.channels), array_size(mcast.count, sizeof(*channels)));
+	if (IS_ERR(channels))
+		return PTR_ERR(channels);
+	nodes = kcalloc(mcast.count, sizeof(*nodes), GFP_KERNEL);
+	results = kcalloc(mcast.count, sizeof(*results), GFP_KERNEL);
+	verdicts = kcalloc(mcast.count, sizeof(*verdicts), GFP_KERNEL);
+	if (nodes == NULL || results == NULL || verdicts == NULL){
+		ret = -ENOMEM;
+		goto free;
+	}
+	data = memdup_user(u64_to_user_ptr(mcast.buf), mcast.len ? mcast.len : 1);
+	if (IS_ERR(data)){
+		ret = PTR_ERR(data);
+		data = NULL;
+		goto free;
+	}
+
+	/* Channels are freed only with device, which isn't removed while this file is open */
+	spin_lock(&sdev->lock);
+	for (i = 0; i < mcast.count; i++){
+		nodes[i] = get_buffer(sdev, channels[i]);
+		if (nodes[i] == NULL)
+			results[i] = -ENOENT;
+	}
+	spin_unlock(&sdev->lock);
+	/* Each channel filters record by own program */
+	for (i = 0; i < mcast.count; i++){
+		verdicts[i] = SBERTASK_BPF_PASS;
+		if (nodes[i] == NULL)
+			continue;
+		prog = filter_get(file_p, nodes[i]);
+		if (prog){
+			verdicts[i] = filter_run(prog, data, mcast.len);
+			bpf_prog_put(prog);
+		}
+	}
+
+	spin_lock(&sdev->lock);
+	for (i = 0; i < mcast.count; i++){
+		if (nodes[i] == NULL)
+			continue;
+		target = filter_target(nodes[i], verdicts[i]);
+		if (target == NULL){
+			/* Dropped by filter, looks queued like for write() */
+			results[i] = mcast.len;
+			ret++;
+			nodes[i] = NULL;
+			continue;
+		}
+		nodes[i] = target;
+		if (mcast.len > channel_capacity(target) ||
+		    (packet_mode(file_p, target) && mcast.len > target->max_record)){
+			results[i] = -EMSGSIZE;
+			nodes[i] = NULL;
+			continue;
+		}
+		buffer_make_room(target, mcast.len);
+		if (buffer_drop_new(target, mcast.len)){
+			results[i] = mcast.len;
+			ret++;
+			nodes[i] = NULL;
+			continue;
+		}
+		if (buffer_room(target) < (int)mcast.len){
+			results[i] = -EAGAIN;
+			nodes[i] = NULL;
+			continue;
+		}
+		results[i] = buffer_put(target, data, mcast.len, file_ttl(file_p, target));
+		if (results[i] == 0 && mcast.len)
+			results[i] = -ENOMEM;
+		else
+			ret++;
+		buffer_trim(target);
+		if (!target->read_ready)
+			nodes[i] = NULL;
+	}
+	spin_unlock(&sdev->lock);
+	/* Wake readers of each channel once */
+	for (i = 0; i < mcast.count; i++){
+		if (nodes[i] == NULL)
+			continue;
+		for (j = 0; j < i && nodes[j] != nodes[i]; j++)
+			;
+		if (j == i)
+			buffer_wake_readers(nodes[i]);
+	}
+
+	if (mcast.results && copy_to_user(u64_to_user_ptr(mcast.results), results,
+					  array_size(mcast.count, sizeof(*results))))
+		ret = -EFAULT;
+free:
+	kfree(data);
+	kfree(verdicts);
+	kfree(results);
+	kfree(nodes);
+	kfree(channels);
+	return ret;
+}
+
+/*
+ * Commit or return leases of file: given one, or it and all older ones.
+ * Returns number of processed leases.
+ */
+static long sbertask_ack(struct file *file_p, struct sbertask_ack __user *argp)
+{
+	struct sbertask_dev *sdev = file_sdev(file_p);
+	struct sbertask_file *file_ctx = file_p->private_data;
+	struct buffer_lease *lease, *lease_prev;
+	struct rb_buf_node *buf_node;
+	struct sbertask_ack ack;
+	long ret = 0;
+	u64 id;
+
+	if (copy_from_user(&ack, argp, sizeof(ack)))
+		return -EFAULT;
+	if (ack.reserved || (ack.flags & ~(SBERTASK_ACK_UPTO | SBERTASK_ACK_RETURN)))
+		return -EINVAL;
+
+	spin_lock(&sdev->lock);
+	id = ack.lease ? ack.lease : file_ctx->lease_seq;
+	/* Newest first, so returned leases keep their order at queue head */
+	list_for_each_entry_safe_reverse(lease, lease_prev, &file_ctx->leases, file_list){
+		if (lease->id > id)
+			continue;
+		if (lease->id < id && !(ack.flags & SBERTASK_ACK_UPTO))
+			break;
+		buf_node = lease->buf_node;
+		if (ack.flags & SBERTASK_ACK_RETURN){
+			lease_return(lease);
+			buffer_wake_readers(buf_node);
+		} else {
+			lease_commit(lease);
+			buffer_wake(buf_node, &buf_node->write_wq);
+		}
+		ret++;
+	}
+	spin_unlock(&sdev->lock);
+	return ret ? ret : -ENOENT;
+}
+
+/*
+ * Move file's cursor in broadcast or log channel. Bytes before head are
+ * gone, cursor stops at the oldest kept one. Caller holds device lock.
+ * Returns new offset or negative error.
+ */
+static s64 cursor_seek(struct file *file_p, struct rb_buf_node *buf_node, s64 offset)
+{
+	struct sbertask_file *file_ctx = file_p->private_data;
+
+	if (offset < 0 || offset > buf_node->tail_off)
+		return -EINVAL;
+	file_ctx->cursor = max_t(u64, offset, buffer_head_off(buf_node));
+	/* Moving forward may free bytes slowest broadcast reader held */
+	buffer_trim(buf_node);
+	return file_ctx->cursor;
+}
+
+/* File position is cursor offset, lseek() replays retained data */
+static loff_t sbertask_llseek(struct file *file_p, loff_t offset, int whence)
+{
+	struct sbertask_dev *sdev = file_sdev(file_p);
+	struct sbertask_file *file_ctx = file_p->private_data;
+	struct rb_buf_node *buf_node;
+	loff_t ret;
+
+	spin_lock(&sdev->lock);
+	buf_node = file_buffer(file_p);
+	if (buf_node == NULL || !(buf_node->flags & CH_CURSOR)){
+		spin_unlock(&sdev->lock);
+		return -ESPIPE;
+	}
+	/* Writer has no cursor, as reader which never reads it would pin data */
+	if (!(file_p->f_mode & FMODE_READ)){
+		spin_unlock(&sdev->lock);
+		return -EBADF;
+	}
+	reader_attach(file_ctx, buf_node);
+	buffer_trim(buf_node);
+	switch (whence){
+	case SEEK_SET:
+		ret = cursor_seek(file_p, buf_node, offset);
+		break;
+	case SEEK_CUR:
+		ret = cursor_seek(file_p, buf_node, max(file_ctx->cursor, buffer_head_off(buf_node)) + offset);
+		break;
+	case SEEK_END:
+		ret = cursor_seek(file_p, buf_node, buf_node->tail_off + offset);
+		break;
+	default:
+		ret = -EINVAL;
+	}
+	if (ret >= 0)
+		file_p->f_pos = ret;
+	spin_unlock(&sdev->lock);
+	wake_up_interruptible(&buf_node->write_wq);
+	return ret;
+}
+
+static long sbertask_seek(struct file *file_p, struct sbertask_seek __user *argp)
+{
+	struct sbertask_dev *sdev = file_sdev(file_p);
+	struct sbertask_file *file_ctx = file_p->private_data;
+	struct sbertask_seek seek;
+	struct rb_buf_node *buf_node;
+	s64 ret = 0;
+
+	if (copy_from_user(&seek, argp, sizeof(seek)))
+		return -EFAULT;
+	if (seek.reserved || (seek.flags & ~(SBERTASK_SEEK_TSTAMP | SBERTASK_SEEK_QUERY)))
+		return -EINVAL;
+
+	spin_lock(&sdev->lock);
+	buf_node = file_buffer(file_p);
+	if (buf_node == NULL || !(buf_node->flags & CH_CURSOR)){
+		spin_unlock(&sdev->lock);
+		return -EINVAL;
+	}
+	/* Writer may only query, it has no cursor */
+	if (!(file_p->f_mode & FMODE_READ) && !(seek.flags & SBERTASK_SEEK_QUERY)){
+		spin_unlock(&sdev->lock);
+		return -EBADF;
+	}
+	/* Query doesn't join, it tells where reader would start */
+	if ((file_p->f_mode & FMODE_READ) && !(seek.flags & SBERTASK_SEEK_QUERY)){
+		reader_attach(file_ctx, buf_node);
+		buffer_trim(buf_node);
+	}
+	if (seek.flags & SBERTASK_SEEK_QUERY)
+		ret = file_ctx->reader_node == buf_node ? max(file_ctx->cursor, buffer_head_off(buf_node)) :
+		      reader_start(file_ctx, buf_node);
+	else if (seek.flags & SBERTASK_SEEK_TSTAMP)
+		ret = cursor_seek(file_p, buf_node, buffer_find_tstamp(buf_node, ns_to_ktime(seek.tstamp_ns)));
+	else if (seek.offset > S64_MAX)
+		ret = -EINVAL;
+	else
+		ret = cursor_seek(file_p, buf_node, seek.offset);
+	if (ret >= 0)
+		file_p->f_pos = ret;
+	seek.head = buffer_head_off(buf_node);
+	seek.tail = buf_node->tail_off;
+	spin_unlock(&sdev->lock);
+	wake_up_interruptible(&buf_node->write_wq);
+	if (ret < 0)
+		return ret;
+
+	seek.offset = ret;
+	if (copy_to_user(argp, &seek, sizeof(seek)))
+		return -EFAULT;
+	return 0;
+}
+
+/*
+ * Gather read over many channels. Sleeps on read queues of all channels
+ * until any of them is readable, then drains every ready channel into
+ * its user buffer under one lock acquisition.
+ */
+static long sbertask_gather(struct file *file_p, struct sbertask_gather __user *argp)
+{
+	struct sbertask_dev *sdev = file_sdev(file_p);
+	struct sbertask_gather gather;
+	struct sbertask_gather_chan *chans;
+	struct sbertask_gather_chan __user *uchans;
+	struct rb_buf_node **nodes;
+	struct rx_undo *undos;
+	wait_queue_entry_t *waits;
+	char *data = NULL, *p;
+	size_t total = 0;
+	unsigned int i, ready = 0, finished;
+	bool nonblock;
+	long ret = 0;
+
+	if (copy_from_user(&gather, argp, sizeof(gather)))
+		return -EFAULT;
+	if (gather.count == 0 || gather.count > SBERTASK_GATHER_MAX)
+		return -EINVAL;
+	nonblock = (gather.flags & SBERTASK_MSG_DONTWAIT) || (file_p->f_flags & O_NONBLOCK);
+	uchans = u64_to_user_ptr(gather.chans);
+	chans = memdup_user(uchans, array_size(gather.count, sizeof(*chans)));
+	if (IS_ERR(chans))
+		return PTR_ERR(chans);
+	nodes = kcalloc(gather.count, sizeof(*nodes), GFP_KERNEL);
+	waits = kcalloc(gather.count, sizeof(*waits), GFP_KERNEL);
+	undos = kcalloc(gather.count, sizeof(*undos), GFP_KERNEL);
+	if (nodes == NULL || waits == NULL || undos == NULL){
+		ret = -ENOMEM;
+		goto free;
+	}
+
+	spin_lock(&sdev->lock);
+	for (i = 0; i < gather.count; i++){
+		nodes[i] = get_buffer(sdev, chans[i].channel);
+		if (nodes[i] == NULL){
+			spin_unlock(&sdev->lock);
+			ret = -ENOENT;
+			goto free;
+		}
+		if (!channel_readable(nodes[i])){
+			spin_unlock(&sdev->lock);
+			ret = -EPERM;
+			goto free;
+		}
+		/* File reads one channel in reader modes, they and ack channels are read with read() */
+		if (nodes[i]->flags & (CH_READERS | SBERTASK_CH_ACK)){
+			spin_unlock(&sdev->lock);
+			ret = -EINVAL;
+			goto free;
+		}
+		chans[i].len = min_t(__u32, chans[i].len, channel_capacity(nodes[i]));
+		chans[i].result = 0;
+		total += chans[i].len;
+		rx_undo_begin(&undos[i], NULL, nodes[i]);
+	}
+	spin_unlock(&sdev->lock);
+	data = kvmalloc(total ? total : 1, GFP_KERNEL);
+	if (data == NULL){
+		ret = -ENOMEM;
+		goto free;
+	}
+
+	for (i = 0; i < gather.count; i++){
+		init_waitqueue_entry(&waits[i], current);
+		add_wait_queue(&nodes[i]->read_wq, &waits[i]);
+	}
+	for (;;){
+		set_current_state(TASK_INTERRUPTIBLE);
+		spin_lock(&sdev->lock);
+		finished = 0;
+		for (p = data, i = 0; i < gather.count; p += chans[i].len, i++){
+			rx_expire(nodes[i]);
+			if (!rx_ready(file_p, nodes[i], 1)){
+				finished += nodes[i]->finished;
+				continue;
+			}
+			if (nodes[i]->flags & SBERTASK_CH_CODEL)
+				codel_dequeue(nodes[i]);
+			chans[i].result += rx_take(nodes[i], p + chans[i].result, chans[i].len - chans[i].result,
+						   read_how(file_p, nodes[i]), NULL, &undos[i]);
+		}
+		for (i = 0; i < gather.count; i++)
+			ready += chans[i].result != 0;
+		if (ready || finished == gather.count)
+			break;
+		if (nonblock){
+			ret = -EAGAIN;
+			break;
+		}
+		if (signal_pending(current)){
+			ret = -ERESTARTSYS;
+			break;
+		}
+		/* Writers wake only sleeping readers, see rx_wait_begin() */
+		for (i = 0; i < gather.count; i++)
+			rx_wait_begin(nodes[i], 1, 0);
+		spin_unlock(&sdev->lock);
+		schedule();
+		spin_lock(&sdev->lock);
+		for (i = 0; i < gather.count; i++)
+			rx_wait_end(nodes[i]);
+		spin_unlock(&sdev->lock);
+	}
+	spin_unlock(&sdev->lock);
+	__set_current_state(TASK_RUNNING);
+	for (i = 0; i < gather.count; i++){
+		remove_wait_queue(&nodes[i]->read_wq, &waits[i]);
+		if (chans[i].result)
+			buffer_wake(nodes[i], &nodes[i]->write_wq);
+	}
+	if (!ret){
+		ret = ready;
+		for (p = data, i = 0; i < gather.count; p += chans[i].len, i++)
+			if ((chans[i].result && copy_to_user(u64_to_user_ptr(chans[i].buf), p, chans[i].result)) ||
+			    put_user(chans[i].result, &uchans[i].result)){
+				pr_err("sbertask: can't put data to userspace!\n");
+				ret = -EFAULT;
+				break;
+			}
+	}
+	/* Nothing is gathered if any buffer is bad, every channel gets its bytes back */
+	for (i = 0; i < gather.count; i++)
+		if (ret < 0 && !list_empty(&undos[i].elements))
+			rx_undo_abort(&undos[i]);
+		else
+			rx_undo_end(&undos[i]);
+free:
+	kvfree(data);
+	kfree(undos);
+	kfree(waits);
+	kfree(nodes);
+	kfree(chans);
+	return ret;
+}
+
+/* Min-heap of merged channels, key is enqueue time of channel's head record */
+struct merge_heap {
+	unsigned int nr;
+	unsigned int idx[SBERTASK_MERGE_MAX];
+	ktime_t key[SBERTASK_MERGE_MAX];
+};
+
+static void merge_heap_push(struct merge_heap *heap, unsigned int idx, ktime_t key)
+{
+	unsigned int i = heap->nr++, parent;
+
+	while (i){
+		parent = (i - 1) / 2;
+		if (heap->key[parent] <= key)
+			break;
+		heap->idx[i] = heap->idx[parent];
+		heap->key[i] = heap->key[parent];
+		i = parent;
+	}
+	heap->idx[i] = idx;
+	heap->key[i] = key;
+}
+
+static unsigned int merge_heap_pop(struct merge_heap *heap)
+{
+	unsigned int top = heap->idx[0], i = 0, child, idx;
+	ktime_t key;
+
+	if (--heap->nr == 0)
+		return top;
+	idx = heap->idx[heap->nr];
+	key = heap->key[heap->nr];
+	while ((child = 2 * i + 1) < heap->nr){
+		if (child + 1 < heap->nr && heap->key[child + 1] < heap->key[child])
+			child++;
+		if (key <= heap->key[child])
+			break;
+		heap->idx[i] = heap->idx[child];
+		heap->key[i] = heap->key[child];
+		i = child;
+	}
+	heap->idx[i] = idx;
+	heap->key[i] = key;
+	return top;
+}
+
+static inline ktime_t buffer_head_tstamp(struct rb_buf_node *buf_node)
+{
+	return list_first_entry(&buf_node->buffer_head->list, struct buffer_element, list)->tstamp;
+}
+
+/* Copy merged records, their sources and stamps to user. Returns number of records or -EFAULT. */
+static long merge_put(struct sbertask_merge *merge, struct sbertask_msg *msgs, char *data, __u64 *sources,
+		      struct sbertask_tstamp *tstamps, unsigned int received)
+{
+	struct sbertask_msg __user *umsgs = u64_to_user_ptr(merge->msgs);
+	unsigned int i;
+	char *p;
+
+	for (p = data, i = 0; i < received; p += msgs[i].len, i++)
+		if (copy_to_user(u64_to_user_ptr(msgs[i].buf), p, msgs[i].result) ||
+		    put_user(msgs[i].result, &umsgs[i].result))
+			goto fault;
+	if (merge->sources &&
+	    copy_to_user(u64_to_user_ptr(merge->sources), sources, array_size(received, sizeof(*sources))))
+		goto fault;
+	if (tstamps &&
+	    copy_to_user(u64_to_user_ptr(merge->tstamps), tstamps, array_size(received, sizeof(*tstamps))))
+		goto fault;
+	return received;
+fault:
+	pr_err("sbertask: can't put data to userspace!\n");
+	return -EFAULT;
+}
+
+/*
+ * K-way merge of channels by enqueue time. Sleeps until every channel
+ * has data or was idle for lag_us, then takes records with min-heap.
+ * Enqueue stamps are taken under device lock, so later write can't get
+ * earlier stamp and order is exact; lag only lets slow inputs catch up.
+ */
+static long sbertask_merge(struct file *file_p, struct sbertask_merge __user *argp)
+{
+	struct sbertask_dev *sdev = file_sdev(file_p);
+	struct sbertask_merge merge;
+	struct sbertask_msg *msgs = NULL;
+	struct sbertask_msg __user *umsgs;
+	struct sbertask_tstamp *tstamps = NULL;
+	struct rb_buf_node **nodes = NULL;
+	struct rx_undo *undos = NULL;
+	wait_queue_entry_t *waits = NULL;
+	struct merge_heap *heap = NULL;
+	__u64 *channels, *sources = NULL;
+	ktime_t now, idle_at, deadline;
+	char *data = NULL, *p;
+	size_t total = 0;
+	unsigned int i, received = 0, has_data, waiting, finished, capacity = 0;
+	bool nonblock;
+	long ret = 0;
+
+	if (copy_from_user(&merge, argp, sizeof(merge)))
+		return -EFAULT;
+	if (merge.count == 0 || merge.count > SBERTASK_MERGE_MAX)
+		return -EINVAL;
+	if (merge.msg_count == 0 || merge.msg_count > SBERTASK_MMSG_MAX)
+		return -EINVAL;
+	nonblock = (merge.flags & SBERTASK_MSG_DONTWAIT) || (file_p->f_flags & O_NONBLOCK);
+	channels = memdup_user(u64_to_user_ptr(merge.channels), array_size(merge.count, sizeof(*channels)));
+	if (IS_ERR(channels))
+		return PTR_ERR(channels);
+	umsgs = u64_to_user_ptr(merge.msgs);
+	msgs = memdup_user(umsgs, array_size(merge.msg_count, sizeof(*msgs)));
+	if (IS_ERR(msgs)){
+		ret = PTR_ERR(msgs);
+		msgs = NULL;
+		goto free;
+	}
+	nodes = kcalloc(merge.count, sizeof(*nodes), GFP_KERNEL);
+	waits = kcalloc(merge.count, sizeof(*waits), GFP_KERNEL);
+	undos = kcalloc(merge.count, sizeof(*undos), GFP_KERNEL);
+	heap = kmalloc(sizeof(*heap), GFP_KERNEL);
+	sources = kcalloc(merge.msg_count, sizeof(*sources), GFP_KERNEL);
+	if (merge.tstamps)
+		tstamps = kcalloc(merge.msg_count, sizeof(*tstamps), GFP_KERNEL);
+	if (!nodes || !waits || !undos || !heap || !sources || (merge.tstamps && !tstamps)){
+		ret = -ENOMEM;
+		goto free;
+	}
+
+	spin_lock(&sdev->lock);
+	for (i = 0; i < merge.count; i++){
+		nodes[i] = get_buffer(sdev, channels[i]);
+		if (nodes[i] == NULL){
+			spin_unlock(&sdev->lock);
+			ret = -ENOENT;
+			goto free;
+		}
+		if (!channel_readable(nodes[i])){
+			spin_unlock(&sdev->lock);
+			ret = -EPERM;
+			goto free;
+		}
+		if (!(nodes[i]->flags & SBERTASK_CH_TSTAMP) || (nodes[i]->flags & (CH_READERS | SBERTASK_CH_ACK))){
+			spin_unlock(&sdev->lock);
+			ret = -EINVAL;
+			goto free;
+		}
+		capacity = max(capacity, channel_capacity(nodes[i]));
+		rx_undo_begin(&undos[i], NULL, nodes[i]);
+	}
+	spin_unlock(&sdev->lock);
+	/* Slot may get record of any channel */
+	for (i = 0; i < merge.msg_count; i++){
+		msgs[i].len = min_t(__u32, msgs[i].len, capacity);
+		msgs[i].result = 0;
+		total += msgs[i].len;
+	}
+	data = kvmalloc(total ? total : 1, GFP_KERNEL);
+	if (data == NULL){
+		ret = -ENOMEM;
+		goto free;
+	}
+
+	for (i = 0; i < merge.count; i++){
+		init_waitqueue_entry(&waits[i], current);
+		add_wait_queue(&nodes[i]->read_wq, &waits[i]);
+	}
+	for (;;){
+		set_current_state(TASK_INTERRUPTIBLE);
+		spin_lock(&sdev->lock);
+		now = ktime_get();
+		deadline = KTIME_MAX;
+		has_data = waiting = finished = 0;
+		for (i = 0; i < merge.count; i++){
+			/* Heap is built under this lock, it sees only live head records */
+			rx_expire(nodes[i]);
+			if (nodes[i]->buffer_length){
+				has_data++;
+				continue;
+			}
+			if (nodes[i]->finished){
+				finished++;
+				continue;
+			}
+			idle_at = ktime_add_us(nodes[i]->last_enqueue, merge.lag_us);
+			if (ktime_after(idle_at, now)){
+				waiting++;
+				deadline = min(deadline, idle_at);
+			}
+		}
+		if (has_data && (!waiting || nonblock))
+			break;
+		if (finished == merge.count)
+			break;
+		if (nonblock || signal_pending(current)){
+			ret = nonblock ? -EAGAIN : -ERESTARTSYS;
+			break;
+		}
+		for (i = 0; i < merge.count; i++)
+			rx_wait_begin(nodes[i], 1, 0);
+		spin_unlock(&sdev->lock);
+		if (has_data)
+			schedule_hrtimeout(&deadline, HRTIMER_MODE_ABS);
+		else
+			schedule();
+		spin_lock(&sdev->lock);
+		for (i = 0; i < merge.count; i++)
+			rx_wait_end(nodes[i]);
+		spin_unlock(&sdev->lock);
+	}
+	if (!ret){
+		heap->nr = 0;
+		/* CoDel looks at head of channel before each record taken from it */
+		for (i = 0; i < merge.count; i++){
+			if (nodes[i]->buffer_length && (nodes[i]->flags & SBERTASK_CH_CODEL))
+				codel_dequeue(nodes[i]);
+			if (nodes[i]->buffer_length)
+				merge_heap_push(heap, i, buffer_head_tstamp(nodes[i]));
+		}
+		for (p = data; received < merge.msg_count && heap->nr; p += msgs[received].len, received++){
+			i = merge_heap_pop(heap);
+			msgs[received].result = rx_take(nodes[i], p, msgs[received].len, GET_RECORD,
+							tstamps ? &tstamps[received] : NULL, &undos[i]);
+			sources[received] = nodes[i]->key;
+			rx_expire(nodes[i]);
+			if (nodes[i]->buffer_length && (nodes[i]->flags & SBERTASK_CH_CODEL))
+				codel_dequeue(nodes[i]);
+			if (nodes[i]->buffer_length)
+				merge_heap_push(heap, i, buffer_head_tstamp(nodes[i]));
+		}
+	}
+	spin_unlock(&sdev->lock);
+	__set_current_state(TASK_RUNNING);
+	for (i = 0; i < merge.count; i++){
+		remove_wait_queue(&nodes[i]->read_wq, &waits[i]);
+		buffer_wake(nodes[i], &nodes[i]->write_wq);
+	}
+	if (!ret)
+		ret = merge_put(&merge, msgs, data, sources, tstamps, received);
+	/* Nothing is merged if any buffer is bad, every channel gets its records back */
+	for (i = 0; i < merge.count; i++)
+		if (ret < 0 && !list_empty(&undos[i].elements))
+			rx_undo_abort(&undos[i]);
+		else
+			rx_undo_end(&undos[i]);
+free:
+	kfree(tstamps);
+	kvfree(data);
+	kfree(sources);
+	kfree(heap);
+	kfree(undos);
+	kfree(waits);
+	kfree(nodes);
+	kfree(msgs);
+	kfree(channels);
+	return ret;
+}
+
+static long sbertask_ioctl (struct file *file_p, unsigned int cmd, unsigned long arg)
+{
+	struct sbertask_file *file_ctx = file_p->private_data;
+	void __user *argp = (void __user *)arg;
+
+	switch (cmd) {
+		case SBERTASK_IOC_SENDMMSG:
+			return sbertask_sendmmsg(file_p, argp);
+		case SBERTASK_IOC_RECVMMSG:
+			return sbertask_recvmmsg(file_p, argp);
+		case SBERTASK_IOC_GET_CONFIG:
+			return sbertask_get_config(file_p, argp);
+		case SBERTASK_IOC_SET_CONFIG:
+			return sbertask_set_config(file_p, argp);
+		case SBERTASK_IOC_GET_TSTAMP:
+			if (copy_to_user(argp, &file_ctx->last_tstamp, sizeof(file_ctx->last_tstamp)))
+				return -EFAULT;
+			return 0;
+		case SBERTASK_IOC_GET_RXPOLICY:
+			return sbertask_get_rxpolicy(file_p, argp);
+		case SBERTASK_IOC_SET_RXPOLICY:
+			return sbertask_set_rxpolicy(file_p, argp);
+		case SBERTASK_IOC_GET_STATS:
+			return sbertask_get_stats(file_p, argp);
+		case SBERTASK_IOC_SET_EVENTFD:
+			return sbertask_set_eventfd(file_p, argp);
+		case SBERTASK_IOC_GATHER:
+			return sbertask_gather(file_p, argp);
+		case SBERTASK_IOC_MERGE:
+			return sbertask_merge(file_p, argp);
+		case SBERTASK_IOC_SEEK:
+			return sbertask_seek(file_p, argp);
+		case SBERTASK_IOC_ACK:
+			return sbertask_ack(file_p, argp);
+		case SBERTASK_IOC_GET_GROUP:
+			return sbertask_get_group(file_p, argp);
+		case SBERTASK_IOC_SET_FILTER:
+			return sbertask_set_filter(file_p, argp);
+		case SBERTASK_IOC_ATTACH:
+			return sbertask_attach(file_p, argp);
+		case SBERTASK_IOC_SENDTO:
+			return sbertask_sendto(file_p, argp);
+		case SBERTASK_IOC_MCAST:
+			return sbertask_mcast(file_p, argp);
+		case SBERTASK_IOC_GET_SEQ:
+			return sbertask_get_seq(file_p, argp);
+		case SBERTASK_IOC_SET_TTL:
+			return sbertask_set_ttl(file_p, argp);
+		case SBERTASK_IOC_SET_DEADLETTER:
+			return sbertask_set_deadletter(file_p, argp);
+		default:
+			return -ENOTTY;
+	}
+};
+
+
+static const struct file_operations f_ops = {
+	.owner   = THIS_MODULE,
+	.open    = sbertask_open,
+	.release = sbertask_release,
+	.read    = sbertask_read,
+	.write   = sbertask_write,
+	.llseek  = sbertask_llseek,
+	.unlocked_ioctl = sbertask_ioctl,
+	.compat_ioctl   = compat_ptr_ioctl,
+};
+
+/* Free all channels of device. Its files are closed, but lease timeouts and expiry sweeps may be pending */
+static void sdev_free_buffers(struct sbertask_dev *sdev)
+{
+	struct rb_node *node, *next;
+	/* Sweep may move records to other channel, so all of them are stopped before any is freed */
+	for (node = rb_first(&sdev->root); node; node = rb_next(node)){
+		struct rb_buf_node *buf_node;
+                buf_node = container_of( node, struct rb_buf_node, node);
+		cancel_delayed_work_sync(&buf_node->lease_work);
+		cancel_delayed_work_sync(&buf_node->ttl_work);
+	}
+	/* Iterate over rb tree, attached channels exist in any mode */
+	for (node = rb_first(&sdev->root); node; node = next){
+		struct rb_buf_node *buf_node;
+                buf_node = container_of( node, struct rb_buf_node, node);
+		next = rb_next(node);
+		spin_lock(&buffer_lock);
+		rm_buffer(sdev, buf_node->key);
+		spin_unlock(&buffer_lock);
+	}
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
+static char *sbertask_devnode(const struct device *dev, umode_t *mode)
+#else
+static char *sbertask_devnode(struct device *dev, umode_t *mode)
+#endif
+{
+	/* Same as mknod -m 666 in start.sh */
+	if (mode)
+		*mode = 0666;
+	return NULL;
+}
+
+/*
+ * Device changes go to each channel of device. Idle channel takes them at
+ * once, busy one at its drain point, see channel_apply_pending().
+ * Caller holds device lock.
+ */
+static void sdev_reconfigure(struct sbertask_dev *sdev, unsigned int what)
+{
+	struct rb_buf_node *buf_node;
+	struct rb_node *node;
+
+	for (node = rb_first(&sdev->root); node; node = rb_next(node)){
+		buf_node = container_of(node, struct rb_buf_node, node);
+		if (what & PENDING_CAPACITY)
+			buf_node->pending_capacity = sdev->capacity;
+		if (what & PENDING_FLAGS)
+			buf_node->pending_flags = sdev->flags;
+		buf_node->pending |= what;
+		channel_apply_pending(buf_node);
+		if (buf_node->write_ready)
+			wake_up_interruptible(&buf_node->write_wq);
+	}
+}
+
+static ssize_t mode_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct sbertask_dev *sdev = dev_get_drvdata(dev);
+	int dev_mode;
+
+	mutex_lock(&devices_mutex);
+	dev_mode = sdev->pending_mode >= 0 ? sdev->pending_mode : sdev->mode;
+	mutex_unlock(&devices_mutex);
+	return sysfs_emit(buf, "%s\n", mode_names[dev_mode]);
+}
+
+/* Open files rely on mode they were opened with, so it changes when device is closed */
+static ssize_t mode_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct sbertask_dev *sdev = dev_get_drvdata(dev);
+	int dev_mode = sysfs_match_string(mode_names, buf);
+
+	if (dev_mode < 0)
+		return dev_mode;
+	mutex_lock(&devices_mutex);
+	if (sdev->users)
+		sdev->pending_mode = dev_mode;
+	else {
+		sdev->mode = dev_mode;
+		sdev->pending_mode = -1;
+	}
+	mutex_unlock(&devices_mutex);
+	return count;
+}
+static DEVICE_ATTR_RW(mode);
+
+static ssize_t capacity_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct sbertask_dev *sdev = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(sdev->capacity));
+}
+
+static ssize_t capacity_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct sbertask_dev *sdev = dev_get_drvdata(dev);
+	unsigned int capacity;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &capacity);
+	if (ret)
+		return ret;
+	if (capacity == 0 || capacity > SBERTASK_CAPACITY_MAX)
+		return -EINVAL;
+	spin_lock(&sdev->lock);
+	WRITE_ONCE(sdev->capacity, capacity);
+	if (sdev->rx_policy.min_bytes > capacity)
+		sdev->rx_policy.min_bytes = capacity;
+	sdev_reconfigure(sdev, PENDING_CAPACITY);
+	spin_unlock(&sdev->lock);
+	return count;
+}
+static DEVICE_ATTR_RW(capacity);
+
+static ssize_t flags_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct sbertask_dev *sdev = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "0x%x\n", READ_ONCE(sdev->flags));
+}
+
+/* Overflow policy and the rest of SBERTASK_CH_*, replaces flags set by SBERTASK_IOC_SET_CONFIG */
+static ssize_t flags_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct sbertask_dev *sdev = dev_get_drvdata(dev);
+	unsigned int flags;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &flags);
+	if (ret)
+		return ret;
+	if (!flags_valid(flags))
+		return -EINVAL;
+	spin_lock(&sdev->lock);
+	WRITE_ONCE(sdev->flags, flags);
+	sdev_reconfigure(sdev, PENDING_FLAGS);
+	spin_unlock(&sdev->lock);
+	return count;
+}
+static DEVICE_ATTR_RW(flags);
+
+/* Wakeup policy of readers which didn't set SBERTASK_IOC_SET_RXPOLICY, used on their next sleep */
+static ssize_t wake_min_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct sbertask_dev *sdev = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(sdev->rx_policy.min_bytes));
+}
+
+static ssize_t wake_min_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct sbertask_dev *sdev = dev_get_drvdata(dev);
+	unsigned int min_bytes;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &min_bytes);
+	if (ret)
+		return ret;
+	spin_lock(&sdev->lock);
+	if (min_bytes > sdev->capacity)
+		ret = -EINVAL;
+	else
+		sdev->rx_policy.min_bytes = min_bytes;
+	spin_unlock(&sdev->lock);
+	return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(wake_min);
+
+static ssize_t wake_delay_us_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct sbertask_dev *sdev = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(sdev->rx_policy.max_delay_us));
+}
+
+static ssize_t wake_delay_us_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct sbertask_dev *sdev = dev_get_drvdata(dev);
+	unsigned int delay;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &delay);
+	if (ret)
+		return ret;
+	spin_lock(&sdev->lock);
+	sdev->rx_policy.max_delay_us = delay;
+	spin_unlock(&sdev->lock);
+	return count;
+}
+static DEVICE_ATTR_RW(wake_delay_us);
+
+/* /sys/class/sbertask/sbertaskN/ */
+static struct attribute *sbertask_attrs[] = {
+	&dev_attr_mode.attr,
+	&dev_attr_capacity.attr,
+	&dev_attr_flags.attr,
+	&dev_attr_wake_min.attr,
+	&dev_attr_wake_delay_us.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(sbertask);
+
+/*
+ * Snapshot of queued data. Old module writes it at unload, new one restores
+ * channels from it before its devices may be opened. Header is written last,
+ * so half written snapshot is not taken.
+ */
+#define SNAP_MAGIC   0x51534253	/* "SBSQ" */
+#define SNAP_VERSION 2
+
+struct snap_header {
+	u32 	magic;
+	u32 	version;
+	u32 	nr_devices;
+	u32 	reserved;
+};
+
+/* Device, its nr_channels channels follow */
+struct snap_dev {
+	s32 	index;
+	u32 	mode;
+	u32 	capacity;
+	u32 	flags;
+	u32 	wake_min;
+	u32 	wake_delay_us;
+	u32 	nr_channels;
+	u32 	reserved;
+};
+
+/* Channel, its length queued bytes follow */
+struct snap_chan {
+	u64 	key;
+	char 	name[SBERTASK_NAME_MAX];
+	u64 	tail_off;
+	u32 	capacity;
+	u32 	flags;
+	u32 	max_record;
+	u32 	delimiter;
+	u32 	spin_max_ns;
+	u32 	chunk;
+	u32 	lag_limit;
+	u32 	retain_bytes;
+	u32 	retain_ms;
+	u32 	lease_ms;
+	u32 	key_bytes;
+	u32 	partitions;
+	u32 	length;
+	u32 	seq_next;
+	struct 	sbertask_stats stats;
+	/* Version 2 */
+	u32 	ttl_ms;
+	u32 	dead_set;
+	u64 	dead_key;
+	u32 	codel_target_us;
+	u32 	codel_interval_us;
+};
+
+struct snap_elem {
+	s64 	tstamp;
+	u32 	seq;
+	char 	data;
+	u8 	flags;
+	u8 	part;
+	u8 	reserved;
+	/* Version 2 */
+	s64 	expires;
+};
+
+/* Version 1 records are prefixes of version 2 ones */
+#define SNAP_CHAN_V1 offsetof(struct snap_chan, ttl_ms)
+#define SNAP_ELEM_V1 offsetof(struct snap_elem, expires)
+
+/* Snapshot read at load, lives until module_start() ends */
+static char *snap_data;
+static size_t snap_size;
+static size_t snap_devs[SBERTASK_DEV_MAX];	/* offset of device in snap_data, 0 - none */
+static size_t snap_chan_size, snap_elem_size;	/* depend on snapshot version */
+
+static int snap_write(struct file *snap_file, const void *data, size_t size, loff_t *pos)
+{
+	ssize_t ret = kernel_write(snap_file, data, size, pos);
+
+	if (ret < 0)
+		return ret;
+	return ret == size ? 0 : -EIO;
+}
+
+/* Next size bytes of snapshot, NULL if it is too short */
+static void *snap_take(size_t *pos, size_t size)
+{
+	void *p;
+
+	if (size > snap_size - *pos)
+		return NULL;
+	p = snap_data + *pos;
+	*pos += size;
+	return p;
+}
+
+static int snapshot_save_chan(struct file *snap_file, loff_t *pos, struct rb_buf_node *buf_node)
+{
+	struct sbertask_dev *sdev = buf_node->sdev;
+	struct buffer_element *queue_iter;
+	struct snap_chan *chan;
+	struct snap_elem *elem;
+	u32 length, n = 0;
+	int ret;
+
+	spin_lock(&sdev->lock);
+	length = buf_node->buffer_length;
+	spin_unlock(&sdev->lock);
+	chan = kvzalloc(sizeof(*chan) + length * sizeof(*elem), GFP_KERNEL);
+	if (chan == NULL)
+		return -ENOMEM;
+	elem = (struct snap_elem *)(chan + 1);
+
+	spin_lock(&sdev->lock);
+	chan->key = buf_node->key;
+	memcpy(chan->name, buf_node->name, sizeof(chan->name));
+	chan->tail_off = buf_node->tail_off;
+	chan->capacity = buf_node->capacity;
+	chan->flags = buf_node->flags;
+	chan->max_record = buf_node->max_record;
+	chan->delimiter = (unsigned char)buf_node->delimiter;
+	chan->spin_max_ns = buf_node->spin_max_ns;
+	chan->chunk = buf_node->chunk;
+	chan->lag_limit = buf_node->lag_limit;
+	chan->retain_bytes = buf_node->retain_bytes;
+	chan->retain_ms = buf_node->retain_ms;
+	chan->lease_ms = buf_node->lease_ms;
+	chan->key_bytes = buf_node->key_bytes;
+	chan->partitions = buf_node->partitions;
+	chan->stats = buf_node->stats;
+	chan->seq_next = buf_node->seq_next;
+	chan->ttl_ms = buf_node->ttl_ms;
+	chan->dead_set = buf_node->dead_set;
+	chan->dead_key = buf_node->dead_key;
+	chan->codel_target_us = buf_node->codel_target_us;
+	chan->codel_interval_us = buf_node->codel_interval_us;
+	if (buf_node->buffer_head)
+		list_for_each_entry(queue_iter, &buf_node->buffer_head->list, list){
+			if (n == length)
+				break;
+			elem[n].tstamp = ktime_to_ns(queue_iter->tstamp);
+			elem[n].data = queue_iter->data;
+			elem[n].flags = queue_iter->flags;
+			elem[n].part = queue_iter->part;
+			elem[n].seq = queue_iter->seq;
+			elem[n].expires = ktime_to_ns(queue_iter->expires);
+			n++;
+		}
+	chan->length = n;
+	spin_unlock(&sdev->lock);
+
+	ret = snap_write(snap_file, chan, sizeof(*chan) + n * sizeof(*elem), pos);
+	kvfree(chan);
+	return ret;
+}
+
+/*
+ * Copy of snapshot parameter, NULL if it is not set. Parameter is writable
+ * through sysfs, so it is read under parameter lock. Caller frees the copy.
+ */
+static char *snapshot_path(void)
+{
+	char *path = NULL;
+
+	kernel_param_lock(THIS_MODULE);
+	if (snapshot && snapshot[0])
+		path = kstrdup(snapshot, GFP_KERNEL);
+	kernel_param_unlock(THIS_MODULE);
+	return path;
+}
+
+/* Write channels of all devices to snapshot. No files are open, channels don't come and go. */
+static void snapshot_save(void)
+{
+	struct snap_header header = { .magic = SNAP_MAGIC, .version = SNAP_VERSION };
+	struct sbertask_dev *sdev;
+	struct file *snap_file;
+	struct snap_dev dev;
+	struct rb_node *node;
+	loff_t pos = sizeof(header), start = 0;
+	char *path;
+	int i, ret = 0;
+
+	path = snapshot_path();
+	if (path == NULL)
+		return;
+	snap_file = filp_open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (IS_ERR(snap_file)){
+		pr_err("sbertask: can't open snapshot %s, queued data is lost\n", path);
+		kfree(path);
+		return;
+	}
+	for (i = 0; i < SBERTASK_DEV_MAX && !ret; i++){
+		sdev = devices[i];
+		if (sdev == NULL)
+			continue;
+		memset(&dev, 0, sizeof(dev));
+		dev.index = i;
+		dev.mode = sdev->pending_mode >= 0 ? sdev->pending_mode : sdev->mode;
+		dev.capacity = sdev->capacity;
+		dev.flags = sdev->flags;
+		dev.wake_min = sdev->rx_policy.min_bytes;
+		dev.wake_delay_us = sdev->rx_policy.max_delay_us;
+		for (node = rb_first(&sdev->root); node; node = rb_next(node))
+			dev.nr_channels++;
+		ret = snap_write(snap_file, &dev, sizeof(dev), &pos);
+		for (node = rb_first(&sdev->root); node && !ret; node = rb_next(node))
+			ret = snapshot_save_chan(snap_file, &pos, container_of(node, struct rb_buf_node, node));
+		header.nr_devices++;
+	}
+	if (!ret)
+		ret = snap_write(snap_file, &header, sizeof(header), &start);
+	filp_close(snap_file, NULL);
+	if (ret)
+		pr_err("sbertask: can't write snapshot %s, error %d, queued data is lost\n", path, ret);
+	else
+		pr_info("sbertask: %u devices saved to %s\n", header.nr_devices, path);
+	kfree(path);
+}
+
+/* Check whole snapshot before anything is restored from it, note where devices are */
+static bool snapshot_valid(void)
+{
+	struct snap_header *header;
+	struct snap_chan *chan;
+	struct snap_dev *dev;
+	size_t pos = 0;
+	u32 i, j;
+
+	header = snap_take(&pos, sizeof(*header));
+	if (header == NULL || header->magic != SNAP_MAGIC)
+		return false;
+	switch (header->version) {
+		case 1:
+			snap_chan_size = SNAP_CHAN_V1;
+			snap_elem_size = SNAP_ELEM_V1;
+			break;
+		case SNAP_VERSION:
+			snap_chan_size = sizeof(struct snap_chan);
+			snap_elem_size = sizeof(struct snap_elem);
+			break;
+		default:
+			return false;
+	}
+	for (i = 0; i < header->nr_devices; i++){
+		dev = snap_take(&pos, sizeof(*dev));
+		if (dev == NULL || dev->index < 0 || dev->index >= SBERTASK_DEV_MAX || snap_devs[dev->index])
+			return false;
+		if (dev->mode > MODE_MULTI || dev->capacity == 0 || dev->capacity > SBERTASK_CAPACITY_MAX ||
+		    !flags_valid(dev->flags) || dev->wake_min > dev->capacity)
+			return false;
+		snap_devs[dev->index] = (char *)dev - snap_data;
+		for (j = 0; j < dev->nr_channels; j++){
+			chan = snap_take(&pos, snap_chan_size);
+			if (chan == NULL || chan->capacity == 0 || chan->capacity > SBERTASK_CAPACITY_MAX ||
+			    chan->length > SBERTASK_CAPACITY_MAX || !flags_valid(chan->flags))
+				return false;
+			if (snap_take(&pos, chan->length * snap_elem_size) == NULL)
+				return false;
+		}
+	}
+	return pos == snap_size;
+}
+
+/* Read snapshot left by previous module, if there is one */
+static void snapshot_load(void)
+{
+	struct file *snap_file;
+	loff_t size, pos = 0;
+	char *path;
+	ssize_t ret;
+
+	path = snapshot_path();
+	if (path == NULL)
+		return;
+	snap_file = filp_open(path, O_RDONLY, 0);
+	if (IS_ERR(snap_file)){
+		if (PTR_ERR(snap_file) != -ENOENT)
+			pr_err("sbertask: can't open snapshot %s\n", path);
+		kfree(path);
+		return;
+	}
+	/* Empty one is already restored */
+	size = i_size_read(file_inode(snap_file));
+	if (size == 0)
+		goto close;
+	if (size > INT_MAX)
+		goto damaged;
+	snap_data = kvmalloc(size, GFP_KERNEL);
+	if (snap_data == NULL)
+		goto damaged;
+	snap_size = size;
+	ret = kernel_read(snap_file, snap_data, size, &pos);
+	if (ret == size && snapshot_valid())
+		goto close;
+	kvfree(snap_data);
+	snap_data = NULL;
+	memset(snap_devs, 0, sizeof(snap_devs));
+damaged:
+	pr_err("sbertask: can't take snapshot %s, queued data is lost\n", path);
+close:
+	filp_close(snap_file, NULL);
+	kfree(path);
+}
+
+/* Channel with its queue of snap_elem_size records. Device is not visible yet, so no lock is needed. */
+static int snapshot_restore_chan(struct sbertask_dev *sdev, const struct snap_chan *chan, const char *elems)
+{
+	unsigned int capacity = chan->capacity;
+	struct buffer_element *element;
+	struct rb_buf_node *buf_node;
+	struct snap_elem elem;
+	ktime_t next = KTIME_MAX;
+	u32 i;
+
+	if (add_buffer(sdev, chan->key))
+		return -ENOMEM;
+	buf_node = get_buffer(sdev, chan->key);
+	memcpy(buf_node->name, chan->name, sizeof(buf_node->name));
+	buf_node->capacity = capacity;
+	buf_node->max_record = clamp(chan->max_record, 1u, capacity);
+	buf_node->chunk = clamp(chan->chunk, 1u, capacity);
+	buf_node->lag_limit = clamp(chan->lag_limit, 1u, capacity);
+	buf_node->retain_bytes = clamp(chan->retain_bytes, 1u, capacity);
+	buf_node->ev_space = capacity;
+	channel_set_flags(buf_node, chan->flags);
+	/* Device may come with other capacity, reads are cut to it. Queued bytes over it drain first. */
+	if (capacity != sdev->capacity)
+		channel_resize(buf_node, sdev->capacity);
+	buf_node->delimiter = chan->delimiter;
+	if (chan->spin_max_ns && chan->spin_max_ns <= NSEC_PER_SEC / HZ)
+		buf_node->spin_max_ns = chan->spin_max_ns;
+	buf_node->retain_ms = chan->retain_ms;
+	buf_node->lease_ms = chan->lease_ms;
+	buf_node->key_bytes = clamp_t(u32, chan->key_bytes, 1, SBERTASK_KEY_MAX);
+	buf_node->partitions = clamp_t(u32, chan->partitions, 1, SBERTASK_PART_MAX);
+	buf_node->stats = chan->stats;
+	buf_node->tail_off = chan->tail_off;
+	buf_node->seq_next = chan->seq_next;
+	buf_node->ttl_ms = (buf_node->flags & CH_CURSOR) ? 0 : chan->ttl_ms;
+	buf_node->dead_set = chan->dead_set && chan->dead_key != chan->key;
+	buf_node->dead_key = chan->dead_key;
+	if (chan->codel_target_us && chan->codel_target_us <= chan->codel_interval_us){
+		buf_node->codel_target_us = chan->codel_target_us;
+		buf_node->codel_interval_us = chan->codel_interval_us;
+	}
+	if (chan->length == 0)
+		return 0;
+
+	buf_node->buffer_head = kmem_cache_alloc(buffer_cache, GFP_KERNEL);
+	if (buf_node->buffer_head == NULL)
+		return -ENOMEM;
+	INIT_LIST_HEAD(&buf_node->buffer_head->list);
+	buf_node->buffer_tail = buf_node->buffer_head;
+	for (i = 0; i < chan->length; i++){
+		element = kmem_cache_alloc(buffer_cache, GFP_KERNEL);
+		if (element == NULL)
+			break;
+		memset(&elem, 0, sizeof(elem));
+		memcpy(&elem, elems + i * snap_elem_size, snap_elem_size);
+		element->data = elem.data;
+		element->flags = elem.flags & ELEMENT_EOR;
+		element->part = elem.part < buf_node->partitions ? elem.part : 0;
+		element->seq = elem.seq;
+		element->tstamp = ns_to_ktime(elem.tstamp);
+		element->expires = (buf_node->flags & CH_CURSOR) ? 0 : ns_to_ktime(elem.expires);
+		if (element->expires){
+			buf_node->ttl_bytes++;
+			next = min(next, element->expires);
+		}
+		if (element->data == buf_node->delimiter)
+			buf_node->delim_count++;
+		list_add_tail(&element->list, &buf_node->buffer_head->list);
+		buf_node->buffer_tail = element;
+		buf_node->buffer_length++;
+		buf_node->part_bytes[element->part]++;
+	}
+	if (buf_node->buffer_length){
+		buf_node->buffer_tail->flags |= ELEMENT_EOR;
+		element = list_first_entry(&buf_node->buffer_head->list, struct buffer_element, list);
+		buf_node->first_byte = element->tstamp ? element->tstamp : ktime_get();
+		buf_node->last_enqueue = buf_node->buffer_tail->tstamp;
+		buf_node->read_ready = buf_node->buffer_length >= buf_node->wake_min || buffer_room(buf_node) <= 0;
+	}
+	/* Records which expired while module was away go at first sweep */
+	if (buf_node->ttl_bytes)
+		ttl_arm(buf_node, next);
+	return i == chan->length ? 0 : -ENOMEM;
+}
+
+/* Channels device had in previous module */
+static void snapshot_restore(struct sbertask_dev *sdev)
+{
+	size_t pos = snap_devs[sdev->index];
+	struct snap_chan *chan;
+	struct snap_dev *dev;
+	const char *elems;
+	int ret;
+	u32 i;
+
+	if (snap_data == NULL || pos == 0)
+		return;
+	snap_devs[sdev->index] = 0;
+	dev = snap_take(&pos, sizeof(*dev));
+	sdev->rx_policy.min_bytes = min(dev->wake_min, sdev->capacity);
+	sdev->rx_policy.max_delay_us = dev->wake_delay_us;
+	for (i = 0; i < dev->nr_channels; i++){
+		/* Version 1 channel lacks tail fields, they stay zero */
+		chan = kzalloc(sizeof(*chan), GFP_KERNEL);
+		ret = -ENOMEM;
+		if (chan){
+			memcpy(chan, snap_take(&pos, snap_chan_size), snap_chan_size);
+			elems = snap_take(&pos, chan->length * snap_elem_size);
+			ret = snapshot_restore_chan(sdev, chan, elems);
+			kfree(chan);
+		}
+		if (ret){
+			pr_err("sbertask: can't restore all channels of device %d\n", sdev->index);
+			break;
+		}
+	}
+	pr_info("sbertask: device %d restored %u channels\n", sdev->index, i);
+}
+
+/* Snapshot is taken, drop it. Truncated, it isn't restored again by next load. */
+static void snapshot_free(void)
+{
+	struct file *snap_file;
+	char *path;
+
+	if (snap_data == NULL)
+		return;
+	kvfree(snap_data);
+	snap_data = NULL;
+	memset(snap_devs, 0, sizeof(snap_devs));
+	path = snapshot_path();
+	if (path == NULL)
+		return;
+	snap_file = filp_open(path, O_WRONLY | O_TRUNC, 0);
+	if (!IS_ERR(snap_file))
+		filp_close(snap_file, NULL);
+	kfree(path);
+}
+
+/* Create minor with its /dev node. Called under devices_mutex. */
+static int sdev_add(int index, int dev_mode, unsigned int capacity, unsigned int flags)
+{
+	struct sbertask_dev *sdev;
+	char name[32];
+	int ret;
+
+	if (devices[index])
+		return -EEXIST;
+	sdev = kzalloc(sizeof(struct sbertask_dev), GFP_KERNEL);
+	if (sdev == NULL)
+		return -ENOMEM;
+	sdev->index = index;
+	sdev->mode = dev_mode;
+	sdev->capacity = capacity;
+	sdev->flags = flags;
+	sdev->pending_mode = -1;
+	spin_lock_init(&sdev->lock);
+	sdev->root = RB_ROOT;
+	mutex_init(&sdev->single_mutex);
+	/* Before anyone may open device */
+	snapshot_restore(sdev);
+	/* cdev has own lifetime, open racing with removal may still hold it */
+	sdev->cdev = cdev_alloc();
+	if (sdev->cdev == NULL){
+		ret = -ENOMEM;
+		goto free_sdev;
+	}
+	sdev->cdev->ops = &f_ops;
+	sdev->cdev->owner = THIS_MODULE;
+	ret = cdev_add(sdev->cdev, MKDEV(MAJOR(dev_base), index), 1);
+	if (ret){
+		kobject_put(&sdev->cdev->kobj);
+		goto free_sdev;
+	}
+	if (index)
+		snprintf(name, sizeof(name), "%s%d", DEVICE_NAME, index);
+	else
+		snprintf(name, sizeof(name), "%s", DEVICE_NAME);
+	sdev->device = device_create_with_groups(sbertask_class, NULL, MKDEV(MAJOR(dev_base), index), sdev,
+						 sbertask_groups, "%s", name);
+	if (IS_ERR(sdev->device)){
+		ret = PTR_ERR(sdev->device);
+		cdev_del(sdev->cdev);
+		goto free_sdev;
+	}
+	devices[index] = sdev;
+	pr_info("sbertask: device %s added, mode %s, capacity %u, flags 0x%x\n", name,
+		mode_names[dev_mode], capacity, flags);
+	return 0;
+
+free_sdev:
+	sdev_free_buffers(sdev);
+	kfree(sdev);
+	return ret;
+}
+
+/*
+ * Take minor which is not open out of devices, so it can't be opened any
+ * more. Called under devices_mutex. Returns device for sdev_destroy() or
+ * error pointer.
+ */
+static struct sbertask_dev *sdev_unlink(int index)
+{
+	struct sbertask_dev *sdev = devices[index];
+
+	if (sdev == NULL)
+		return ERR_PTR(-ENODEV);
+	if (sdev->users)
+		return ERR_PTR(-EBUSY);
+	devices[index] = NULL;
+	return sdev;
+}
+
+/*
+ * Free unlinked minor. Called without devices_mutex: device_destroy() waits
+ * for sysfs handlers of device, and they take the mutex.
+ */
+static void sdev_destroy(struct sbertask_dev *sdev)
+{
+	device_destroy(sbertask_class, MKDEV(MAJOR(dev_base), sdev->index));
+	cdev_del(sdev->cdev);
+	sdev_free_buffers(sdev);
+	pr_info("sbertask: device %d removed\n", sdev->index);
+	kfree(sdev);
+}
+
+/* Remove all minors, at unload or failed load */
+static void sdev_remove_all(void)
+{
+	struct sbertask_dev *gone[SBERTASK_DEV_MAX];
+	int i;
+
+	mutex_lock(&devices_mutex);
+	for (i = 0; i < SBERTASK_DEV_MAX; i++)
+		gone[i] = devices[i] ? sdev_unlink(i) : NULL;
+	mutex_unlock(&devices_mutex);
+	for (i = 0; i < SBERTASK_DEV_MAX; i++)
+		if (!IS_ERR_OR_NULL(gone[i]))
+			sdev_destroy(gone[i]);
+}
+
+/*
+ * /dev/sbertask-control, like loop-control: creates and removes numbered
+ * devices at runtime. Needs CAP_SYS_ADMIN.
+ */
+static long sbertask_ctl_ioctl(struct file *file_p, unsigned int cmd, unsigned long arg)
+{
+	struct sbertask_ctl_dev __user *argp = (void __user *)arg;
+	struct sbertask_dev *gone = NULL;
+	struct sbertask_ctl_dev ctl;
+	long ret;
+	int i;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (cmd != SBERTASK_CTL_ADD && cmd != SBERTASK_CTL_REMOVE)
+		return -ENOTTY;
+	if (copy_from_user(&ctl, argp, sizeof(ctl)))
+		return -EFAULT;
+	if (ctl.reserved[0] || ctl.reserved[1] || ctl.reserved[2] || ctl.index < -1 || ctl.index >= SBERTASK_DEV_MAX)
+		return -EINVAL;
+
+	mutex_lock(&devices_mutex);
+	switch (cmd){
+		case SBERTASK_CTL_ADD:
+			if (ctl.mode > MODE_MULTI || ctl.capacity > SBERTASK_CAPACITY_MAX ||
+			    !flags_valid(ctl.flags)){
+				ret = -EINVAL;
+				break;
+			}
+			if (ctl.capacity == 0)
+				ctl.capacity = BUFFER_DEPTH;
+			/* -1 - first free minor */
+			if (ctl.index < 0){
+				for (i = 1; i < SBERTASK_DEV_MAX && devices[i]; i++)
+					;
+				if (i == SBERTASK_DEV_MAX){
+					ret = -ENOSPC;
+					break;
+				}
+				ctl.index = i;
+			}
+			ret = sdev_add(ctl.index, ctl.mode, ctl.capacity, ctl.flags);
+			if (!ret)
+				ret = ctl.index;
+			break;
+		case SBERTASK_CTL_REMOVE:
+			/* /dev/sbertask lives as long as module */
+			if (ctl.index <= 0){
+				ret = -EINVAL;
+				break;
+			}
+			gone = sdev_unlink(ctl.index);
+			ret = PTR_ERR_OR_ZERO(gone);
+			break;
+		default:
+			ret = -ENOTTY;
+	}
+	mutex_unlock(&devices_mutex);
+	if (!IS_ERR_OR_NULL(gone))
+		sdev_destroy(gone);
+	return ret;
+}
+
+static const struct file_operations ctl_ops = {
+	.owner   = THIS_MODULE,
+	.unlocked_ioctl = sbertask_ctl_ioctl,
+	.compat_ioctl   = compat_ptr_ioctl,
+	.llseek  = noop_llseek,
+};
+
+static struct miscdevice ctl_device = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name  = DEVICE_NAME "-control",
+	.fops  = &ctl_ops,
+	.mode  = 0600,
+};
+
+static int mode_parse(const char *str)
+{
+	if 	(!strcmp(str, "default"))
+		return MODE_DEFAULT;
+	else if (!strcmp(str, "single"))
+		return MODE_SINGLE;
+	else if (!strcmp(str, "multi"))
+		return MODE_MULTI;
+	pr_err("sbertask: wrong mode setted. Only default/single/multi modes supported\n");
+	return -EINVAL;
+}
+
+static int __init module_start(void)
+{
+	int dev_modes[SBERTASK_DEV_MAX];
+	int nr_devs, i, ret;
+
+	/* Device 0 takes old mode parameter unless modes is given */
+	nr_devs = max3(1, nr_modes, max(nr_capacities, nr_chflags));
+	for (i = 0; i < nr_devs; i++){
+		dev_modes[i] = mode_parse(i < nr_modes ? modes[i] : (i ? "default" : mode));
+		if (dev_modes[i] < 0)
+			return -EINVAL;
+		if (i < nr_capacities && capacities[i] > SBERTASK_CAPACITY_MAX)
+			return -EINVAL;
+		if (i < nr_chflags && !flags_valid(chflags[i]))
+			return -EINVAL;
+	}
+
+	pr_info("sbertask: module runned in %s mode\n", mode_names[dev_modes[0]]);
+
+	/* Cache create. Element is 40 bytes, cache line alignment would pad it to 64 */
+	buffer_cache = kmem_cache_create("sbertask_buffer", sizeof(struct buffer_element), 0, 0, NULL);
+	if (buffer_cache == NULL){
+		pr_err("sbertask: can't create buffer cache\n");
+		return -ENOMEM;
+	}
+
+	/* Minors for /dev/sbertask and devices made by control device */
+	ret = alloc_chrdev_region(&dev_base, 0, SBERTASK_DEV_MAX, DEVICE_NAME);
+	if (ret){
+		pr_err("sbertask: can't register device %s\n", DEVICE_NAME);
+		goto destroy_cache;
+	}
+	pr_info("sbertask: assigned major number %d\n", MAJOR(dev_base));
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+	sbertask_class = class_create(DEVICE_NAME);
+#else
+	sbertask_class = class_create(THIS_MODULE, DEVICE_NAME);
+#endif
+	if (IS_ERR(sbertask_class)){
+		ret = PTR_ERR(sbertask_class);
+		goto unregister;
+	}
+	sbertask_class->devnode = sbertask_devnode;
+	snapshot_load();
+
+	/* Register /dev/sbertask and /dev/sbertaskN from parameters */
+	mutex_lock(&devices_mutex);
+	for (i = 0; i < nr_devs; i++){
+		ret = sdev_add(i, dev_modes[i], i < nr_capacities && capacities[i] ? capacities[i] : BUFFER_DEPTH,
+			       i < nr_chflags ? chflags[i] : 0);
+		if (ret)
+			break;
+	}
+	/* and ones made by control device before upgrade */
+	for (i = 0; i < SBERTASK_DEV_MAX && !ret; i++){
+		struct snap_dev *dev;
+
+		if (snap_devs[i] == 0 || devices[i])
+			continue;
+		dev = (struct snap_dev *)(snap_data + snap_devs[i]);
+		ret = sdev_add(i, dev->mode, dev->capacity, dev->flags);
+	}
+	mutex_unlock(&devices_mutex);
+	if (ret)
+		goto remove_dev;
+	ret = misc_register(&ctl_device);
+	if (ret){
+		pr_err("sbertask: can't register control device\n");
+		goto remove_dev;
+	}
+	/* Everything is up, restored queues are ours now */
+	snapshot_free();
+		
+	pr_info("sbertask: module successfully loaded\n");
+
+	return 0;
+
+remove_dev:
+	sdev_remove_all();
+	/* Snapshot file is kept for next try */
+	kvfree(snap_data);
+	snap_data = NULL;
+	memset(snap_devs, 0, sizeof(snap_devs));
+	class_destroy(sbertask_class);
+unregister:
+	unregister_chrdev_region(dev_base, SBERTASK_DEV_MAX);
+destroy_cache:
+	kmem_cache_destroy(buffer_cache);
+	return ret;
+};
+
+static void __exit module_stop(void)
+{
+	misc_deregister(&ctl_device);
+	/* All files are closed, module is not unloaded otherwise */
+	mutex_lock(&devices_mutex);
+	snapshot_save();
+	mutex_unlock(&devices_mutex);
+	sdev_remove_all();
+	class_destroy(sbertask_class);
+	unregister_chrdev_region(dev_base, SBERTASK_DEV_MAX);
 	kmem_cache_destroy(buffer_cache);
-	unregister_chrdev(major_number, DEVICE_NAME);
 	pr_info("sbertask: module unloaded\n");
 };
 
@@ -462,4 +4887,8 @@ MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Arsenii Akimov <arseniumfrela@bk.ru>");
 MODULE_DESCRIPTION("FIFO buffer driver. Runs 3 modes: default, single, multi");
 MODULE_PARM_DESC(mode_string, "Select  mode: default/single/multi");
+MODULE_PARM_DESC(modes, "Modes of devices made at load, /dev/sbertask first");
+MODULE_PARM_DESC(capacities, "Queue depth of devices made at load, 0 - 1000 bytes");
+MODULE_PARM_DESC(chflags, "SBERTASK_CH_* flags of new channels of devices made at load");
+MODULE_PARM_DESC(snapshot, "File keeping queued data over module upgrade, e.g. /dev/shm/sbertask.snap");
 
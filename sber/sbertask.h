@@ -0,0 +1,360 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later WITH Linux-syscall-note */
+/*
+ * 	sbertask.h: userspace interface of sbertask driver
+ *
+ *	Copyright (C) 2023 Arsenii Akimov <arseniumfrela@bk.ru>
+ *
+ *	https://www.github.com/arsaki/test_tasks
+ *
+ *	ioctl commands and structures shared by driver and applications.
+ *	All user pointers passed as __u64, so layout is the same for
+ *	32 and 64 bit processes.
+ *
+ */
+
+#ifndef _SBERTASK_H
+#define _SBERTASK_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define SBERTASK_IOC_MAGIC	'S'
+
+/* Max records in one batched call, same as UIO_MAXIOV */
+#define SBERTASK_MMSG_MAX	1024
+
+/* sbertask_mmsg flags */
+#define SBERTASK_MSG_DONTWAIT	0x1	/* don't sleep, like O_NONBLOCK */
+
+/* One record of batched send/receive */
+struct sbertask_msg {
+	__u64 buf;		/* user buffer */
+	__u32 len;		/* buffer length */
+	__u32 result;		/* out: bytes transferred */
+};
+
+/* Batch of records, like sendmmsg()/recvmmsg() */
+struct sbertask_mmsg {
+	__u64 msgs;		/* user array of struct sbertask_msg */
+	__u32 count;		/* records in array */
+	__u32 flags;		/* SBERTASK_MSG_* */
+	__u64 tstamps;		/* recv: optional user array of struct sbertask_tstamp */
+};
+
+/* Record times, CLOCK_MONOTONIC nanoseconds. Zero if channel has no SBERTASK_CH_TSTAMP */
+struct sbertask_tstamp {
+	__s64 enqueue_ns;	/* when record was written */
+	__s64 dequeue_ns;	/* when record was read */
+};
+
+/* Channel flags */
+#define SBERTASK_CH_PACKET	0x1	/* write is one record, read returns one record */
+#define SBERTASK_CH_DELIM	0x2	/* read returns one line ended by delimiter */
+#define SBERTASK_CH_TSTAMP	0x4	/* stamp records at enqueue and dequeue */
+#define SBERTASK_CH_LOWLAT	0x8	/* spin before sleep, sync wakeups */
+#define SBERTASK_CH_DISPATCH	0x10	/* wake one reader per chunk of data */
+#define SBERTASK_CH_BROADCAST	0x20	/* every reader gets all data, has own cursor */
+#define SBERTASK_CH_DROPSLOW	0x40	/* broadcast: skip data of lagging reader, don't block writer */
+#define SBERTASK_CH_LOG		0x80	/* keep last retain_bytes / retain_ms, readers seek and replay */
+#define SBERTASK_CH_ACK		0x100	/* read leases data, it is freed by SBERTASK_IOC_ACK */
+#define SBERTASK_CH_GROUP	0x200	/* readers share key partitions of records */
+#define SBERTASK_CH_DROPNEW	0x400	/* full queue: drop written record, don't block writer */
+#define SBERTASK_CH_OVERWRITE	0x800	/* full queue: drop oldest records, don't block writer */
+#define SBERTASK_CH_CODEL	0x1000	/* drop head records while queue delay stays over target */
+#define SBERTASK_CH_ECN		0x2000	/* codel: mark head records instead of dropping */
+#define SBERTASK_CH_MASK	(SBERTASK_CH_PACKET | SBERTASK_CH_DELIM | SBERTASK_CH_TSTAMP | \
+				 SBERTASK_CH_LOWLAT | SBERTASK_CH_DISPATCH | SBERTASK_CH_BROADCAST | \
+				 SBERTASK_CH_DROPSLOW | SBERTASK_CH_LOG | SBERTASK_CH_ACK | SBERTASK_CH_GROUP | \
+				 SBERTASK_CH_DROPNEW | SBERTASK_CH_OVERWRITE | SBERTASK_CH_CODEL | SBERTASK_CH_ECN)
+
+/* Consumer group limits */
+#define SBERTASK_KEY_MAX	32	/* key bytes at record start */
+#define SBERTASK_PART_MAX	64	/* key hash partitions */
+
+/* Per channel configuration. Read it with GET_CONFIG, change and SET_CONFIG back */
+struct sbertask_config {
+	__u32 flags;		/* SBERTASK_CH_* */
+	__u32 max_record;	/* max record length in packet mode, 0 - queue depth */
+	__u32 delimiter;	/* line delimiter byte, '\n' by default */
+	__u32 spin_us;		/* max spin before sleep in low latency mode, 0 - default */
+	__u32 chunk;		/* max bytes taken by one reader in dispatch mode, 0 - queue depth */
+	__u32 lag_limit;	/* broadcast: max bytes reader may lag behind, 0 - queue depth */
+	__u32 retain_bytes;	/* log: bytes kept, oldest records are dropped, 0 - queue depth */
+	__u32 retain_ms;	/* log: records older than this are dropped, 0 - no limit */
+	__u32 lease_ms;		/* ack: unacknowledged lease returns to queue after it, 0 - on close only */
+	__u32 key_bytes;	/* group: record starts with key of so many bytes, 0 - 8 */
+	__u32 partitions;	/* group: key hash partitions, 0 - 16 */
+	__u32 codel_target_us;	/* codel: acceptable queue delay, 0 - 5 ms */
+	__u32 codel_interval_us;	/* codel: how long delay may stay over target, 0 - 100 ms */
+	__u32 ttl_ms;		/* records expire so long after write, 0 - never. Not for broadcast and log */
+	__u32 reserved[2];	/* must be zero */
+};
+
+/* Channel counters */
+struct sbertask_stats {
+	__u64 rx_spins;		/* reader spins in low latency mode */
+	__u64 rx_spin_hits;	/* ... which ended without sleep */
+	__u64 tx_spins;		/* writer spins */
+	__u64 tx_spin_hits;
+	__u64 lag_drops;	/* bytes skipped by lagging readers in broadcast mode */
+	__u64 lease_timeouts;	/* leases returned to queue by lease_ms timeout */
+	__u64 rebalances;	/* group partitions redistributed on reader join or leave */
+	__u64 filter_drops;	/* records dropped by BPF filter */
+	__u64 filter_redirects;	/* records sent to other channel by BPF filter */
+	__u64 overflow_drops;	/* records dropped by SBERTASK_CH_DROPNEW */
+	__u64 overwrites;	/* queued records dropped by SBERTASK_CH_OVERWRITE */
+	__u64 codel_drops;	/* head records dropped by SBERTASK_CH_CODEL */
+	__u64 codel_marks;	/* head records marked with SBERTASK_CH_ECN */
+	__u64 ttl_expired;	/* records whose time to live passed before they were read */
+	__u64 dead_letters;	/* ... which went to dead letter channel */
+	__u64 reserved[1];
+};
+
+/*
+ * Record sequence numbers, they wrap at 2^32. Each written record takes next
+ * one, dropped records too, so sole reader sees loss as gap between last of
+ * one read and first of next read.
+ */
+struct sbertask_seq {
+	__u32 first;		/* record of first byte of last read */
+	__u32 last;		/* record of last byte of last read */
+	__u32 next;		/* number next written record gets */
+	__u32 marks;		/* records of last read marked by SBERTASK_CH_ECN */
+};
+
+/* Time to live of records written by this file, overrides ttl_ms of channel */
+struct sbertask_ttl {
+	__u32 ttl_ms;		/* 0 - channel's one */
+	__u32 reserved;		/* must be zero */
+};
+
+/* sbertask_deadletter flags */
+#define SBERTASK_DEADLETTER_ON	0x1	/* 0 - expired records are dropped */
+
+/* Where expired records of channel go */
+struct sbertask_deadletter {
+	__u64 channel;		/* key of dead letter channel, it is made if there is none */
+	__u32 flags;		/* SBERTASK_DEADLETTER_* */
+	__u32 reserved;		/* must be zero */
+};
+
+/* Per file read policy, like VMIN/VTIME of terminal */
+struct sbertask_rxpolicy {
+	__u32 min_bytes;	/* wake reader when queue holds so many bytes, 0 - any byte */
+	__u32 max_delay_us;	/* or when first unread byte waits so long, 0 - no limit */
+};
+
+/* eventfd events, edge triggered */
+#define SBERTASK_EV_DATA	0x1	/* queue became not empty */
+#define SBERTASK_EV_SPACE	0x2	/* free space rose to space_threshold */
+
+struct sbertask_eventfd {
+	__s32 fd;		/* eventfd, -1 - unregister */
+	__u32 events;		/* SBERTASK_EV_* */
+	__u32 space_threshold;	/* bytes, 0 - queue depth */
+	__u32 reserved;		/* must be zero */
+};
+
+/* Max channels in one gather call */
+#define SBERTASK_GATHER_MAX	64
+
+/* One channel of gather read. Channel is buffer key: pid in multi mode, 0 otherwise, or SBERTASK_CHAN_KEYED one */
+struct sbertask_gather_chan {
+	__u64 channel;
+	__u64 buf;		/* user buffer for data of this channel */
+	__u32 len;		/* buffer length */
+	__u32 result;		/* out: bytes read from channel */
+};
+
+/* Wait until any channel has data, then read all ready channels */
+struct sbertask_gather {
+	__u64 chans;		/* user array of struct sbertask_gather_chan */
+	__u32 count;		/* channels in array */
+	__u32 flags;		/* SBERTASK_MSG_DONTWAIT */
+};
+
+/* Max channels in one merge call */
+#define SBERTASK_MERGE_MAX	64
+
+/*
+ * Merge read: records of channels in global enqueue time order.
+ * Channels must have SBERTASK_CH_TSTAMP.
+ */
+struct sbertask_merge {
+	__u64 channels;		/* user array of __u64 channel keys */
+	__u32 count;		/* channels in array */
+	__u32 flags;		/* SBERTASK_MSG_DONTWAIT */
+	__u64 msgs;		/* user array of struct sbertask_msg, one record per slot */
+	__u32 msg_count;	/* slots in array */
+	__u32 lag_us;		/* empty channel is waited for until idle so long */
+	__u64 sources;		/* optional user array of __u64: channel of each record */
+	__u64 tstamps;		/* optional user array of struct sbertask_tstamp */
+};
+
+/* seek flags */
+#define SBERTASK_SEEK_TSTAMP	0x1	/* seek to first record written at or after tstamp_ns */
+#define SBERTASK_SEEK_QUERY	0x2	/* don't move, just report offsets */
+
+/*
+ * Cursor of file in log or broadcast channel. Offsets count bytes ever
+ * written to channel, they never go back. lseek() works with offsets too.
+ */
+struct sbertask_seek {
+	__u64 offset;		/* in: target offset; out: new cursor offset */
+	__s64 tstamp_ns;	/* CLOCK_MONOTONIC, with SBERTASK_SEEK_TSTAMP */
+	__u32 flags;		/* SBERTASK_SEEK_* */
+	__u32 reserved;		/* must be zero */
+	__u64 head;		/* out: offset of oldest kept byte */
+	__u64 tail;		/* out: offset of next written byte */
+};
+
+/* ack flags */
+#define SBERTASK_ACK_UPTO	0x1	/* also older leases of this file */
+#define SBERTASK_ACK_RETURN	0x2	/* don't commit, return data to queue head for redelivery */
+
+/*
+ * Each read() or RECVMMSG record of SBERTASK_CH_ACK channel is a lease,
+ * leases of file are numbered from 1 in read order. Lease is freed by ack
+ * and returned to queue head if file is closed or lease_ms passes.
+ */
+struct sbertask_ack {
+	__u64 lease;		/* lease number, 0 - last one */
+	__u32 flags;		/* SBERTASK_ACK_* */
+	__u32 reserved;		/* must be zero */
+};
+
+/*
+ * Group reader of SBERTASK_CH_GROUP channel. Records with the same key
+ * go to the same partition, partitions are dealt to readers round robin
+ * in join order and dealt again when reader joins or leaves.
+ */
+struct sbertask_group {
+	__u64 parts;		/* bit mask of partitions of this file */
+	__u32 members;		/* readers in group */
+	__u32 partitions;
+};
+
+/* Max redirect targets of BPF filter */
+#define SBERTASK_REDIRECT_MAX	16
+
+/*
+ * Return values of BPF filter. Program is BPF_PROG_TYPE_SOCKET_FILTER,
+ * it runs on every written record given as packet data. Like socket filter
+ * any non zero value which is not valid redirect passes the record.
+ */
+#define SBERTASK_BPF_DROP		0
+#define SBERTASK_BPF_PASS		1
+#define SBERTASK_BPF_REDIRECT(i)	(0x80000000u | (i))	/* to channel targets[i] */
+
+struct sbertask_filter {
+	__s32 fd;		/* BPF program fd, -1 - detach */
+	__u32 count;		/* redirect targets */
+	__u64 targets;		/* user array of __u64 channel keys */
+};
+
+/*
+ * Channel keys. Channel of driver mode has key 0, or pid of process in
+ * multi mode. Channels attached by key or name have SBERTASK_CHAN_KEYED
+ * bit, so they never meet mode channels.
+ */
+#define SBERTASK_CHAN_KEYED	(1ULL << 63)
+#define SBERTASK_CHAN_NAMED	(1ULL << 62)	/* key is hash of name */
+#define SBERTASK_CHAN_KEY_MASK	(SBERTASK_CHAN_NAMED - 1)
+#define SBERTASK_NAME_MAX	16
+
+/* attach flags */
+#define SBERTASK_ATTACH_NAME	0x1	/* attach by name, not key */
+#define SBERTASK_ATTACH_FD	0x2	/* return new fd bound to channel, this file stays as is */
+#define SBERTASK_ATTACH_CLOEXEC	0x4	/* new fd is close-on-exec */
+#define SBERTASK_ATTACH_RDONLY	0x8	/* new fd is read only, O_RDWR without access flag */
+#define SBERTASK_ATTACH_WRONLY	0x10	/* new fd is write only, it never holds broadcast data */
+
+/*
+ * Attach file to channel, channel is created on first attach and lives
+ * until its device is removed. Any process may attach the same key or name.
+ */
+struct sbertask_attach {
+	__u64 key;		/* 0 .. SBERTASK_CHAN_KEY_MASK */
+	char name[SBERTASK_NAME_MAX];	/* with SBERTASK_ATTACH_NAME, zero padded */
+	__u32 flags;		/* SBERTASK_ATTACH_* */
+	__u32 reserved;		/* must be zero */
+	__u64 channel;		/* out: channel key for gather, merge and filter targets */
+};
+
+/* Multi mode mailbox send: one record to channel of process pid */
+struct sbertask_sendto {
+	__u64 buf;		/* user buffer */
+	__u32 len;		/* record length */
+	__u32 flags;		/* SBERTASK_MSG_DONTWAIT */
+	__s32 pid;		/* receiver, as seen in caller's pid namespace */
+	__u32 reserved;		/* must be zero */
+};
+
+/* Max channels in one multicast write */
+#define SBERTASK_MCAST_MAX	64
+
+/* One record written to several channels */
+struct sbertask_mcast {
+	__u64 buf;		/* user buffer */
+	__u32 len;		/* record length */
+	__u32 count;		/* channels in array */
+	__u64 channels;		/* user array of __u64 channel keys */
+	__u64 results;		/* optional user array of __s32: bytes queued or -errno */
+	__u32 flags;		/* must be zero */
+	__u32 reserved;		/* must be zero */
+};
+
+/* Device modes, see README */
+#define SBERTASK_MODE_DEFAULT	0	/* one channel, multiple access */
+#define SBERTASK_MODE_SINGLE	1	/* one channel, single access */
+#define SBERTASK_MODE_MULTI	2	/* channel per process */
+
+/* Minors: /dev/sbertask is 0, devices made by control device are /dev/sbertaskN */
+#define SBERTASK_DEV_MAX	64
+#define SBERTASK_CAPACITY_MAX	65536	/* max queue depth, bytes */
+
+/* Device of /dev/sbertask-control */
+struct sbertask_ctl_dev {
+	__s32 index;		/* minor, -1 - first free one */
+	__u32 mode;		/* SBERTASK_MODE_* */
+	__u32 capacity;		/* queue depth of channels, 0 - 1000 bytes */
+	__u32 flags;		/* SBERTASK_CH_* of new channels */
+	__u32 reserved[3];	/* must be zero */
+};
+
+/* Both return number of processed records */
+#define SBERTASK_IOC_SENDMMSG	_IOW(SBERTASK_IOC_MAGIC, 1, struct sbertask_mmsg)
+#define SBERTASK_IOC_RECVMMSG	_IOW(SBERTASK_IOC_MAGIC, 2, struct sbertask_mmsg)
+#define SBERTASK_IOC_GET_CONFIG	_IOR(SBERTASK_IOC_MAGIC, 3, struct sbertask_config)
+#define SBERTASK_IOC_SET_CONFIG	_IOW(SBERTASK_IOC_MAGIC, 4, struct sbertask_config)
+/* Times of first byte given by last read() or recv on this file */
+#define SBERTASK_IOC_GET_TSTAMP	_IOR(SBERTASK_IOC_MAGIC, 5, struct sbertask_tstamp)
+#define SBERTASK_IOC_GET_RXPOLICY	_IOR(SBERTASK_IOC_MAGIC, 6, struct sbertask_rxpolicy)
+#define SBERTASK_IOC_SET_RXPOLICY	_IOW(SBERTASK_IOC_MAGIC, 7, struct sbertask_rxpolicy)
+#define SBERTASK_IOC_GET_STATS	_IOR(SBERTASK_IOC_MAGIC, 8, struct sbertask_stats)
+#define SBERTASK_IOC_SET_EVENTFD	_IOW(SBERTASK_IOC_MAGIC, 9, struct sbertask_eventfd)
+/* Returns number of channels data was read from */
+#define SBERTASK_IOC_GATHER	_IOW(SBERTASK_IOC_MAGIC, 10, struct sbertask_gather)
+/* Returns number of merged records */
+#define SBERTASK_IOC_MERGE	_IOW(SBERTASK_IOC_MAGIC, 11, struct sbertask_merge)
+#define SBERTASK_IOC_SEEK	_IOWR(SBERTASK_IOC_MAGIC, 12, struct sbertask_seek)
+/* Returns number of acknowledged leases */
+#define SBERTASK_IOC_ACK	_IOW(SBERTASK_IOC_MAGIC, 13, struct sbertask_ack)
+#define SBERTASK_IOC_GET_GROUP	_IOR(SBERTASK_IOC_MAGIC, 14, struct sbertask_group)
+#define SBERTASK_IOC_SET_FILTER	_IOW(SBERTASK_IOC_MAGIC, 15, struct sbertask_filter)
+/* Returns new fd with SBERTASK_ATTACH_FD, 0 otherwise */
+#define SBERTASK_IOC_ATTACH	_IOWR(SBERTASK_IOC_MAGIC, 16, struct sbertask_attach)
+/* Returns number of queued bytes */
+#define SBERTASK_IOC_SENDTO	_IOW(SBERTASK_IOC_MAGIC, 17, struct sbertask_sendto)
+/* Returns number of channels record was queued to */
+#define SBERTASK_IOC_MCAST	_IOW(SBERTASK_IOC_MAGIC, 18, struct sbertask_mcast)
+/* Sequence numbers of records given by last read() or recv on this file */
+#define SBERTASK_IOC_GET_SEQ	_IOR(SBERTASK_IOC_MAGIC, 19, struct sbertask_seq)
+#define SBERTASK_IOC_SET_TTL	_IOW(SBERTASK_IOC_MAGIC, 20, struct sbertask_ttl)
+#define SBERTASK_IOC_SET_DEADLETTER	_IOW(SBERTASK_IOC_MAGIC, 21, struct sbertask_deadletter)
+
+/* Control device ioctls. Add returns minor of new device */
+#define SBERTASK_CTL_ADD	_IOW(SBERTASK_IOC_MAGIC, 64, struct sbertask_ctl_dev)
+#define SBERTASK_CTL_REMOVE	_IOW(SBERTASK_IOC_MAGIC, 65, struct sbertask_ctl_dev)
+
+#endif /* _SBERTASK_H */
@@ -0,0 +1,90 @@
+/*
+ * sendto.c: SBERTASK_IOC_SENDTO example. Parent sends record to mailbox of
+ * child process, only child may read it.
+ * Run after "sudo ./start_multi.sh": ./sendto [/dev/sbertask]
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include "sbertask.h"
+
+int main(int argc, char **argv)
+{
+	const char *dev = argc > 1 ? argv[1] : "/dev/sbertask";
+	struct sbertask_gather_chan chan;
+	struct sbertask_gather gather;
+	struct sbertask_sendto msg;
+	int fd, ready[2], sent[2], status, res, ret = 1;
+	char buf[100], byte = 0;
+	pid_t pid;
+
+	fd = open(dev, O_RDWR | O_NONBLOCK);
+	if (fd < 0){
+		perror(dev);
+		return 1;
+	}
+	if (pipe(ready) || pipe(sent)){
+		perror("pipe");
+		return 1;
+	}
+	pid = fork();
+	if (pid == 0){
+		/* Child's open makes its channel */
+		int child_fd = open(dev, O_RDWR | O_NONBLOCK);
+
+		while (child_fd >= 0 && read(child_fd, buf, sizeof(buf)) > 0)
+			;
+		write(ready[1], &byte, 1);
+		read(sent[0], &byte, 1);
+		res = child_fd >= 0 ? read(child_fd, buf, sizeof(buf)) : -1;
+		_exit(res == 4 && !memcmp(buf, "mail", 4) ? 0 : 1);
+	}
+	read(ready[0], &byte, 1);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.buf = (uintptr_t)"mail";
+	msg.len = 4;
+	msg.flags = SBERTASK_MSG_DONTWAIT;
+	msg.pid = pid;
+	res = ioctl(fd, SBERTASK_IOC_SENDTO, &msg);
+	if (res != 4){
+		printf("sendto: FAIL returned %d, expected 4\n", res);
+		goto wait;
+	}
+	/* Mailbox is read by its owner only */
+	memset(&chan, 0, sizeof(chan));
+	chan.channel = pid;
+	chan.buf = (uintptr_t)buf;
+	chan.len = sizeof(buf);
+	memset(&gather, 0, sizeof(gather));
+	gather.chans = (uintptr_t)&chan;
+	gather.count = 1;
+	gather.flags = SBERTASK_MSG_DONTWAIT;
+	if (ioctl(fd, SBERTASK_IOC_GATHER, &gather) != -1 || errno != EPERM){
+		printf("sendto: FAIL other process gathered mailbox\n");
+		goto wait;
+	}
+	/* init never opened device, it has no mailbox */
+	msg.pid = 1;
+	if (ioctl(fd, SBERTASK_IOC_SENDTO, &msg) != -1 || errno != ESRCH){
+		printf("sendto: FAIL send to process without channel didn't fail with ESRCH\n");
+		goto wait;
+	}
+	ret = 0;
+wait:
+	write(sent[1], &byte, 1);
+	waitpid(pid, &status, 0);
+	if (!ret && (!WIFEXITED(status) || WEXITSTATUS(status))){
+		printf("sendto: FAIL child didn't get the record\n");
+		ret = 1;
+	}
+	if (!ret)
+		printf("sendto: OK\n");
+	close(fd);
+	return ret;
+}
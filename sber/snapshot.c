@@ -0,0 +1,103 @@
+/*
+ * snapshot.c: upgrade without losing queued data. "save" queues records and
+ * sets snapshot parameter, module is reloaded by hand, "check" finds records
+ * and channel config back.
+ * Run as root after "sudo ./start.sh":
+ *	sudo ./snapshot save
+ *	sudo rmmod sbertask && sudo insmod sbertask.ko snapshot=/dev/shm/sbertask.snap
+ *	sudo ./snapshot check
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include "sbertask.h"
+
+#define DEV "/dev/sbertask"
+#define PARAM "/sys/module/sbertask/parameters/snapshot"
+#define SNAPSHOT "/dev/shm/sbertask.snap"
+#define NR_RECS 3
+#define FLAGS (SBERTASK_CH_PACKET | SBERTASK_CH_TSTAMP)
+
+static const char *recs[NR_RECS] = { "first", "second", "third" };
+
+static int save(int fd)
+{
+	struct sbertask_config config;
+	char buf[100];
+	FILE *f;
+	int i;
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+	if (ioctl(fd, SBERTASK_IOC_GET_CONFIG, &config)){
+		perror("SBERTASK_IOC_GET_CONFIG");
+		return 1;
+	}
+	config.flags = FLAGS;
+	if (ioctl(fd, SBERTASK_IOC_SET_CONFIG, &config)){
+		perror("SBERTASK_IOC_SET_CONFIG");
+		return 1;
+	}
+	for (i = 0; i < NR_RECS; i++)
+		write(fd, recs[i], strlen(recs[i]));
+	f = fopen(PARAM, "w");
+	if (f == NULL || fputs(SNAPSHOT, f) < 0 || fclose(f)){
+		perror(PARAM);
+		return 1;
+	}
+	printf("snapshot: %d records queued, now reload module with snapshot=%s and run check\n",
+	       NR_RECS, SNAPSHOT);
+	return 0;
+}
+
+static int check(int fd)
+{
+	struct sbertask_config config;
+	struct sbertask_tstamp ts;
+	char buf[100];
+	int i, res, ret = 1;
+
+	if (ioctl(fd, SBERTASK_IOC_GET_CONFIG, &config) || config.flags != FLAGS){
+		printf("snapshot: FAIL channel config was not restored\n");
+		return 1;
+	}
+	for (i = 0; i < NR_RECS; i++){
+		res = read(fd, buf, sizeof(buf));
+		if (res != (int)strlen(recs[i]) || memcmp(buf, recs[i], res)){
+			printf("snapshot: FAIL record %d is \"%.*s\", expected \"%s\"\n",
+			       i, res > 0 ? res : 0, buf, recs[i]);
+			goto restore;
+		}
+		/* Stamped by old module */
+		if (ioctl(fd, SBERTASK_IOC_GET_TSTAMP, &ts) || ts.enqueue_ns == 0 || ts.enqueue_ns > ts.dequeue_ns){
+			printf("snapshot: FAIL record %d lost its timestamp\n", i);
+			goto restore;
+		}
+	}
+	printf("snapshot: OK\n");
+	ret = 0;
+restore:
+	config.flags = 0;
+	ioctl(fd, SBERTASK_IOC_SET_CONFIG, &config);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	int fd, ret;
+
+	if (argc < 2 || (strcmp(argv[1], "save") && strcmp(argv[1], "check"))){
+		fprintf(stderr, "usage: %s save|check\n", argv[0]);
+		return 2;
+	}
+	fd = open(DEV, O_RDWR | O_NONBLOCK);
+	if (fd < 0){
+		perror(DEV);
+		return 1;
+	}
+	ret = strcmp(argv[1], "save") ? check(fd) : save(fd);
+	close(fd);
+	return ret;
+}
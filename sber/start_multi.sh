@@ -29,7 +29,8 @@ else
 fi
 
 echo -n "Creating char device /dev/sbertask..... "
-mknod -m=666 /dev/sbertask c $MAJOR_NUM 0
+# Node is made by devtmpfs, mknod is for systems without it
+[ -c /dev/sbertask ] || mknod -m=666 /dev/sbertask c $MAJOR_NUM 0
 if [ -c /dev/sbertask ]
 then
 	echo "Successful."
@@ -0,0 +1,184 @@
+/*
+ * sysfs.c: live tuning example. Attributes of device are written while it
+ * is open: idle channel takes them at once, busy one when it drains, mode
+ * when device is closed. Works on own device made by control device.
+ * Run as root after "sudo ./start.sh": sudo ./sysfs
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include "sbertask.h"
+
+#define CONTROL "/dev/sbertask-control"
+
+static int dev_index;
+
+static int attr_path(const char *attr, char *path, size_t len)
+{
+	return snprintf(path, len, "/sys/class/sbertask/sbertask%d/%s", dev_index, attr);
+}
+
+static int write_attr(const char *attr, const char *value)
+{
+	char path[100];
+	FILE *f;
+	int ret;
+
+	attr_path(attr, path, sizeof(path));
+	f = fopen(path, "w");
+	if (f == NULL)
+		return -1;
+	ret = fputs(value, f) < 0;
+	return fclose(f) || ret ? -1 : 0;
+}
+
+static int read_attr(const char *attr, char *buf, size_t len)
+{
+	char path[100];
+	FILE *f;
+
+	attr_path(attr, path, sizeof(path));
+	f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+	if (fgets(buf, len, f) == NULL)
+		buf[0] = 0;
+	buf[strcspn(buf, "\n")] = 0;
+	fclose(f);
+	return 0;
+}
+
+/* Bytes nonblocking writes queue until channel is full, queue is drained after */
+static int fill(int fd)
+{
+	char buf[1000];
+	int res, total = 0;
+
+	memset(buf, 'x', sizeof(buf));
+	while ((res = write(fd, buf, sizeof(buf))) > 0)
+		total += res;
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+	return total;
+}
+
+static __u32 channel_flags(int fd)
+{
+	struct sbertask_config config;
+
+	if (ioctl(fd, SBERTASK_IOC_GET_CONFIG, &config))
+		return ~0u;
+	return config.flags;
+}
+
+static int check(const char *dev, int fd)
+{
+	struct sbertask_rxpolicy policy;
+	char attr[32], buf[100];
+	int status;
+	pid_t pid;
+
+	/* Idle channel takes new capacity at once */
+	if (write_attr("capacity", "3000") || fill(fd) != 3000){
+		printf("sysfs: FAIL idle channel didn't take capacity 3000\n");
+		return 1;
+	}
+	/* Busy channel takes flags when it drains */
+	write(fd, "busy", 4);
+	if (write_attr("flags", "0x1") || channel_flags(fd) != 0){
+		printf("sysfs: FAIL busy channel took flags before drain\n");
+		return 1;
+	}
+	read(fd, buf, sizeof(buf));
+	if (channel_flags(fd) != SBERTASK_CH_PACKET){
+		printf("sysfs: FAIL drained channel has flags 0x%x, expected 0x1\n", channel_flags(fd));
+		return 1;
+	}
+	/* Read policy of files which didn't set own one */
+	if (write_attr("wake_min", "8") || write_attr("wake_delay_us", "500") ||
+	    ioctl(fd, SBERTASK_IOC_GET_RXPOLICY, &policy) || policy.min_bytes != 8 || policy.max_delay_us != 500){
+		printf("sysfs: FAIL file didn't get wake_min 8 and wake_delay_us 500\n");
+		return 1;
+	}
+	write_attr("wake_min", "0");
+	write_attr("wake_delay_us", "0");
+	/* Mode waits for device to be closed, new file still shares channel */
+	if (write_attr("mode", "multi") || read_attr("mode", attr, sizeof(attr)) || strcmp(attr, "multi")){
+		printf("sysfs: FAIL mode is \"%s\", expected \"multi\"\n", attr);
+		return 1;
+	}
+	write(fd, "mine", 4);
+	pid = fork();
+	if (pid == 0){
+		int child_fd = open(dev, O_RDWR | O_NONBLOCK);
+
+		_exit(child_fd >= 0 && read(child_fd, buf, sizeof(buf)) == 4 ? 0 : 1);
+	}
+	waitpid(pid, &status, 0);
+	if (!WIFEXITED(status) || WEXITSTATUS(status)){
+		printf("sysfs: FAIL open device changed mode at once\n");
+		return 1;
+	}
+	return 0;
+}
+
+int main(void)
+{
+	struct sbertask_ctl_dev ctl;
+	char dev[32], buf[100];
+	int cfd, fd, i, res, status, ret = 1;
+	pid_t pid;
+
+	cfd = open(CONTROL, O_RDWR);
+	if (cfd < 0){
+		perror(CONTROL);
+		return 1;
+	}
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.index = -1;
+	ctl.mode = SBERTASK_MODE_DEFAULT;
+	dev_index = ioctl(cfd, SBERTASK_CTL_ADD, &ctl);
+	if (dev_index <= 0){
+		perror("SBERTASK_CTL_ADD");
+		return 1;
+	}
+	snprintf(dev, sizeof(dev), "/dev/sbertask%d", dev_index);
+	for (i = 0; i < 100 && (fd = open(dev, O_RDWR | O_NONBLOCK)) < 0 && errno == ENOENT; i++)
+		usleep(10000);
+	if (fd < 0){
+		perror(dev);
+		goto remove;
+	}
+	res = check(dev, fd);
+	close(fd);
+	if (res)
+		goto remove;
+
+	/* Closed device is in multi mode now: child has own channel */
+	fd = open(dev, O_RDWR | O_NONBLOCK);
+	write(fd, "parent", 6);
+	pid = fork();
+	if (pid == 0){
+		int child_fd = open(dev, O_RDWR | O_NONBLOCK);
+
+		_exit(child_fd >= 0 && read(child_fd, buf, sizeof(buf)) == -1 && errno == EAGAIN ? 0 : 1);
+	}
+	waitpid(pid, &status, 0);
+	close(fd);
+	if (!WIFEXITED(status) || WEXITSTATUS(status)){
+		printf("sysfs: FAIL reopened device isn't in multi mode\n");
+		goto remove;
+	}
+	printf("sysfs: OK\n");
+	ret = 0;
+remove:
+	ctl.index = dev_index;
+	ioctl(cfd, SBERTASK_CTL_REMOVE, &ctl);
+	close(cfd);
+	return ret;
+}
@@ -0,0 +1,72 @@
+/*
+ * tstamp.c: record timestamps example. Record waits 10 ms in queue, its
+ * enqueue and dequeue times must show it.
+ * Run after "sudo ./start.sh": ./tstamp [/dev/sbertask]
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include "sbertask.h"
+
+#define WAIT_NS 10000000LL
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+	const char *dev = argc > 1 ? argv[1] : "/dev/sbertask";
+	struct sbertask_config old, config;
+	struct sbertask_tstamp ts;
+	int64_t before, after;
+	char buf[100];
+	int fd, ret = 1;
+
+	fd = open(dev, O_RDWR | O_NONBLOCK);
+	if (fd < 0){
+		perror(dev);
+		return 1;
+	}
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+	if (ioctl(fd, SBERTASK_IOC_GET_CONFIG, &old)){
+		perror("SBERTASK_IOC_GET_CONFIG");
+		return 1;
+	}
+	config = old;
+	config.flags = SBERTASK_CH_PACKET | SBERTASK_CH_TSTAMP;
+	if (ioctl(fd, SBERTASK_IOC_SET_CONFIG, &config)){
+		perror("SBERTASK_IOC_SET_CONFIG");
+		return 1;
+	}
+
+	before = now_ns();
+	write(fd, "tick", 4);
+	usleep(WAIT_NS / 1000);
+	read(fd, buf, sizeof(buf));
+	after = now_ns();
+	if (ioctl(fd, SBERTASK_IOC_GET_TSTAMP, &ts)){
+		perror("SBERTASK_IOC_GET_TSTAMP");
+		goto restore;
+	}
+	if (ts.enqueue_ns < before || ts.dequeue_ns > after || ts.dequeue_ns - ts.enqueue_ns < WAIT_NS){
+		printf("tstamp: FAIL enqueue %lld dequeue %lld, written at %lld, read by %lld\n",
+		       (long long)ts.enqueue_ns, (long long)ts.dequeue_ns, (long long)before, (long long)after);
+		goto restore;
+	}
+	printf("tstamp: OK, record waited %lld us\n", (long long)(ts.dequeue_ns - ts.enqueue_ns) / 1000);
+	ret = 0;
+restore:
+	ioctl(fd, SBERTASK_IOC_SET_CONFIG, &old);
+	close(fd);
+	return ret;
+}
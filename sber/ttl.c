@@ -0,0 +1,119 @@
+/*
+ * ttl.c: time to live example. Expired record is skipped by reader, own ttl
+ * of file keeps other one alive, dead letter channel gets expired records.
+ * Run after "sudo ./start.sh": ./ttl [/dev/sbertask]
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include "sbertask.h"
+
+#define TTL_MS 20
+#define DEAD_KEY 5000
+
+static int set_ttl(int fd, __u32 ttl_ms)
+{
+	struct sbertask_ttl ttl;
+
+	memset(&ttl, 0, sizeof(ttl));
+	ttl.ttl_ms = ttl_ms;
+	return ioctl(fd, SBERTASK_IOC_SET_TTL, &ttl);
+}
+
+int main(int argc, char **argv)
+{
+	const char *dev = argc > 1 ? argv[1] : "/dev/sbertask";
+	struct sbertask_config old, config;
+	struct sbertask_stats before, after;
+	struct sbertask_deadletter dl;
+	struct sbertask_attach attach;
+	int fd, dfd = -1, res, ret = 1;
+	char buf[1000];
+
+	fd = open(dev, O_RDWR | O_NONBLOCK);
+	if (fd < 0){
+		perror(dev);
+		return 1;
+	}
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+	if (ioctl(fd, SBERTASK_IOC_GET_CONFIG, &old)){
+		perror("SBERTASK_IOC_GET_CONFIG");
+		return 1;
+	}
+	config = old;
+	config.flags = SBERTASK_CH_PACKET;
+	config.ttl_ms = TTL_MS;
+	if (ioctl(fd, SBERTASK_IOC_SET_CONFIG, &config)){
+		perror("SBERTASK_IOC_SET_CONFIG");
+		return 1;
+	}
+	ioctl(fd, SBERTASK_IOC_GET_STATS, &before);
+
+	/* "old" lives ttl_ms of channel, "new" lives ttl of file */
+	write(fd, "old", 3);
+	if (set_ttl(fd, 100 * TTL_MS)){
+		perror("SBERTASK_IOC_SET_TTL");
+		goto restore;
+	}
+	write(fd, "new", 3);
+	set_ttl(fd, 0);
+	usleep(2 * TTL_MS * 1000);
+	res = read(fd, buf, sizeof(buf));
+	if (res != 3 || memcmp(buf, "new", 3)){
+		printf("ttl: FAIL read \"%.*s\", expected \"new\"\n", res > 0 ? res : 0, buf);
+		goto restore;
+	}
+
+	/* Expired records go to dead letter channel */
+	memset(&dl, 0, sizeof(dl));
+	dl.channel = SBERTASK_CHAN_KEYED | DEAD_KEY;
+	dl.flags = SBERTASK_DEADLETTER_ON;
+	if (ioctl(fd, SBERTASK_IOC_SET_DEADLETTER, &dl)){
+		perror("SBERTASK_IOC_SET_DEADLETTER");
+		goto restore;
+	}
+	memset(&attach, 0, sizeof(attach));
+	attach.key = DEAD_KEY;
+	attach.flags = SBERTASK_ATTACH_FD;
+	dfd = ioctl(fd, SBERTASK_IOC_ATTACH, &attach);
+	if (dfd < 0){
+		perror("SBERTASK_IOC_ATTACH");
+		goto restore;
+	}
+	fcntl(dfd, F_SETFL, O_NONBLOCK);
+	while (read(dfd, buf, sizeof(buf)) > 0)
+		;
+	write(fd, "late", 4);
+	usleep(2 * TTL_MS * 1000);
+	res = read(fd, buf, sizeof(buf));
+	if (res != -1 || errno != EAGAIN){
+		printf("ttl: FAIL expired record was read\n");
+		goto restore;
+	}
+	res = read(dfd, buf, sizeof(buf));
+	if (res != 4 || memcmp(buf, "late", 4)){
+		printf("ttl: FAIL dead letter channel holds \"%.*s\", expected \"late\"\n", res > 0 ? res : 0, buf);
+		goto restore;
+	}
+	ioctl(fd, SBERTASK_IOC_GET_STATS, &after);
+	if (after.ttl_expired - before.ttl_expired != 2 || after.dead_letters - before.dead_letters != 1){
+		printf("ttl: FAIL ttl_expired %llu, dead_letters %llu, expected 2 and 1\n",
+		       (unsigned long long)(after.ttl_expired - before.ttl_expired),
+		       (unsigned long long)(after.dead_letters - before.dead_letters));
+		goto restore;
+	}
+	printf("ttl: OK\n");
+	ret = 0;
+restore:
+	if (dfd >= 0)
+		close(dfd);
+	memset(&dl, 0, sizeof(dl));
+	ioctl(fd, SBERTASK_IOC_SET_DEADLETTER, &dl);
+	ioctl(fd, SBERTASK_IOC_SET_CONFIG, &old);
+	close(fd);
+	return ret;
+}